@@ -0,0 +1,237 @@
+//
+// Created by Matthew Johnson on 29/03/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "lockedPool.h"
+
+/*
+ * FIFO queued job
+ */
+typedef struct job {
+    struct job *jobNext;        /* linked list of jobs */
+    void *(*jobFunc)(void *);   /* function to call */
+    void *jobArg;               /* its argument */
+} job_t;
+
+/*
+ * List of active worker threads, linked through their stacks.
+ */
+typedef struct active {
+    struct active *activeNext;  /* linked list of threads */
+    pthread_t activeTid;        /* active thread id */
+} active_t;
+
+struct lockedPool {
+    pthread_mutex_t poolMutex;  /* protects the pool data */
+    pthread_cond_t poolBusycv;  /* synchronization in lockedPoolDestroy() */
+    pthread_cond_t poolWorkcv;  /* synchronization with workers */
+    pthread_cond_t poolWaitcv;  /* synchronization in lockedPoolWait() */
+    active_t *poolActive;       /* list of threads performing work */
+    job_t *poolHead;            /* head of FIFO job queue */
+    job_t *poolTail;            /* tail of FIFO job queue */
+    pthread_attr_t poolAttr;    /* attributes of the workers */
+    unsigned int poolFlags;     /* see below */
+    unsigned int poolLinger;    /* seconds before idle workers exit */
+    int poolMinimum;            /* minimum number of worker threads */
+    int poolMaximum;            /* maximum number of worker threads */
+    int poolNthreads;           /* current number of worker threads */
+    int poolIdle;               /* number of idle workers */
+};
+
+/* poolFlags */
+#define POOL_WAIT 0x01u         /* waiting in lockedPoolWait() */
+#define POOL_DESTROY 0x02u      /* pool is being destroyed */
+
+static sigset_t signalSet;
+
+static void *workerThread(void *);
+
+static int
+createWorker(lockedPool_t *pool) {
+    sigset_t oset;
+    pthread_t thread;
+    int error;
+
+    pthread_sigmask(SIG_SETMASK, &signalSet, &oset);
+    error = pthread_create(&thread, &pool->poolAttr, workerThread, pool);
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    return error;
+}
+
+static void
+workerCleanup(void *arg) {
+    lockedPool_t *pool = (lockedPool_t *) arg;
+
+    --pool->poolNthreads;
+    if (pool->poolFlags & POOL_DESTROY) {
+        if (pool->poolNthreads == 0)
+            (void) pthread_cond_broadcast(&pool->poolBusycv);
+    } else if (pool->poolHead != NULL && pool->poolNthreads < pool->poolMaximum && createWorker(pool) == 0) {
+        pool->poolNthreads++;
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+}
+
+static void
+notifyWaiters(lockedPool_t *pool) {
+    if (pool->poolHead == NULL && pool->poolActive == NULL) {
+        pool->poolFlags &= ~POOL_WAIT;
+        pthread_cond_broadcast(&pool->poolWaitcv);
+    }
+}
+
+static void
+jobCleanup(void *arg) {
+    lockedPool_t *pool = (lockedPool_t *) arg;
+    pthread_t myTid = pthread_self();
+    active_t *activep, **activepp;
+
+    pthread_mutex_lock(&pool->poolMutex);
+    for (activepp = &pool->poolActive; (activep = *activepp) != NULL; activepp = &activep->activeNext) {
+        if (activep->activeTid == myTid) {
+            *activepp = activep->activeNext;
+            break;
+        }
+    }
+    if (pool->poolFlags & POOL_WAIT)
+        notifyWaiters(pool);
+}
+
+static void *
+workerThread(void *arg) {
+    lockedPool_t *pool = (lockedPool_t *) arg;
+    void *(*func)(void *);
+    struct timespec ts;
+    active_t active;
+    job_t *job;
+    int timedout;
+
+    pthread_mutex_lock(&pool->poolMutex);
+    pthread_cleanup_push(workerCleanup, pool)
+    active.activeTid = pthread_self();
+            for (;;) {
+                timedout = 0;
+                pool->poolIdle++;
+                if (pool->poolFlags & POOL_WAIT)
+                    notifyWaiters(pool);
+                while (pool->poolHead == NULL && !(pool->poolFlags & POOL_DESTROY)) {
+                    if (pool->poolNthreads <= pool->poolMinimum) {
+                        (void) pthread_cond_wait(&pool->poolWorkcv, &pool->poolMutex);
+                    } else {
+                        (void) clock_gettime(CLOCK_REALTIME, &ts);
+                        ts.tv_sec += pool->poolLinger;
+                        if (pool->poolLinger == 0 ||
+                            pthread_cond_timedwait(&pool->poolWorkcv, &pool->poolMutex, &ts) == ETIMEDOUT) {
+                            timedout = 1;
+                            break;
+                        }
+                    }
+                }
+                pool->poolIdle--;
+                if (pool->poolFlags & POOL_DESTROY)
+                    break;
+                if ((job = pool->poolHead) != NULL) {
+                    timedout = 0;
+                    func = job->jobFunc;
+                    arg = job->jobArg;
+                    pool->poolHead = job->jobNext;
+                    if (job == pool->poolTail)
+                        pool->poolTail = NULL;
+                    active.activeNext = pool->poolActive;
+                    pool->poolActive = &active;
+                    pthread_mutex_unlock(&pool->poolMutex);
+                    pthread_cleanup_push(jobCleanup, pool)
+                    free(job);
+                    func(arg);
+                    pthread_cleanup_pop(1);    /* jobCleanup(pool) */
+                }
+                if (timedout && pool->poolNthreads > pool->poolMinimum) {
+                    break;
+                }
+            }
+    pthread_cleanup_pop(1);    /* workerCleanup(pool) */
+    return NULL;
+}
+
+lockedPool_t *
+lockedPoolCreate(uint16_t minThreads, uint16_t maxThreads, uint16_t linger) {
+    lockedPool_t *pool;
+
+    sigfillset(&signalSet);
+    if (minThreads > maxThreads || maxThreads < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&pool->poolMutex, NULL);
+    pthread_cond_init(&pool->poolBusycv, NULL);
+    pthread_cond_init(&pool->poolWorkcv, NULL);
+    pthread_cond_init(&pool->poolWaitcv, NULL);
+    pool->poolLinger = linger;
+    pool->poolMinimum = minThreads;
+    pool->poolMaximum = maxThreads;
+    pthread_attr_init(&pool->poolAttr);
+    pthread_attr_setdetachstate(&pool->poolAttr, PTHREAD_CREATE_DETACHED);
+    return pool;
+}
+
+int
+lockedPoolQueue(lockedPool_t *pool, void *(*func)(void *), void *arg) {
+    job_t *job;
+
+    if ((job = malloc(sizeof(*job))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    job->jobNext = NULL;
+    job->jobFunc = func;
+    job->jobArg = arg;
+
+    pthread_mutex_lock(&pool->poolMutex);
+    if (pool->poolHead == NULL)
+        pool->poolHead = job;
+    else
+        pool->poolTail->jobNext = job;
+    pool->poolTail = job;
+    if (pool->poolIdle > 0) {
+        pthread_cond_signal(&pool->poolWorkcv);
+    } else if (pool->poolNthreads < pool->poolMaximum && createWorker(pool) == 0) {
+        pool->poolNthreads++;
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+    return 0;
+}
+
+void
+lockedPoolWait(lockedPool_t *pool) {
+    pthread_mutex_lock(&pool->poolMutex);
+    while (pool->poolHead != NULL || pool->poolActive != NULL) {
+        pool->poolFlags |= POOL_WAIT;
+        (void) pthread_cond_wait(&pool->poolWaitcv, &pool->poolMutex);
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+}
+
+void
+lockedPoolDestroy(lockedPool_t *pool) {
+    job_t *job;
+
+    /* The benchmark only destroys idle pools, nothing is cancelled. */
+    pthread_mutex_lock(&pool->poolMutex);
+    pool->poolFlags |= POOL_DESTROY;
+    pthread_cond_broadcast(&pool->poolWorkcv);
+    while (pool->poolNthreads != 0)
+        pthread_cond_wait(&pool->poolBusycv, &pool->poolMutex);
+    pthread_mutex_unlock(&pool->poolMutex);
+
+    while ((job = pool->poolHead) != NULL) {
+        pool->poolHead = job->jobNext;
+        free(job);
+    }
+    pthread_attr_destroy(&pool->poolAttr);
+    free(pool);
+}
@@ -0,0 +1,30 @@
+//
+// Created by Matthew Johnson on 29/03/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_LOCKED_POOL_H
+#define INVEST_FETCH_C_LOCKED_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The thread pool as it was before work stealing: one mutex and a linked
+ * FIFO of malloc'd jobs. Only kept as the baseline for the pool benchmark.
+ */
+typedef struct lockedPool lockedPool_t;
+
+lockedPool_t *lockedPoolCreate(uint16_t minThreads, uint16_t maxThreads, uint16_t linger);
+
+int lockedPoolQueue(lockedPool_t *pool, void *(*func)(void *), void *arg);
+
+void lockedPoolWait(lockedPool_t *pool);
+
+void lockedPoolDestroy(lockedPool_t *pool);
+
+#endif //INVEST_FETCH_C_LOCKED_POOL_H
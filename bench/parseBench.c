@@ -0,0 +1,278 @@
+//
+// Created by Matthew Johnson on 28/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/nzx/priceHandler.h"
+#include "../src/threading/threadPool.h"
+
+/*
+ * Parse throughput of the pool with and without its workers placed.
+ * A synthetic market board is built once and every job parses it with
+ * nzxExtractMarketPrices(), the same work the price fetch does on each
+ * download. The pool is run unpinned and then with thrPoolPlace(), each
+ * job notes whether its worker moved CPU part way through the parse.
+ * Placement only shows on a host with more than one CPU, and more than
+ * one NUMA node for scatter to differ from compact.
+ *  usage: parse_bench [boards] [rows per board] [workers]
+ */
+
+/* One of the placements under test, unplaced skips thrPoolPlace(). */
+typedef struct benchPlace {
+    const char *name;
+    int placed;
+    thrPlacement_t placement;
+} benchPlace_t;
+
+typedef struct parseJob {
+    const memoryChunk_t *board;
+    int64_t nanos;              /* spent parsing */
+    int moved;                  /* worker changed CPU during the parse */
+    int rows;
+} parseJob_t;
+
+static atomic_long completed;
+
+/*
+ * Stand ins for the storage thread, the parse never stores anything but
+ * priceHandler.c has to link.
+ */
+struct storageBatch {
+    int unused;
+};
+
+storageBatch_t *
+storageBatchCreate(const char *name) {
+    (void) name;
+    errno = ENOSYS;
+    return NULL;
+}
+
+int
+storageBatchAdd(storageBatch_t *batch, const char *command, int nParams, const char *const *values,
+                const int *lengths, const int *formats, storageResultFunc onResult, void *resultArg) {
+    (void) batch;
+    (void) command;
+    (void) nParams;
+    (void) values;
+    (void) lengths;
+    (void) formats;
+    (void) onResult;
+    (void) resultArg;
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+storageBatchAutocommit(storageBatch_t *batch) {
+    (void) batch;
+}
+
+void
+storageBatchAfterDurable(storageBatch_t *batch) {
+    (void) batch;
+}
+
+void
+storageBatchFree(storageBatch_t *batch) {
+    free(batch);
+}
+
+int
+storageSubmit(storageBatch_t *batch, storageDoneFunc done, void *arg) {
+    free(batch);
+    if (done != NULL) {
+        done(NULL, -1, arg);
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+storageSubmitDurable(storageBatch_t *batch) {
+    free(batch);
+    errno = ENOSYS;
+    return -1;
+}
+
+static const benchPlace_t places[] = {
+        {"unplaced", 0, THR_PLACE_NONE},
+        {"compact",  1, THR_PLACE_COMPACT},
+        {"scatter",  1, THR_PLACE_SCATTER},
+};
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int64_t
+nowNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compareSamples(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const int64_t *sorted, long count, double share) {
+    long i = (long) (share * (double) (count - 1));
+
+    return (double) sorted[i] / 1000.0;
+}
+
+/* Rows laid out like the board's, with the cells the parse skips over. */
+static memoryChunk_t *
+buildBoard(int rows) {
+    static const char *const head = "<html><body><table class=\"table\"><thead><tr><th>Code</th>"
+                                    "<th>Price</th></tr></thead>\n<tbody>\n";
+    static const char *const row = "<tr class=\"\" title=\"B%03d\">\n"
+                                   "  <td data-title=\"Code\"><a href=\"/markets/NZSX/securities/B%03d\">"
+                                   "B%03d</a></td>\n"
+                                   "  <td class=\"text-right\" data-title=\"Price\">\n      $%d.%02d\n  </td>\n"
+                                   "  <td class=\"text-right\" data-title=\"Change\">\n      +0.00%%\n  </td>\n"
+                                   "  <td class=\"text-right\" data-title=\"Volume\">\n      %d\n  </td>\n"
+                                   "</tr>\n";
+    memoryChunk_t *chunk;
+    size_t used, cap;
+    int i;
+
+    if ((chunk = calloc(1, sizeof(memoryChunk_t))) == NULL) {
+        return NULL;
+    }
+    cap = strlen(head) + (size_t) rows * 512 + 64;
+    if ((chunk->memory = malloc(cap)) == NULL) {
+        free(chunk);
+        return NULL;
+    }
+    used = (size_t) snprintf(chunk->memory, cap, "%s", head);
+    for (i = 0; i < rows; i++) {
+        used += (size_t) snprintf(chunk->memory + used, cap - used, row, i % 1000, i % 1000, i % 1000,
+                                  i % 50, i % 100, i * 37);
+    }
+    used += (size_t) snprintf(chunk->memory + used, cap - used, "</tbody></table></body></html>");
+    chunk->size = used;
+    clock_gettime(CLOCK_REALTIME, &chunk->fetched);
+    return chunk;
+}
+
+static void *
+parseJob(void *arg) {
+    parseJob_t *job = (parseJob_t *) arg;
+    nzxNode_t *head = NULL;
+    int64_t start;
+    int cpu;
+
+    cpu = sched_getcpu();
+    start = nowNs();
+    /* The parse only reads the board, the jobs can share one. */
+    nzxExtractMarketPrices((memoryChunk_t *) job->board, &head);
+    job->nanos = nowNs() - start;
+    job->moved = sched_getcpu() != cpu;
+    job->rows = nzxListingsCount(head);
+    nzxDrainListings(&head);
+    atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+    return NULL;
+}
+
+static int
+run(const benchPlace_t *place, const memoryChunk_t *board, long boards, int rows, uint16_t workers) {
+    threadPool_t *pool;
+    parseJob_t *jobs;
+    int64_t *samples;
+    double start, finished;
+    long failed = 0, moved = 0, i;
+
+    if ((pool = thrPoolCreate(workers, workers, 0, NULL)) == NULL) {
+        perror(place->name);
+        return -1;
+    }
+    if (place->placed && thrPoolPlace(pool, place->placement, NULL, 0) == -1) {
+        perror(place->name);
+        thrPoolDestroy(pool);
+        return -1;
+    }
+    jobs = calloc((size_t) boards, sizeof(*jobs));
+    samples = malloc((size_t) boards * sizeof(*samples));
+    if (jobs == NULL || samples == NULL) {
+        free(jobs);
+        free(samples);
+        thrPoolDestroy(pool);
+        return -1;
+    }
+    atomic_store(&completed, 0);
+    start = now();
+    for (i = 0; i < boards; i++) {
+        jobs[i].board = board;
+        if (thrPoolQueue(pool, parseJob, &jobs[i]) == -1) {
+            jobs[i].rows = -1;
+        }
+    }
+    thrPoolWait(pool);
+    finished = now() - start;
+    thrPoolDestroy(pool);
+
+    for (i = 0; i < boards; i++) {
+        if (jobs[i].rows != rows)
+            failed++;
+        moved += jobs[i].moved;
+        samples[i] = jobs[i].nanos;
+    }
+    free(jobs);
+
+    qsort(samples, (size_t) boards, sizeof(*samples), compareSamples);
+    printf("%-10s %10.0f %9.1f %9.1f %9.1f %9.1f %7ld %7ld\n", place->name, (double) boards / finished,
+           (double) board->size * (double) boards / finished / 1e6, percentile(samples, boards, 0.5),
+           percentile(samples, boards, 0.99), percentile(samples, boards, 0.999), moved, failed);
+    free(samples);
+    return failed == 0 && atomic_load(&completed) == boards ? 0 : -1;
+}
+
+int
+main(int argc, char **argv) {
+    long boards = argc > 1 ? atol(argv[1]) : 20000;
+    int rows = argc > 2 ? atoi(argv[2]) : 200;
+    long workers = argc > 3 ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    memoryChunk_t *board;
+    int status = 0;
+    size_t i;
+
+    if (boards < 1 || rows < 1 || workers < 1 || workers > UINT16_MAX) {
+        fprintf(stderr, "usage: %s [boards] [rows per board] [workers]\n", argv[0]);
+        return 2;
+    }
+    if ((board = buildBoard(rows)) == NULL) {
+        perror("board");
+        return 1;
+    }
+    printf("%ld boards x %d rows (%zu bytes), %ld workers\n", boards, rows, board->size, workers);
+    printf("%-10s %10s %9s %9s %9s %9s %7s %7s\n", "placement", "parses/s", "MB/s", "p50 us", "p99 us",
+           "p99.9 us", "moved", "failed");
+    for (i = 0; i < sizeof(places) / sizeof(places[0]); i++) {
+        if (run(&places[i], board, boards, rows, (uint16_t) workers) == -1)
+            status = 1;
+    }
+    free(board->memory);
+    free(board);
+    return status;
+}
@@ -0,0 +1,249 @@
+//
+// Created by Matthew Johnson on 28/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/threading/threadPool.h"
+#include "lockedPool.h"
+
+/*
+ * Contention benchmark for the thread pool against the single lock FIFO
+ * it replaced. Producer threads queue empty jobs as fast as they can and
+ * the pool is waited on once they are all in. Every job records how long
+ * it sat in the queue and the heap calls made while the pools run are
+ * counted, malloc and friends are wrapped at link time (see CMakeLists.txt).
+ *  usage: pool_bench [producers] [jobs per producer] [workers]
+ */
+
+/* One of the pools under test. */
+typedef struct benchPool {
+    const char *name;
+    void *(*create)(uint16_t workers);
+    int (*queue)(void *pool, void *(*func)(void *), void *arg);
+    void (*wait)(void *pool);
+    void (*destroy)(void *pool);
+} benchPool_t;
+
+typedef struct producer {
+    pthread_t thread;
+    const benchPool_t *kind;
+    void *pool;
+    long jobs;
+    int64_t *samples;           /* submit time, then queue latency of each job */
+    double seconds;             /* spent queueing its jobs */
+    long failed;
+} producer_t;
+
+static atomic_long completed;
+static atomic_long heapCalls;
+static pthread_barrier_t startLine;
+
+void *__real_malloc(size_t size);
+
+void *__real_calloc(size_t count, size_t size);
+
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&heapCalls, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&heapCalls, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&heapCalls, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+static void *
+stealCreate(uint16_t workers) {
+    return thrPoolCreate(workers, workers, 0, NULL);
+}
+
+static int
+stealQueue(void *pool, void *(*func)(void *), void *arg) {
+    return thrPoolQueue((threadPool_t *) pool, func, arg);
+}
+
+static void
+stealWait(void *pool) {
+    thrPoolWait((threadPool_t *) pool);
+}
+
+static void
+stealDestroy(void *pool) {
+    thrPoolDestroy((threadPool_t *) pool);
+}
+
+static void *
+lockedCreate(uint16_t workers) {
+    return lockedPoolCreate(workers, workers, 0);
+}
+
+static int
+lockedQueue(void *pool, void *(*func)(void *), void *arg) {
+    return lockedPoolQueue((lockedPool_t *) pool, func, arg);
+}
+
+static void
+lockedWait(void *pool) {
+    lockedPoolWait((lockedPool_t *) pool);
+}
+
+static void
+lockedDestroy(void *pool) {
+    lockedPoolDestroy((lockedPool_t *) pool);
+}
+
+static const benchPool_t pools[] = {
+        {"locked fifo",   lockedCreate, lockedQueue, lockedWait, lockedDestroy},
+        {"work stealing", stealCreate,  stealQueue,  stealWait,  stealDestroy},
+};
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int64_t
+nowNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compareSamples(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const int64_t *sorted, long count, double share) {
+    long i = (long) (share * (double) (count - 1));
+
+    return (double) sorted[i] / 1000.0;
+}
+
+static void *
+emptyJob(void *arg) {
+    int64_t *sample = (int64_t *) arg;
+
+    *sample = nowNs() - *sample;
+    atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+    return NULL;
+}
+
+static void *
+produce(void *arg) {
+    producer_t *producer = (producer_t *) arg;
+    double start;
+    long i;
+
+    pthread_barrier_wait(&startLine);
+    start = now();
+    for (i = 0; i < producer->jobs; i++) {
+        producer->samples[i] = nowNs();
+        if (producer->kind->queue(producer->pool, emptyJob, &producer->samples[i]) == -1) {
+            producer->samples[i] = 0;
+            producer->failed++;
+        }
+    }
+    producer->seconds = now() - start;
+    return NULL;
+}
+
+static int
+run(const benchPool_t *kind, int producers, long jobs, uint16_t workers) {
+    producer_t *producer;
+    int64_t *samples;
+    double start, submitted = 0, finished;
+    long failed = 0, total = (long) producers * jobs, heap;
+    void *pool;
+    int i;
+
+    if ((pool = kind->create(workers)) == NULL) {
+        perror(kind->name);
+        return -1;
+    }
+    producer = calloc((size_t) producers, sizeof(*producer));
+    samples = malloc((size_t) total * sizeof(*samples));
+    if (producer == NULL || samples == NULL) {
+        free(producer);
+        free(samples);
+        kind->destroy(pool);
+        return -1;
+    }
+    atomic_store(&completed, 0);
+    pthread_barrier_init(&startLine, NULL, (unsigned) producers + 1);
+    for (i = 0; i < producers; i++) {
+        producer[i].kind = kind;
+        producer[i].pool = pool;
+        producer[i].jobs = jobs;
+        producer[i].samples = samples + (long) i * jobs;
+        pthread_create(&producer[i].thread, NULL, produce, &producer[i]);
+    }
+    /* Producers hold at the barrier, their own setup is not counted. */
+    atomic_store(&heapCalls, 0);
+    pthread_barrier_wait(&startLine);
+    start = now();
+    for (i = 0; i < producers; i++) {
+        pthread_join(producer[i].thread, NULL);
+        if (producer[i].seconds > submitted)
+            submitted = producer[i].seconds;
+        failed += producer[i].failed;
+    }
+    kind->wait(pool);
+    finished = now() - start;
+    heap = atomic_load(&heapCalls);
+    pthread_barrier_destroy(&startLine);
+    kind->destroy(pool);
+    free(producer);
+
+    qsort(samples, (size_t) total, sizeof(*samples), compareSamples);
+    printf("%-14s %12.0f %12.0f %9.1f %9.1f %9.1f %8.2f %7ld\n", kind->name, (double) total / submitted,
+           (double) total / finished, percentile(samples, total, 0.5), percentile(samples, total, 0.99),
+           percentile(samples, total, 0.999), (double) heap / (double) total, failed);
+    free(samples);
+    return failed == 0 && atomic_load(&completed) == total ? 0 : -1;
+}
+
+int
+main(int argc, char **argv) {
+    int producers = argc > 1 ? atoi(argv[1]) : 4;
+    long jobs = argc > 2 ? atol(argv[2]) : 200000;
+    long workers = argc > 3 ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int status = 0;
+    size_t i;
+
+    if (producers < 1 || jobs < 1 || workers < 1 || workers > UINT16_MAX) {
+        fprintf(stderr, "usage: %s [producers] [jobs per producer] [workers]\n", argv[0]);
+        return 2;
+    }
+    printf("%d producers x %ld jobs, %ld workers\n", producers, jobs, workers);
+    printf("%-14s %12s %12s %9s %9s %9s %8s %7s\n", "pool", "submit/s", "complete/s", "p50 us", "p99 us",
+           "p99.9 us", "heap/job", "failed");
+    for (i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        if (run(&pools[i], producers, jobs, (uint16_t) workers) == -1)
+            status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,36 @@
+-- Base schema for the tables written by invest-fetch-c.
+CREATE EXTENSION IF NOT EXISTS timescaledb;
+
+CREATE SCHEMA IF NOT EXISTS nzx;
+
+CREATE TABLE IF NOT EXISTS nzx.listings
+(
+    code         text PRIMARY KEY,
+    company      text,
+    eps          real,
+    nta          real,
+    gdy          real,
+    volume       bigint,
+    si           bigint,
+    update       boolean NOT NULL DEFAULT true,
+    last_updated timestamptz
+);
+
+CREATE TABLE IF NOT EXISTS nzx.prices
+(
+    time  timestamptz NOT NULL,
+    code  text        NOT NULL,
+    price real
+);
+
+-- One board a minute for about 300 codes over a seven hour trading day is
+-- around 125 thousand rows a day, 2.5 million a month. A week per chunk
+-- keeps a chunk near 600 thousand rows so the open one and its index stay
+-- in memory.
+SELECT create_hypertable('nzx.prices', 'time',
+                         chunk_time_interval => INTERVAL '7 days',
+                         if_not_exists => TRUE);
+
+-- Spooled batches are replayed at least once, this lets repeats be ignored.
+CREATE UNIQUE INDEX IF NOT EXISTS prices_code_time_idx
+    ON nzx.prices (code, time DESC);
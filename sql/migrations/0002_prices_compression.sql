@@ -0,0 +1,11 @@
+-- Compress closed chunks per code, queries are almost always for a single code.
+ALTER TABLE nzx.prices SET (
+    timescaledb.compress,
+    timescaledb.compress_segmentby = 'code',
+    timescaledb.compress_orderby = 'time DESC'
+    );
+
+SELECT add_compression_policy('nzx.prices', INTERVAL '60 days', if_not_exists => TRUE);
+
+-- Raw ticks are only kept for ten years.
+SELECT add_retention_policy('nzx.prices', INTERVAL '10 years', if_not_exists => TRUE);
@@ -0,0 +1,88 @@
+-- OHLC bars at 1m, 15m, 1h and 1d. Each level is built from the one below
+-- it so a refresh only reads the next finer level, never the raw ticks.
+-- VWAP is left out until the board's volume is stored with the price.
+-- All four use real-time aggregation, the buckets newer than the last
+-- refresh are computed from the level below when queried.
+
+-- Replaced by nzx.prices_1h.
+DROP MATERIALIZED VIEW IF EXISTS nzx.price_daily;
+
+CREATE MATERIALIZED VIEW IF NOT EXISTS nzx.prices_1m
+    WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT time_bucket(INTERVAL '1 minute', time) AS bucket,
+       code,
+       first(price, time)                     AS open,
+       max(price)                             AS high,
+       min(price)                             AS low,
+       last(price, time)                      AS close,
+       count(*)                               AS ticks
+FROM nzx.prices
+GROUP BY time_bucket(INTERVAL '1 minute', time), code
+WITH NO DATA;
+
+CREATE MATERIALIZED VIEW IF NOT EXISTS nzx.prices_15m
+    WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT time_bucket(INTERVAL '15 minutes', bucket) AS bucket,
+       code,
+       first(open, bucket)                        AS open,
+       max(high)                                  AS high,
+       min(low)                                   AS low,
+       last(close, bucket)                        AS close,
+       sum(ticks)::bigint                         AS ticks
+FROM nzx.prices_1m
+GROUP BY time_bucket(INTERVAL '15 minutes', bucket), code
+WITH NO DATA;
+
+CREATE MATERIALIZED VIEW IF NOT EXISTS nzx.prices_1h
+    WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT time_bucket(INTERVAL '1 hour', bucket) AS bucket,
+       code,
+       first(open, bucket)                    AS open,
+       max(high)                              AS high,
+       min(low)                               AS low,
+       last(close, bucket)                    AS close,
+       sum(ticks)::bigint                     AS ticks
+FROM nzx.prices_15m
+GROUP BY time_bucket(INTERVAL '1 hour', bucket), code
+WITH NO DATA;
+
+-- Trading days are NZ days, not UTC ones.
+CREATE MATERIALIZED VIEW IF NOT EXISTS nzx.prices_1d
+    WITH (timescaledb.continuous, timescaledb.materialized_only = false) AS
+SELECT time_bucket(INTERVAL '1 day', bucket, 'Pacific/Auckland') AS bucket,
+       code,
+       first(open, bucket)                                       AS open,
+       max(high)                                                 AS high,
+       min(low)                                                  AS low,
+       last(close, bucket)                                       AS close,
+       sum(ticks)::bigint                                        AS ticks
+FROM nzx.prices_1h
+GROUP BY time_bucket(INTERVAL '1 day', bucket, 'Pacific/Auckland'), code
+WITH NO DATA;
+
+-- The ingest path refreshes the buckets each price batch lands in, these
+-- catch anything it missed (e.g. spooled batches replayed late). Every
+-- level runs after the one below it has had a chance to.
+SELECT add_continuous_aggregate_policy('nzx.prices_1m',
+                                       start_offset => INTERVAL '2 hours',
+                                       end_offset => INTERVAL '1 minute',
+                                       schedule_interval => INTERVAL '5 minutes',
+                                       if_not_exists => TRUE);
+
+SELECT add_continuous_aggregate_policy('nzx.prices_15m',
+                                       start_offset => INTERVAL '1 day',
+                                       end_offset => INTERVAL '15 minutes',
+                                       schedule_interval => INTERVAL '15 minutes',
+                                       if_not_exists => TRUE);
+
+SELECT add_continuous_aggregate_policy('nzx.prices_1h',
+                                       start_offset => INTERVAL '3 days',
+                                       end_offset => INTERVAL '1 hour',
+                                       schedule_interval => INTERVAL '1 hour',
+                                       if_not_exists => TRUE);
+
+SELECT add_continuous_aggregate_policy('nzx.prices_1d',
+                                       start_offset => INTERVAL '7 days',
+                                       end_offset => INTERVAL '1 day',
+                                       schedule_interval => INTERVAL '1 day',
+                                       if_not_exists => TRUE);
@@ -0,0 +1,20 @@
+-- Bars built in process as prices arrive, written once each has closed.
+CREATE TABLE IF NOT EXISTS nzx.bars
+(
+    time  timestamptz NOT NULL, -- start of the bar
+    code  text        NOT NULL,
+    width integer     NOT NULL, -- seconds
+    open  real,
+    high  real,
+    low   real,
+    close real,
+    ticks integer     NOT NULL
+);
+
+-- A handful of rows per code a day, a quarter per chunk is plenty.
+SELECT create_hypertable('nzx.bars', 'time',
+                         chunk_time_interval => INTERVAL '90 days',
+                         if_not_exists => TRUE);
+
+CREATE UNIQUE INDEX IF NOT EXISTS bars_code_width_time_idx
+    ON nzx.bars (code, width, time DESC);
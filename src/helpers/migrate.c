@@ -0,0 +1,150 @@
+//
+// Created by Matthew Johnson on 26/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "migrate.h"
+
+/* Held while migrating so only one process applies a migration. */
+#define MIGRATE_LOCK_ID "4242"
+
+static int
+execCommand(PGconn *conn, const char *command) {
+    PGresult *res = PQexec(conn, command);
+    int result = 0;
+
+    if (res == NULL || (PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK)) {
+        logError("Problem is: %s", PQerrorMessage(conn))
+        result = -1;
+    }
+    PQclear(res);
+    return result;
+}
+
+static char *
+readFile(const char *path) {
+    FILE *file;
+    char *data;
+    long len;
+
+    if ((file = fopen(path, "rb")) == NULL) {
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) == -1 || (len = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) == -1) {
+        fclose(file);
+        return NULL;
+    }
+    if ((data = malloc(len + 1)) == NULL) {
+        fclose(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (fread(data, 1, len, file) != (size_t) len) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    data[len] = '\0';
+    fclose(file);
+    return data;
+}
+
+static int
+isMigration(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    return len > 4 && strcmp(entry->d_name + len - 4, ".sql") == 0;
+}
+
+static int
+applied(PGconn *conn, const char *version) {
+    const char *const paramValues[1] = {version};
+    PGresult *res;
+    int found;
+
+    res = PQexecParams(conn, "SELECT 1 FROM public.schema_migrations WHERE version = $1;",
+                       1, NULL, paramValues, NULL, NULL, 0);
+    if (res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
+        logError("Problem is: %s", PQerrorMessage(conn))
+        PQclear(res);
+        return -1;
+    }
+    found = PQntuples(res) > 0;
+    PQclear(res);
+    return found;
+}
+
+static int
+applyMigration(PGconn *conn, const char *dir, const char *version) {
+    const char *const paramValues[1] = {version};
+    char path[1024];
+    char *sql;
+    PGresult *res;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, version);
+    if ((sql = readFile(path)) == NULL) {
+        logError("Could not read migration %s: %d", path, errno)
+        return -1;
+    }
+    if (execCommand(conn, "BEGIN;") == -1) {
+        free(sql);
+        return -1;
+    }
+    /* A file can hold many statements, they all run in this transaction. */
+    if (execCommand(conn, sql) == -1) {
+        logError("Migration %s failed.", version)
+        execCommand(conn, "ROLLBACK;");
+        free(sql);
+        return -1;
+    }
+    free(sql);
+    res = PQexecParams(conn, "INSERT INTO public.schema_migrations (version) VALUES ($1);",
+                       1, NULL, paramValues, NULL, NULL, 0);
+    if (res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK) {
+        logError("Problem is: %s", PQerrorMessage(conn))
+        PQclear(res);
+        execCommand(conn, "ROLLBACK;");
+        return -1;
+    }
+    PQclear(res);
+    if (execCommand(conn, "COMMIT;") == -1) {
+        return -1;
+    }
+    logInfo("Applied migration %s.", version)
+    return 0;
+}
+
+int
+migrateApply(const char *dir) {
+    struct dirent **entries;
+    PGconn *conn;
+    int i, n, found, count = 0;
+
+    if ((n = scandir(dir, &entries, isMigration, alphasort)) == -1) {
+        logWarn("No migrations found in %s.", dir)
+        return 0;
+    }
+    if ((conn = postgresConnect()) == NULL) {
+        logCrit("Could not connect to Postgres Server.")
+        count = -1;
+    } else if (execCommand(conn, "SELECT pg_advisory_lock(" MIGRATE_LOCK_ID ");") == -1 ||
+               execCommand(conn, "CREATE TABLE IF NOT EXISTS public.schema_migrations ("
+                                 "version text PRIMARY KEY, applied_at timestamptz NOT NULL DEFAULT now());") == -1) {
+        count = -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (count != -1) {
+            if ((found = applied(conn, entries[i]->d_name)) == -1) {
+                count = -1;
+            } else if (!found) {
+                count = applyMigration(conn, dir, entries[i]->d_name) == -1 ? -1 : count + 1;
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    if (conn) {
+        /* The lock is released with the session. */
+        PQfinish(conn);
+    }
+    return count;
+}
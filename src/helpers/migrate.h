@@ -0,0 +1,27 @@
+//
+// Created by Matthew Johnson on 26/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_MIGRATE_H
+#define INVEST_FETCH_C_MIGRATE_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <libpq-fe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "postgres.h"
+#include "../logging/logger.h"
+
+/*
+ * Apply every migration in dir that has not been applied yet, in file
+ * name order. Each *.sql file runs in its own transaction and is then
+ * recorded in public.schema_migrations. Returns the number applied or
+ * -1 on error, migrations after a failed one are not attempted.
+ */
+int migrateApply(const char *dir);
+
+#endif //INVEST_FETCH_C_MIGRATE_H
@@ -33,4 +33,43 @@ struct pg_conn *postgresConnect(void) {
     PQsetClientEncoding(conn, "UTF8");
 
     return conn;
-}
\ No newline at end of file
+}
+
+char *postgresTextArray(const char *const *values, int n) {
+    char *literal, *out;
+    const char *in;
+    size_t len;
+    int i;
+
+    /* Worst case every character needs escaping, plus quotes and a delimiter. */
+    len = 3;
+    for (i = 0; i < n; i++) {
+        len += values[i] ? (strlen(values[i]) * 2) + 3 : sizeof("NULL,");
+    }
+    if ((literal = malloc(len)) == NULL) {
+        return NULL;
+    }
+    out = literal;
+    *out++ = '{';
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            *out++ = ',';
+        }
+        if (values[i] == NULL) {
+            memcpy(out, "NULL", 4);
+            out += 4;
+            continue;
+        }
+        *out++ = '"';
+        for (in = values[i]; *in; in++) {
+            if (*in == '"' || *in == '\\') {
+                *out++ = '\\';
+            }
+            *out++ = *in;
+        }
+        *out++ = '"';
+    }
+    *out++ = '}';
+    *out = '\0';
+    return literal;
+}
@@ -8,7 +8,16 @@
 
 #include <libpq-fe.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 struct pg_conn *postgresConnect(void);
 
+/*
+ * Build a text format array literal, e.g. {"a","b"}, from n strings.
+ * NULL entries are written as NULL elements. Returns a malloc'd string
+ * that the caller must free, or NULL if out of memory.
+ */
+char *postgresTextArray(const char *const *values, int n);
+
 #endif //INVEST_FETCH_C_POSTGRES_H
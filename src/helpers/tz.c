@@ -0,0 +1,413 @@
+//
+// Created by Matthew Johnson on 22/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "tz.h"
+
+#define TZ_DEFAULT_DIR "/usr/share/zoneinfo"
+#define TZ_HEADER_LEN 44
+#define TZ_DAY 86400
+
+/*
+ * When a POSIX TZ rule switches to or from daylight time, e.g. M9.5.0/2
+ */
+typedef struct tzRule {
+    char kind;              /* 'J' day 1-365 without Feb 29, 'D' day 0-365, 'M' month.week.day */
+    int day;                /* day of the year, or day of the week (0 Sunday) for 'M' */
+    int week;               /* 1-5, 5 is the last */
+    int month;              /* 1-12 */
+    int32_t time;           /* seconds after local midnight */
+} tzRule_t;
+
+struct tzZone {
+    tzZone_t *next;         /* linked list of loaded zones */
+    char *name;             /* IANA name */
+    int nTransitions;       /* entries in the tables below */
+    int64_t *transitions;   /* UTC instants, ascending */
+    int32_t *offsets;       /* offset in effect from each transition */
+    int32_t initial;        /* offset before the first transition */
+    int hasFooter;          /* the rule below applies past the last transition */
+    int hasDst;             /* the rule has a daylight time */
+    int32_t stdOffset;      /* standard time offset from the footer */
+    int32_t dstOffset;      /* daylight time offset from the footer */
+    tzRule_t start;         /* daylight time starts, in standard time */
+    tzRule_t end;           /* daylight time ends, in daylight time */
+};
+
+/* Zones are never freed once loaded. */
+static tzZone_t *tzZones = NULL;
+static pthread_mutex_t tzLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int32_t
+readInt32(const uint8_t *p) {
+    return (int32_t) ((uint32_t) p[0] << 24u | (uint32_t) p[1] << 16u | (uint32_t) p[2] << 8u | p[3]);
+}
+
+static inline int64_t
+readInt64(const uint8_t *p) {
+    return (int64_t) ((uint64_t) (uint32_t) readInt32(p) << 32u | (uint32_t) readInt32(p + 4));
+}
+
+/*
+ * Skip a zone abbreviation, either alphabetic or quoted in <>.
+ */
+static const char *
+parseAbbreviation(const char *p) {
+    const char *start = p;
+
+    if (*p == '<') {
+        while (*p != '\0' && *p != '>') {
+            p++;
+        }
+        return *p == '>' ? p + 1 : NULL;
+    }
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')) {
+        p++;
+    }
+    return p - start >= 3 ? p : NULL;
+}
+
+/*
+ * Parse [+-]hh[:mm[:ss]] into seconds, hours can go up to 167 in rule times.
+ */
+static const char *
+parseTime(const char *p, int32_t *seconds) {
+    int32_t sign = 1, parts[3] = {0, 0, 0};
+    int i;
+
+    if (*p == '+' || *p == '-') {
+        sign = *p++ == '-' ? -1 : 1;
+    }
+    for (i = 0; i < 3; i++) {
+        if (*p < '0' || *p > '9') {
+            return NULL;
+        }
+        while (*p >= '0' && *p <= '9') {
+            parts[i] = parts[i] * 10 + (*p++ - '0');
+            if (parts[i] > 167) {
+                return NULL;
+            }
+        }
+        if (*p != ':') {
+            break;
+        }
+        p++;
+    }
+    *seconds = sign * (parts[0] * 3600 + parts[1] * 60 + parts[2]);
+    return p;
+}
+
+static const char *
+parseNumber(const char *p, int *value, int min, int max) {
+    if (*p < '0' || *p > '9') {
+        return NULL;
+    }
+    for (*value = 0; *p >= '0' && *p <= '9' && *value <= max; p++) {
+        *value = *value * 10 + (*p - '0');
+    }
+    return *value >= min && *value <= max ? p : NULL;
+}
+
+static const char *
+parseRule(const char *p, tzRule_t *rule) {
+    if (*p == 'M') {
+        rule->kind = 'M';
+        if ((p = parseNumber(p + 1, &rule->month, 1, 12)) == NULL || *p != '.' ||
+            (p = parseNumber(p + 1, &rule->week, 1, 5)) == NULL || *p != '.' ||
+            (p = parseNumber(p + 1, &rule->day, 0, 6)) == NULL) {
+            return NULL;
+        }
+    } else if (*p == 'J') {
+        rule->kind = 'J';
+        if ((p = parseNumber(p + 1, &rule->day, 1, 365)) == NULL) {
+            return NULL;
+        }
+    } else {
+        rule->kind = 'D';
+        if ((p = parseNumber(p, &rule->day, 0, 365)) == NULL) {
+            return NULL;
+        }
+    }
+    rule->time = 2 * 3600;
+    if (*p == '/') {
+        p = parseTime(p + 1, &rule->time);
+    }
+    return p;
+}
+
+/*
+ * Parse the POSIX TZ string in a version 2+ footer, e.g.
+ * NZST-12NZDT,M9.5.0,M4.1.0/3. Offsets there count west of UTC.
+ * Without a usable rule the last transition is held instead.
+ */
+static void
+parseFooter(tzZone_t *zone, const char *p) {
+    int32_t offset;
+
+    if ((p = parseAbbreviation(p)) == NULL || (p = parseTime(p, &offset)) == NULL) {
+        return;
+    }
+    zone->stdOffset = -offset;
+    if (*p == '\0') {
+        zone->hasFooter = 1;
+        return;
+    }
+    if ((p = parseAbbreviation(p)) == NULL) {
+        return;
+    }
+    zone->dstOffset = zone->stdOffset + 3600;
+    if (*p != ',' && *p != '\0') {
+        if ((p = parseTime(p, &offset)) == NULL) {
+            return;
+        }
+        zone->dstOffset = -offset;
+    }
+    /* A daylight time without rules has no defined switch, hold the transitions. */
+    if (*p != ',' || (p = parseRule(p + 1, &zone->start)) == NULL ||
+        *p != ',' || (p = parseRule(p + 1, &zone->end)) == NULL || *p != '\0') {
+        return;
+    }
+    zone->hasDst = 1;
+    zone->hasFooter = 1;
+}
+
+/*
+ * Parse a TZif file. Version 2+ files repeat the data with 64 bit
+ * transition times after the version 1 block, that copy is preferred,
+ * and end with a POSIX TZ string for the times past the last transition.
+ * Slim files rely on it, they stop at the last change to the rules.
+ */
+static int
+parseZone(tzZone_t *zone, const uint8_t *data, size_t len) {
+    const uint8_t *p = data, *times, *idxs, *types, *footer, *footerEnd;
+    int32_t isUtc, isStd, leap, timeCnt, typeCnt, charCnt;
+    size_t timeSize = 4, blockLen;
+    char rule[128];
+    int i;
+
+    for (;;) {
+        if ((size_t) (p - data) + TZ_HEADER_LEN > len || memcmp(p, "TZif", 4) != 0) {
+            return -1;
+        }
+        isUtc = readInt32(p + 20);
+        isStd = readInt32(p + 24);
+        leap = readInt32(p + 28);
+        timeCnt = readInt32(p + 32);
+        typeCnt = readInt32(p + 36);
+        charCnt = readInt32(p + 40);
+        blockLen = timeCnt * timeSize + timeCnt + typeCnt * 6 + charCnt + leap * (timeSize + 4) + isStd + isUtc;
+        if (typeCnt < 1 || (size_t) (p - data) + TZ_HEADER_LEN + blockLen > len) {
+            return -1;
+        }
+        if (timeSize == 4 && p[4] >= '2') {
+            /* Skip to the 64 bit block. */
+            p += TZ_HEADER_LEN + blockLen;
+            timeSize = 8;
+            continue;
+        }
+        break;
+    }
+    times = p + TZ_HEADER_LEN;
+    idxs = times + timeCnt * timeSize;
+    types = idxs + timeCnt;
+
+    zone->nTransitions = timeCnt;
+    zone->transitions = malloc((timeCnt ? timeCnt : 1) * sizeof(int64_t));
+    zone->offsets = malloc((timeCnt ? timeCnt : 1) * sizeof(int32_t));
+    if (zone->transitions == NULL || zone->offsets == NULL) {
+        return -1;
+    }
+    for (i = 0; i < timeCnt; i++) {
+        if (idxs[i] >= typeCnt) {
+            return -1;
+        }
+        zone->transitions[i] = timeSize == 8 ? readInt64(times + i * 8) : readInt32(times + i * 4);
+        zone->offsets[i] = readInt32(types + idxs[i] * 6);
+    }
+    /* Before the first transition the first standard time type applies. */
+    zone->initial = readInt32(types);
+    for (i = 0; i < typeCnt; i++) {
+        if (types[i * 6 + 4] == 0) {
+            zone->initial = readInt32(types + i * 6);
+            break;
+        }
+    }
+
+    /* The footer is the TZ string between two newlines. */
+    footer = p + TZ_HEADER_LEN + blockLen;
+    if (timeSize == 8 && footer < data + len && *footer == '\n' &&
+        (footerEnd = memchr(footer + 1, '\n', data + len - footer - 1)) != NULL &&
+        (size_t) (footerEnd - footer - 1) < sizeof(rule)) {
+        memcpy(rule, footer + 1, footerEnd - footer - 1);
+        rule[footerEnd - footer - 1] = '\0';
+        parseFooter(zone, rule);
+    }
+    return 0;
+}
+
+static tzZone_t *
+readZone(const char *name) {
+    char path[512];
+    const char *dir;
+    uint8_t *data;
+    tzZone_t *zone;
+    FILE *file;
+    long len;
+
+    if ((dir = getenv("TZDIR")) == NULL) {
+        dir = TZ_DEFAULT_DIR;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((file = fopen(path, "rb")) == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = malloc(len > 0 ? len : 1);
+    if (len <= 0 || data == NULL || fread(data, 1, len, file) != (size_t) len) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    if ((zone = calloc(1, sizeof(tzZone_t))) != NULL &&
+        (parseZone(zone, data, len) == -1 || (zone->name = strdup(name)) == NULL)) {
+        free(zone->transitions);
+        free(zone->offsets);
+        free(zone);
+        zone = NULL;
+    }
+    free(data);
+    return zone;
+}
+
+tzZone_t *
+tzLoad(const char *name) {
+    tzZone_t *zone;
+
+    pthread_mutex_lock(&tzLock);
+    for (zone = tzZones; zone != NULL; zone = zone->next) {
+        if (strcmp(zone->name, name) == 0) {
+            break;
+        }
+    }
+    if (zone == NULL && (zone = readZone(name)) != NULL) {
+        zone->next = tzZones;
+        tzZones = zone;
+    }
+    pthread_mutex_unlock(&tzLock);
+    return zone;
+}
+
+static inline int
+isLeap(int64_t year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+/*
+ * Days from 1970-01-01 to the given date in the proleptic Gregorian calendar.
+ */
+static int64_t
+daysFromCivil(int64_t year, int month, int day) {
+    int64_t era, yoe, doy;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/*
+ * Local midnight the rule falls on in the given year, in days from the epoch.
+ */
+static int64_t
+ruleDay(const tzRule_t *rule, int64_t year) {
+    static const int monthDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int64_t first;
+    int day, length;
+
+    switch (rule->kind) {
+        case 'J':
+            return daysFromCivil(year, 1, 1) + rule->day - 1 + (isLeap(year) && rule->day >= 60);
+        case 'D':
+            return daysFromCivil(year, 1, 1) + rule->day;
+        default:
+            /* 1970-01-01 was a Thursday. */
+            first = daysFromCivil(year, rule->month, 1);
+            day = 1 + (int) ((rule->day - (first + 4) % 7 + 14) % 7) + (rule->week - 1) * 7;
+            length = monthDays[rule->month - 1] + (rule->month == 2 && isLeap(year));
+            while (day > length) {
+                day -= 7;
+            }
+            return first + day - 1;
+    }
+}
+
+/*
+ * Offset from the footer rule. Daylight time starts at a time given in
+ * standard time and ends at one given in daylight time.
+ */
+static long
+footerOffset(const tzZone_t *zone, int64_t utc) {
+    int64_t days, year, start, end;
+
+    if (!zone->hasDst) {
+        return zone->stdOffset;
+    }
+    /* The civil year of the local standard time. */
+    days = utc + zone->stdOffset;
+    days = (days >= 0 ? days : days - TZ_DAY + 1) / TZ_DAY;
+    for (year = 1970 + days / 366; daysFromCivil(year + 1, 1, 1) <= days; year++);
+    while (daysFromCivil(year, 1, 1) > days) {
+        year--;
+    }
+    start = ruleDay(&zone->start, year) * TZ_DAY + zone->start.time - zone->stdOffset;
+    end = ruleDay(&zone->end, year) * TZ_DAY + zone->end.time - zone->dstOffset;
+    /* In the southern hemisphere daylight time spans the new year. */
+    if (start < end) {
+        return utc >= start && utc < end ? zone->dstOffset : zone->stdOffset;
+    }
+    return utc >= end && utc < start ? zone->stdOffset : zone->dstOffset;
+}
+
+long
+tzOffset(const tzZone_t *zone, time_t utc) {
+    int low = 0, high = zone->nTransitions;
+
+    /* Past the last transition the footer rule applies, if there is one. */
+    if (zone->hasFooter && (high == 0 || (int64_t) utc >= zone->transitions[high - 1])) {
+        return footerOffset(zone, utc);
+    }
+    /* Find the first transition after utc, the one before it applies. */
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zone->transitions[mid] <= (int64_t) utc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low == 0 ? zone->initial : zone->offsets[low - 1];
+}
+
+time_t
+tzTruncate(const tzZone_t *zone, time_t utc, long seconds) {
+    long offset = tzOffset(zone, utc), earlier;
+    time_t local = utc + offset;
+
+    local -= ((local % seconds) + seconds) % seconds;
+    /*
+     * The offset can change between the start of the bucket and utc, e.g.
+     * midnight on a daylight saving day. Use the one in effect at the
+     * start, unless that local time was skipped over.
+     */
+    earlier = tzOffset(zone, local - offset);
+    if (earlier != offset && tzOffset(zone, local - earlier) == earlier) {
+        offset = earlier;
+    }
+    return local - offset;
+}
@@ -0,0 +1,41 @@
+//
+// Created by Matthew Johnson on 22/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_TZ_H
+#define INVEST_FETCH_C_TZ_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A time zone's UTC offset transitions, read from the system zoneinfo
+ * database (or TZDIR) once and cached for the life of the process.
+ */
+typedef struct tzZone tzZone_t;
+
+/*
+ * Load a zone by its IANA name, e.g. "Pacific/Auckland". Repeated calls
+ * with the same name return the cached zone. Returns NULL if the zone
+ * cannot be read.
+ */
+tzZone_t *tzLoad(const char *name);
+
+/*
+ * Seconds east of UTC in effect at the given instant.
+ */
+long tzOffset(const tzZone_t *zone, time_t utc);
+
+/*
+ * Round an instant down to a multiple of seconds in the zone's local time.
+ * The result uses the offset in effect at the start of the bucket, so a
+ * day bucket starts at local midnight on daylight saving days too.
+ */
+time_t tzTruncate(const tzZone_t *zone, time_t utc, long seconds);
+
+#endif //INVEST_FETCH_C_TZ_H
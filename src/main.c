@@ -6,10 +6,27 @@
 #include <curl/curl.h>
 #include "logging/logger.h"
 #include "redis/manager.h"
+#include "storage/storage.h"
+#include "helpers/migrate.h"
+
+#define MIGRATIONS_ENV "INVEST_MIGRATIONS"
+/* Set by the build to the source tree's migrations, see CMakeLists.txt. */
+#ifndef MIGRATIONS_DIR
+#define MIGRATIONS_DIR "sql/migrations"
+#endif
 
 int main() {
     curl_global_init(CURL_GLOBAL_NOTHING);
     loggerInit(0, DEBUG);
+    /* Not fatal, anything collected while Postgres is unavailable is spooled. */
+    if (migrateApply(getenv(MIGRATIONS_ENV) ? getenv(MIGRATIONS_ENV) : MIGRATIONS_DIR) == -1) {
+        logError("Could not apply the schema migrations.")
+    }
+    if (storageStart() == -1) {
+        logCrit("Could not start the storage thread.")
+        return 1;
+    }
     managerStreamTasks();
+    storageStop();
     curl_global_cleanup();
 }
\ No newline at end of file
@@ -0,0 +1,443 @@
+//
+// Created by Matthew Johnson on 28/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "bars.h"
+
+#define NZX_BAR_WIDTHS_ENV "NZX_BAR_WIDTHS"
+#define NZX_BAR_WIDTHS "60,900,3600,86400"
+#define NZX_BAR_MAX_WIDTHS 8
+/* time, code, width, open, high, low, close and ticks. */
+#define NZX_BAR_COLUMNS 8
+/* The board is sampled at most once a minute. */
+#define NZX_BAR_TICK 60
+
+typedef struct bar {
+    time_t start;       /* first second of the bar, 0 if none is open */
+    time_t end;         /* first second of the next bar */
+    time_t firstAt;     /* when open was observed */
+    time_t lastAt;      /* when close was observed */
+    float open;
+    float high;
+    float low;
+    float close;
+    int ticks;          /* prices in the bar */
+} bar_t;
+
+/*
+ * The open bars of a single listing, one per width.
+ */
+typedef struct barSeries {
+    char *code;
+    bar_t bars[NZX_BAR_MAX_WIDTHS];
+} barSeries_t;
+
+/*
+ * A closed bar waiting to be written.
+ */
+typedef struct closedBar {
+    const char *code;   /* series are never freed */
+    long width;
+    bar_t bar;
+} closedBar_t;
+
+/* barsFlags */
+#define BARS_RUNNING 0x01u
+#define BARS_EXIT 0x02u
+
+static struct nzxBars {
+    pthread_mutex_t barsMutex;  /* protects everything below */
+    pthread_cond_t barsWakecv;  /* signaled when nextEnd changes or on exit */
+    pthread_t barsTid;          /* the sweeper */
+    unsigned int barsFlags;     /* see above */
+    long widths[NZX_BAR_MAX_WIDTHS];
+    int nWidths;                /* 0 until configured */
+    barSeries_t **table;        /* open addressed on code, power of 2 */
+    int nTable;
+    int nSeries;
+    time_t nextEnd;             /* earliest end of an open bar, 0 if none */
+} Bars = {.barsMutex = PTHREAD_MUTEX_INITIALIZER, .barsWakecv = PTHREAD_COND_INITIALIZER};
+
+static void
+configure(void) {
+    char *env, *list, *token, *save;
+    long width;
+
+    env = getenv(NZX_BAR_WIDTHS_ENV);
+    if ((list = strdup(env ? env : NZX_BAR_WIDTHS)) == NULL) {
+        /* Left unconfigured, the next batch tries again. */
+        logError("Could not read the bar widths, out of memory.")
+        return;
+    }
+    for (token = strtok_r(list, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        width = strtol(token, NULL, 10);
+        if (width < NZX_BAR_TICK || width % NZX_BAR_TICK != 0) {
+            logWarn("Ignoring bar width %s, it must be a whole number of minutes.", token)
+        } else if (Bars.nWidths == NZX_BAR_MAX_WIDTHS) {
+            logWarn("Ignoring bar width %s, at most %d are kept.", token, NZX_BAR_MAX_WIDTHS)
+        } else {
+            Bars.widths[Bars.nWidths++] = width;
+        }
+    }
+    free(list);
+    if (Bars.nWidths == 0) {
+        /* Configured but empty, nothing is built. */
+        Bars.nWidths = -1;
+    }
+}
+
+static unsigned int
+hashCode(const char *code) {
+    unsigned int hash = 2166136261u;
+
+    while (*code) {
+        hash = (hash ^ (unsigned char) *code++) * 16777619u;
+    }
+    return hash;
+}
+
+static barSeries_t **
+findSlot(const char *code) {
+    unsigned int i = hashCode(code) & (Bars.nTable - 1);
+
+    while (Bars.table[i] != NULL && strcmp(Bars.table[i]->code, code) != 0) {
+        i = (i + 1) & (Bars.nTable - 1);
+    }
+    return &Bars.table[i];
+}
+
+/*
+ * The series for code, created if it is new. Returns NULL if it is new
+ * and there is no memory for it.
+ */
+static barSeries_t *
+getSeries(const char *code) {
+    barSeries_t **old, **slot, *series;
+    int i, nOld;
+
+    /* Keep the table at most half full. */
+    if (Bars.nSeries * 2 >= Bars.nTable) {
+        old = Bars.table;
+        nOld = Bars.nTable;
+        if ((Bars.table = calloc(nOld ? nOld * 2 : 256, sizeof(barSeries_t *))) == NULL) {
+            /* Keep using the old table while it has a free slot left. */
+            Bars.table = old;
+            if (Bars.nSeries + 1 >= nOld) {
+                return NULL;
+            }
+        } else {
+            Bars.nTable = nOld ? nOld * 2 : 256;
+            for (i = 0; i < nOld; i++) {
+                if (old[i] != NULL) {
+                    *findSlot(old[i]->code) = old[i];
+                }
+            }
+            free(old);
+        }
+    }
+    slot = findSlot(code);
+    if (*slot == NULL) {
+        if ((series = calloc(1, sizeof(barSeries_t))) == NULL) {
+            return NULL;
+        }
+        if ((series->code = strdup(code)) == NULL) {
+            free(series);
+            return NULL;
+        }
+        *slot = series;
+        Bars.nSeries++;
+    }
+    return *slot;
+}
+
+/*
+ * The bucket an instant falls in, in market time when the zone is known.
+ */
+static void
+bucket(tzZone_t *zone, time_t observed, long width, time_t *start, time_t *end) {
+    if (zone == NULL) {
+        *start = observed / width * width;
+        *end = *start + width;
+        return;
+    }
+    *start = tzTruncate(zone, observed, width);
+    /* Days are not always 24 hours, find the start of the next one. */
+    *end = tzTruncate(zone, *start + width * 3 / 2, width);
+}
+
+/*
+ * Take a bar off its series and add it to the closed ones. A bar that
+ * can't be added is dropped.
+ */
+static void
+closeBar(closedBar_t **closed, int *nClosed, int *capacity, barSeries_t *series, int w) {
+    closedBar_t *grown;
+
+    if (*nClosed == *capacity) {
+        if ((grown = realloc(*closed, (*capacity ? *capacity * 2 : 64) * sizeof(closedBar_t))) == NULL) {
+            logError("Dropped a closed %s bar, out of memory.", series->code)
+            series->bars[w].ticks = 0;
+            return;
+        }
+        *closed = grown;
+        *capacity = *capacity ? *capacity * 2 : 64;
+    }
+    (*closed)[*nClosed].code = series->code;
+    (*closed)[*nClosed].width = Bars.widths[w];
+    (*closed)[*nClosed].bar = series->bars[w];
+    (*nClosed)++;
+    series->bars[w].ticks = 0;
+}
+
+static void
+addPrice(bar_t *bar, float price, time_t observed) {
+    if (bar->ticks == 0) {
+        bar->open = bar->high = bar->low = bar->close = price;
+        bar->firstAt = bar->lastAt = observed;
+        bar->ticks = 1;
+        return;
+    }
+    /* Batches can finish out of order, open and close go by observed time. */
+    if (observed < bar->firstAt) {
+        bar->open = price;
+        bar->firstAt = observed;
+    }
+    if (observed >= bar->lastAt) {
+        bar->close = price;
+        bar->lastAt = observed;
+    }
+    if (price > bar->high) {
+        bar->high = price;
+    }
+    if (price < bar->low) {
+        bar->low = price;
+    }
+    bar->ticks++;
+}
+
+/*
+ * Queue the closed bars as a single insert of parallel arrays.
+ */
+static void
+storeBars(const closedBar_t *closed, int nClosed) {
+    storageBatch_t *batch;
+    const char **columns[NZX_BAR_COLUMNS];
+    char *arrays[NZX_BAR_COLUMNS];
+    char (*numbers)[NZX_BAR_COLUMNS - 1][32];   /* every column but the code */
+    int i, c, result = -1;
+
+    memset(columns, 0, sizeof(columns));
+    memset(arrays, 0, sizeof(arrays));
+    if ((numbers = malloc(nClosed * sizeof(*numbers))) == NULL) {
+        goto out;
+    }
+    for (c = 0; c < NZX_BAR_COLUMNS; c++) {
+        if ((columns[c] = malloc(nClosed * sizeof(char *))) == NULL) {
+            goto out;
+        }
+    }
+    for (i = 0; i < nClosed; i++) {
+        snprintf(numbers[i][0], sizeof(numbers[i][0]), "%lld", (long long) closed[i].bar.start);
+        snprintf(numbers[i][1], sizeof(numbers[i][1]), "%ld", closed[i].width);
+        snprintf(numbers[i][2], sizeof(numbers[i][2]), "%.9g", closed[i].bar.open);
+        snprintf(numbers[i][3], sizeof(numbers[i][3]), "%.9g", closed[i].bar.high);
+        snprintf(numbers[i][4], sizeof(numbers[i][4]), "%.9g", closed[i].bar.low);
+        snprintf(numbers[i][5], sizeof(numbers[i][5]), "%.9g", closed[i].bar.close);
+        snprintf(numbers[i][6], sizeof(numbers[i][6]), "%d", closed[i].bar.ticks);
+        columns[0][i] = numbers[i][0];
+        columns[1][i] = closed[i].code;
+        for (c = 2; c < NZX_BAR_COLUMNS; c++) {
+            columns[c][i] = numbers[i][c - 1];
+        }
+    }
+    for (c = 0; c < NZX_BAR_COLUMNS; c++) {
+        if ((arrays[c] = postgresTextArray(columns[c], nClosed)) == NULL) {
+            goto out;
+        }
+    }
+
+    if ((batch = storageBatchCreate("bars")) == NULL) {
+        goto out;
+    }
+    if (storageBatchAdd(
+            batch,
+            "INSERT INTO nzx.bars (time, code, width, open, high, low, close, ticks) "
+            "SELECT to_timestamp(t), c, w, o, h, l, cl, n "
+            "FROM unnest($1::bigint[], $2::text[], $3::int[], $4::real[], $5::real[], $6::real[], "
+            "$7::real[], $8::int[]) AS b(t, c, w, o, h, l, cl, n) "
+            "ON CONFLICT (code, width, time) DO NOTHING;",
+            NZX_BAR_COLUMNS,
+            (const char *const *) arrays,
+            NULL,
+            NULL,
+            NULL,
+            NULL) == -1) {
+        storageBatchFree(batch);
+        goto out;
+    }
+    /* Spooled like the prices they were built from. */
+    storageSubmitDurable(batch);
+    result = 0;
+
+    out:
+    if (result == -1) {
+        logError("Could not build the batch for %d closed bars, they are dropped.", nClosed)
+    }
+    for (c = 0; c < NZX_BAR_COLUMNS; c++) {
+        free(arrays[c]);
+        free(columns[c]);
+    }
+    free(numbers);
+}
+
+/*
+ * Close every open bar that ends by cutoff and work out when the next
+ * one does. Called with barsMutex held.
+ */
+static void
+closeDue(time_t cutoff, closedBar_t **closed, int *nClosed, int *capacity) {
+    barSeries_t *series;
+    time_t nextEnd = 0;
+    int i, w;
+
+    for (i = 0; i < Bars.nTable; i++) {
+        if ((series = Bars.table[i]) == NULL) {
+            continue;
+        }
+        for (w = 0; w < Bars.nWidths; w++) {
+            if (series->bars[w].ticks == 0) {
+                continue;
+            }
+            if (series->bars[w].end <= cutoff) {
+                closeBar(closed, nClosed, capacity, series, w);
+            } else if (nextEnd == 0 || series->bars[w].end < nextEnd) {
+                nextEnd = series->bars[w].end;
+            }
+        }
+    }
+    if (nextEnd != Bars.nextEnd) {
+        Bars.nextEnd = nextEnd;
+        pthread_cond_signal(&Bars.barsWakecv);
+    }
+}
+
+static void
+storeClosed(closedBar_t *closed, int nClosed) {
+    if (nClosed > 0) {
+        logDebug("Closed %d bars.", nClosed)
+        storeBars(closed, nClosed);
+    }
+    free(closed);
+}
+
+void
+nzxBarsUpdate(nzxNode_t *head, time_t observed) {
+    tzZone_t *zone = nzxMarketZone();
+    closedBar_t *closed = NULL;
+    barSeries_t *series;
+    time_t start, end;
+    int w, nClosed = 0, capacity = 0;
+
+    pthread_mutex_lock(&Bars.barsMutex);
+    if (Bars.nWidths == 0) {
+        configure();
+    }
+    for (; head != NULL && Bars.nWidths > 0; head = head->next) {
+        if ((series = getSeries(head->listing.Code)) == NULL) {
+            logError("Dropping a %s price, out of memory.", head->listing.Code)
+            continue;
+        }
+        for (w = 0; w < Bars.nWidths; w++) {
+            bucket(zone, observed, Bars.widths[w], &start, &end);
+            if (start < series->bars[w].start || (start == series->bars[w].start && series->bars[w].ticks == 0)) {
+                /* Its bar has already been written. */
+                logDebug("Dropping a late %s price.", series->code)
+                continue;
+            }
+            if (series->bars[w].ticks > 0 && start != series->bars[w].start) {
+                closeBar(&closed, &nClosed, &capacity, series, w);
+            }
+            series->bars[w].start = start;
+            series->bars[w].end = end;
+            addPrice(&series->bars[w], head->listing.Price, observed);
+        }
+    }
+    /* A bar is complete once its last minute is in, whether or not every code traded. */
+    closeDue(observed + NZX_BAR_TICK, &closed, &nClosed, &capacity);
+    pthread_mutex_unlock(&Bars.barsMutex);
+    storeClosed(closed, nClosed);
+}
+
+void
+nzxBarsSweep(time_t now) {
+    closedBar_t *closed = NULL;
+    int nClosed = 0, capacity = 0;
+
+    pthread_mutex_lock(&Bars.barsMutex);
+    /* Leave a minute for the batch of a bar's last minute to arrive. */
+    closeDue(now - nzxPriceDelay() - NZX_BAR_TICK, &closed, &nClosed, &capacity);
+    pthread_mutex_unlock(&Bars.barsMutex);
+    storeClosed(closed, nClosed);
+}
+
+/*
+ * Sleep until the earliest open bar is due and sweep.
+ */
+static void *
+sweeper(void *arg) {
+    struct timespec wake = {0, 0};
+
+    (void) arg;
+    pthread_mutex_lock(&Bars.barsMutex);
+    while (!(Bars.barsFlags & BARS_EXIT)) {
+        if (Bars.nextEnd == 0) {
+            pthread_cond_wait(&Bars.barsWakecv, &Bars.barsMutex);
+            continue;
+        }
+        wake.tv_sec = Bars.nextEnd + nzxPriceDelay() + NZX_BAR_TICK;
+        if (time(NULL) < wake.tv_sec) {
+            pthread_cond_timedwait(&Bars.barsWakecv, &Bars.barsMutex, &wake);
+            continue;
+        }
+        pthread_mutex_unlock(&Bars.barsMutex);
+        nzxBarsSweep(time(NULL));
+        pthread_mutex_lock(&Bars.barsMutex);
+    }
+    pthread_mutex_unlock(&Bars.barsMutex);
+    return NULL;
+}
+
+int
+nzxBarsStart(void) {
+    int error;
+
+    pthread_mutex_lock(&Bars.barsMutex);
+    if (Bars.barsFlags & BARS_RUNNING) {
+        pthread_mutex_unlock(&Bars.barsMutex);
+        return 0;
+    }
+    if ((error = pthread_create(&Bars.barsTid, NULL, sweeper, NULL)) != 0) {
+        pthread_mutex_unlock(&Bars.barsMutex);
+        errno = error;
+        return -1;
+    }
+    Bars.barsFlags = BARS_RUNNING;
+    pthread_mutex_unlock(&Bars.barsMutex);
+    return 0;
+}
+
+void
+nzxBarsStop(void) {
+    pthread_mutex_lock(&Bars.barsMutex);
+    if (!(Bars.barsFlags & BARS_RUNNING)) {
+        pthread_mutex_unlock(&Bars.barsMutex);
+        return;
+    }
+    Bars.barsFlags |= BARS_EXIT;
+    pthread_cond_signal(&Bars.barsWakecv);
+    pthread_mutex_unlock(&Bars.barsMutex);
+
+    pthread_join(Bars.barsTid, NULL);
+    Bars.barsFlags = 0;
+}
@@ -0,0 +1,57 @@
+//
+// Created by Matthew Johnson on 28/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_BARS_H
+#define INVEST_FETCH_C_BARS_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../helpers/postgres.h"
+#include "../helpers/tz.h"
+#include "../logging/logger.h"
+#include "../storage/storage.h"
+#include "models.h"
+#include "priceHandler.h"
+
+/*
+ * Streaming OHLC bars. Each price batch updates the open bar of every
+ * listing at every configured width, and bars are written to nzx.bars
+ * together as soon as their interval has ended: with the batch for
+ * their last minute, or by the sweeper a minute after it was due if no
+ * batch came, e.g. at the close of trading. Widths are read once
+ * from NZX_BAR_WIDTHS, a comma separated list of seconds (default
+ * 60,900,3600,86400), and bucketed in market local time.
+ * Open bars live only in memory, the first bar after a restart only
+ * holds the prices seen since.
+ */
+
+/*
+ * Add a batch of prices observed at the given minute and queue any bars
+ * that have closed.
+ */
+void nzxBarsUpdate(nzxNode_t *head, time_t observed);
+
+/*
+ * Write every open bar that ended more than a minute before now, less
+ * the board delay. The sweeper calls this as bars come due.
+ */
+void nzxBarsSweep(time_t now);
+
+/*
+ * Start the sweeper thread.
+ * On error, nzxBarsStart() returns -1 with errno set to the error code.
+ */
+int nzxBarsStart(void);
+
+/*
+ * Stop the sweeper. Bars still open are not written.
+ */
+void nzxBarsStop(void);
+
+#endif //INVEST_FETCH_C_BARS_H
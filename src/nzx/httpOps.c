@@ -58,6 +58,7 @@ nzxFetchData(const char *url) {
                      "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/80.0.3987.132 Safari/537.36");
 
     res = curl_easy_perform(curl_handle);
+    clock_gettime(CLOCK_REALTIME, &chunk->fetched);
     // Check for errors
     if (res != CURLE_OK) {
         fprintf(stderr, "curl_easy_perform() failed: %s\n",
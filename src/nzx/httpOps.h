@@ -9,6 +9,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <curl/curl.h>
 #include "../logging/logger.h"
@@ -16,6 +17,7 @@
 typedef struct memoryChunk {
     char *memory;
     size_t size;
+    struct timespec fetched;    // When the transfer completed
 } memoryChunk_t;
 
 
@@ -22,6 +22,22 @@ static void removeAllChars(char *str, char c, int n) {
     *pw = '\0';
 }
 
+#define NZX_PERF_UPDATE "UPDATE nzx.listings SET eps=$1, nta=$2, gdy=$3, volume=$4, si=$5, update=false, " \
+                        "last_updated=date_trunc('minute', now())::timestamptz WHERE code = $6;"
+
+static void
+freePerformanceList(nzxPerformanceList_t **head) {
+    while (*head != NULL) {
+        nzxPerformanceList_t *next = (*head)->next;
+        free((*head)->node->code);
+        free((*head)->node);
+        free(*head);
+        (*head) = next;
+    }
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
 static void
 toNbof(const float in, float *out) {
     uint32_t *i = (uint32_t * ) & in;
@@ -31,21 +47,17 @@ toNbof(const float in, float *out) {
     r[1] = htons((uint16_t) * i);
 }
 
-int nzxStoreListingPerformance(nzxPerformanceList_t **head) {
-    struct pg_conn *conn;
-    PGresult *res;
+/*
+ * One UPDATE per instrument, the storage thread sends them back to back
+ * in a single pipeline so the whole refresh costs about one round trip.
+ */
+static int
+batchPerformance(storageBatch_t *batch, nzxPerformanceList_t *head) {
     float eps, nta, gdy;
     unsigned long si, volume;
 
-    conn = postgresConnect();
-
-
-    if (!conn) {
-        logCrit("Could not connect to Postgres Server.")
-        return -1;
-    }
-    while (*head != NULL) {
-        nzxPerform_t *entry = (*head)->node;
+    for (; head != NULL; head = head->next) {
+        nzxPerform_t *entry = head->node;
 
         int n = 1;
         if (*(char *) &n == 1) {
@@ -79,30 +91,170 @@ int nzxStoreListingPerformance(nzxPerformanceList_t **head) {
                 (int) strlen(entry->code)
         };
         int paramFormats[6] = {1, 1, 1, 1, 1, 0};
-        res = PQexecParams(
-                conn,
-                "UPDATE nzx.listings SET eps=$1, nta=$2, gdy=$3, volume=$4, si=$5, update=false, last_updated=date_trunc('minute', now())::timestamptz WHERE code = $6;",
-                6,
-                NULL,
-                paramValues,
-                paramLengths,
-                paramFormats,
-                0);
-
-        if (res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            logError("Problem is: %s", PQerrorMessage(conn))
+        if (storageBatchAdd(batch, NZX_PERF_UPDATE, 6, paramValues, paramLengths, paramFormats, NULL, NULL) == -1 ||
+            storageBatchLabel(batch, entry->code) == -1) {
+            return -1;
         }
-        nzxPerformanceList_t *next = (*head)->next;
-        free((*head)->node->code);
-        free((*head)->node);
-        free(*head);
-        (*head) = next;
-        PQclear(res);
     }
-    PQfinish(conn);
     return 0;
 }
 
+#else
+
+static void
+performanceUpdated(const PGresult *res, void *arg) {
+    long expected = (long) arg;
+
+    if (PQntuples(res) != expected) {
+        logError("Only %d of %ld listings had their performance updated.", PQntuples(res), expected)
+    }
+}
+
+/*
+ * libpq without pipeline support, send the whole refresh as one statement
+ * using array parameters rather than a round trip per instrument.
+ */
+static int
+batchPerformance(storageBatch_t *batch, nzxPerformanceList_t *head) {
+    nzxPerformanceList_t *iter;
+    char *arrays[6];
+    const char **columns[6];
+    char (*numbers)[5][32];
+    int count, i, result = -1;
+
+    count = 0;
+    for (iter = head; iter != NULL; iter = iter->next) {
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    memset(arrays, 0, sizeof(arrays));
+    memset(columns, 0, sizeof(columns));
+    if ((numbers = malloc(count * sizeof(*numbers))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < 6; i++) {
+        if ((columns[i] = malloc(count * sizeof(char *))) == NULL) {
+            errno = ENOMEM;
+            goto out;
+        }
+    }
+    for (i = 0, iter = head; iter != NULL; i++, iter = iter->next) {
+        nzxPerform_t *entry = iter->node;
+        snprintf(numbers[i][0], sizeof(numbers[i][0]), "%.9g", entry->eps);
+        snprintf(numbers[i][1], sizeof(numbers[i][1]), "%.9g", entry->nta);
+        snprintf(numbers[i][2], sizeof(numbers[i][2]), "%.9g", entry->gdy);
+        snprintf(numbers[i][3], sizeof(numbers[i][3]), "%ld", entry->volume);
+        snprintf(numbers[i][4], sizeof(numbers[i][4]), "%ld", entry->si);
+        for (int col = 0; col < 5; col++) {
+            columns[col][i] = numbers[i][col];
+        }
+        columns[5][i] = entry->code;
+    }
+    for (i = 0; i < 6; i++) {
+        if ((arrays[i] = postgresTextArray(columns[i], count)) == NULL) {
+            errno = ENOMEM;
+            goto out;
+        }
+    }
+
+    const char *const paramValues[6] = {arrays[0], arrays[1], arrays[2], arrays[3], arrays[4], arrays[5]};
+    result = storageBatchAdd(
+            batch,
+            "UPDATE nzx.listings AS l SET eps=v.eps, nta=v.nta, gdy=v.gdy, volume=v.volume, si=v.si, update=false, "
+            "last_updated=date_trunc('minute', now())::timestamptz "
+            "FROM unnest($1::real[], $2::real[], $3::real[], $4::bigint[], $5::bigint[], $6::text[]) "
+            "AS v(eps, nta, gdy, volume, si, code) WHERE l.code = v.code RETURNING l.code;",
+            6,
+            paramValues,
+            NULL,
+            NULL,
+            performanceUpdated,
+            (void *) (long) count);
+
+    out:
+    for (i = 0; i < 6; i++) {
+        free(arrays[i]);
+        free(columns[i]);
+    }
+    free(numbers);
+    return result;
+}
+
+#endif
+
+/*
+ * Codes in a submitted refresh, handed back to the rotation once the
+ * storage thread is done with them.
+ */
+typedef struct performRefresh {
+    int nCodes;
+    char **codes;
+} performRefresh_t;
+
+static void
+performanceStored(const char *name, int status, void *arg) {
+    performRefresh_t *refresh = (performRefresh_t *) arg;
+    int i;
+
+    (void) name;
+    for (i = 0; i < refresh->nCodes; i++) {
+        nzxRotationRelease(refresh->codes[i], status == 0);
+        free(refresh->codes[i]);
+    }
+    free(refresh->codes);
+    free(refresh);
+}
+
+int nzxStoreListingPerformance(nzxPerformanceList_t **head) {
+    storageBatch_t *batch;
+    performRefresh_t *refresh;
+    nzxPerformanceList_t *iter;
+    int i;
+
+    if ((refresh = calloc(1, sizeof(performRefresh_t))) == NULL) {
+        freePerformanceList(head);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (iter = *head; iter != NULL; iter = iter->next) {
+        refresh->nCodes++;
+    }
+    if ((refresh->codes = calloc(refresh->nCodes ? refresh->nCodes : 1, sizeof(char *))) == NULL) {
+        free(refresh);
+        freePerformanceList(head);
+        errno = ENOMEM;
+        return -1;
+    }
+    /* A code that can't be copied is handed back to the rotation straight away. */
+    for (i = 0, iter = *head; iter != NULL; iter = iter->next) {
+        if ((refresh->codes[i] = strdup(iter->node->code)) != NULL) {
+            i++;
+        } else {
+            nzxRotationRelease(iter->node->code, 0);
+        }
+    }
+    refresh->nCodes = i;
+
+    if ((batch = storageBatchCreate("performance")) == NULL) {
+        performanceStored("performance", -1, refresh);
+        freePerformanceList(head);
+        return -1;
+    }
+    if (batchPerformance(batch, *head) == -1) {
+        logError("Could not build the performance batch.")
+        storageBatchFree(batch);
+        performanceStored("performance", -1, refresh);
+        freePerformanceList(head);
+        return -1;
+    }
+    freePerformanceList(head);
+    /* The storage thread owns the batch from here. */
+    return storageSubmit(batch, performanceStored, refresh);
+}
+
 int nzxExtractListingPerformance(memoryChunk_t *chunk, nzxPerform_t *node) {
     char *ptr, *end;
     int size;
@@ -146,46 +298,38 @@ int nzxExtractListingPerformance(memoryChunk_t *chunk, nzxPerform_t *node) {
     return 0;
 }
 
-int nzxGetUpdateCodes(nzxPerformanceList_t **head) {
-    struct pg_conn *conn;
-    PGresult *res;
+int nzxGetUpdateCodes(nzxPerformanceList_t **head, int budget, const char *from, const char *to) {
+    char **codes;
+    int count, i;
 
-    conn = postgresConnect();
-
-    if (!conn) {
-        logCrit("Could not connect to Postgres Server.")
+    codes = malloc(budget * sizeof(char *));
+    if ((count = nzxRotationTake(budget, from, to, codes)) == -1) {
+        free(codes);
         return -1;
     }
-
-    res = PQexec(conn, "select code from nzx.listings order by update DESC, last_updated LIMIT 20;");
-
-    if (res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
-        logError("Problem is: %s", PQerrorMessage(conn))
-        PQclear(res);
-        PQfinish(conn);
-        return -1;
+    for (i = 0; i < count; i++) {
+        nzxPerformanceList_t *entry = (nzxPerformanceList_t *) malloc(sizeof(nzxPerformanceList_t));
+        entry->node = (nzxPerform_t *) calloc(1, sizeof(nzxPerform_t));
+        /* The list takes ownership of the copy. */
+        entry->node->code = codes[i];
+        entry->next = *head;
+        *head = entry;
     }
+    free(codes);
+    return count;
+}
 
-    for (int row = 0; row < PQntuples(res); row++) {
-        if (!PQgetisnull(res, row, 0)) {
-
-            nzxPerformanceList_t *entry = (nzxPerformanceList_t *) malloc(sizeof(nzxPerformanceList_t));
-            entry->node = (nzxPerform_t *) malloc(sizeof(nzxPerform_t));
-
-            char *code = PQgetvalue(res, row, 0);
-            size_t len = strlen(code) + 1;
-            entry->node->code = (char *) malloc(sizeof(char) * len);
-            strncpy(entry->node->code, code, len);
+void nzxDropUpdateCode(nzxPerformanceList_t **head, nzxPerformanceList_t *entry) {
+    nzxPerformanceList_t **iter;
 
-            if (head == NULL) {
-                entry->next = NULL;
-            } else {
-                entry->next = *head;
-            }
-            *head = entry;
+    for (iter = head; *iter != NULL; iter = &(*iter)->next) {
+        if (*iter == entry) {
+            *iter = entry->next;
+            nzxRotationRelease(entry->node->code, 0);
+            free(entry->node->code);
+            free(entry->node);
+            free(entry);
+            return;
         }
     }
-    PQclear(res);
-    PQfinish(conn);
-    return 0;
-}
\ No newline at end of file
+}
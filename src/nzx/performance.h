@@ -8,6 +8,8 @@
 
 #include "httpOps.h"
 #include "../helpers/postgres.h"
+#include "../storage/storage.h"
+#include "rotation.h"
 #include <libpq-fe.h>
 #include <string.h>
 #include <netinet/in.h>
@@ -29,10 +31,30 @@ struct nzxListingPerformance {
     long volume;            // Number of shares traded
 };
 
-int nzxGetUpdateCodes(nzxPerformanceList_t **head);
+/* Instruments refreshed per cycle unless overridden by NZX_PERF_BUDGET. */
+#define NZX_PERF_BUDGET 20
+/* Most instruments a single cycle may refresh, whatever it is asked for. */
+#define NZX_PERF_MAX_BUDGET 1000
+
+/*
+ * Take up to budget of the stalest listings with codes between from and
+ * to (inclusive, NULL for no bound) out of the refresh rotation.
+ * Returns the number added to head or -1 on error.
+ */
+int nzxGetUpdateCodes(nzxPerformanceList_t **head, int budget, const char *from, const char *to);
+
+/*
+ * Remove an entry that could not be refreshed, it keeps its place in the
+ * rotation.
+ */
+void nzxDropUpdateCode(nzxPerformanceList_t **head, nzxPerformanceList_t *entry);
 
 int nzxExtractListingPerformance(memoryChunk_t *chunk, nzxPerform_t *node);
 
+/*
+ * Queue the refreshed values for storage, the codes return to the back of
+ * the rotation once they are written.
+ */
 int nzxStoreListingPerformance(nzxPerformanceList_t **head);
 
 #endif //INVEST_FETCH_C_PERFORMANCE_H
@@ -5,6 +5,15 @@
 
 #include "priceHandler.h"
 
+/* Seconds the board prices are delayed by, overridden by NZX_PRICE_DELAY. */
+#define NZX_PRICE_DELAY_ENV "NZX_PRICE_DELAY"
+#define NZX_PRICE_DELAY (20 * 60)
+/* Zone the market minutes are counted in, overridden by NZX_TZ. */
+#define NZX_TZ_ENV "NZX_TZ"
+#define NZX_TZ "Pacific/Auckland"
+/* Seconds between the Unix and Postgres epochs. */
+#define POSTGRES_EPOCH 946684800L
+
 static char *
 extractCode(char **ptr) {
     char *code;
@@ -55,61 +64,122 @@ toNbof(const float in, float *out) {
     r[1] = htons((uint16_t) *i);
 }
 
-int
-nzxStoreMarketPrices(nzxNode_t *head) {
-    PGconn *conn;
-    conn = postgresConnect();
+/* Fixed for the life of the process, loaded by the first thread to ask. */
+static pthread_once_t marketOnce = PTHREAD_ONCE_INIT;
+static tzZone_t *marketZone = NULL;
+static long priceDelay = NZX_PRICE_DELAY;
 
-    if (!conn) {
-        logCrit("Failed to connect to the Postgres server.")
-        return -1;
+static void
+loadMarket(void) {
+    char *env;
+
+    env = getenv(NZX_TZ_ENV);
+    if ((marketZone = tzLoad(env ? env : NZX_TZ)) == NULL) {
+        logError("Could not load time zone %s.", env ? env : NZX_TZ)
     }
-    /* Request the time from the server, takes the byte order and incorrect time configurations out. */
-    PGresult *tm = PQexec(
-            conn,
-            "SELECT DATE_TRUNC('minute', (now() AT time zone 'Pacific/Auckland') - interval '20 minutes')::timestamp"
-    );
-    if (tm == NULL) {
-        logCrit("Failed to get the time from the postgres server")
-        PQfinish(conn);
-        return -1;
-    } else if (PQresultStatus(tm) != PGRES_TUPLES_OK) {
-        logCrit("Postgres did not return a valid time set.")
+    if ((env = getenv(NZX_PRICE_DELAY_ENV)) != NULL) {
+        priceDelay = strtol(env, NULL, 10);
     }
-    if (PQgetisnull(tm, 0, 0)) {
-        logCrit("Server send no time data.")
-        PQclear(tm);
-        PQfinish(conn);
-        return -1;
+}
+
+tzZone_t *
+nzxMarketZone(void) {
+    pthread_once(&marketOnce, loadMarket);
+    return marketZone;
+}
+
+long
+nzxPriceDelay(void) {
+    pthread_once(&marketOnce, loadMarket);
+    return priceDelay;
+}
+
+time_t
+nzxPriceObserved(const memoryChunk_t *chunk) {
+    tzZone_t *zone = nzxMarketZone();
+
+    if (zone == NULL) {
+        return (chunk->fetched.tv_sec - priceDelay) / 60 * 60;
     }
-    char *timestamp = PQgetvalue(tm, 0, 0);
+    /* The board is delayed, the prices on it are from this long ago. */
+    return tzTruncate(zone, chunk->fetched.tv_sec - priceDelay, 60);
+}
 
+/*
+ * Refresh the minute the prices landed in once they have been written.
+ * Only the finest level is refreshed here, the coarser ones are built
+ * from it by their own policies (0003_price_aggregates.sql).
+ */
+static void
+refreshAggregates(time_t observed) {
+    storageBatch_t *batch;
+    char start[24], end[24];
+
+    if ((batch = storageBatchCreate("aggregates")) == NULL) {
+        return;
+    }
+    /* CALL refresh_continuous_aggregate() cannot run inside a transaction. */
+    storageBatchAutocommit(batch);
+    /* Behind the prices even if they wait in the spool for a while. */
+    storageBatchAfterDurable(batch);
+    /* Minutes are whole in every zone the market could be in. */
+    snprintf(start, sizeof(start), "%lld", (long long) (observed / 60 * 60));
+    snprintf(end, sizeof(end), "%lld", (long long) (observed / 60 * 60 + 60));
+
+    const char *const paramValues[2] = {start, end};
+
+    if (storageBatchAdd(batch, "CALL refresh_continuous_aggregate('nzx.prices_1m', "
+                               "to_timestamp($1::bigint), to_timestamp($2::bigint));",
+                        2, paramValues, NULL, NULL, NULL, NULL) == -1) {
+        logError("Could not add nzx.prices_1m to the refresh batch.")
+        storageBatchFree(batch);
+        return;
+    }
+    storageSubmit(batch, NULL, NULL);
+}
+
+int
+nzxStoreMarketPrices(nzxNode_t *head, time_t observed) {
+    storageBatch_t *batch;
+    uint64_t timestamp;
+
+    /* Binary timestamptz is big endian microseconds since 2000-01-01 UTC. */
+    timestamp = (uint64_t) (observed - POSTGRES_EPOCH) * 1000000u;
+    int n = 1;
+    if (*(char *) &n == 1) {
+        timestamp = __builtin_bswap64(timestamp);
+    }
+
+    if ((batch = storageBatchCreate("prices")) == NULL) {
+        return -1;
+    }
     while (head) {
         float converted; // This is now in network byte order
         toNbof(head->listing.Price, &converted);
 
-        const char *const paramValues[3] = {timestamp, head->listing.Code, (char *) &converted};
-        int paramLengths[3] = {(int) strlen(timestamp), (int) strlen(head->listing.Code), sizeof(converted)};
-        int paramFormats[3] = {0, 0, 1};
+        const char *const paramValues[3] = {(char *) &timestamp, head->listing.Code, (char *) &converted};
+        int paramLengths[3] = {sizeof(timestamp), (int) strlen(head->listing.Code), sizeof(converted)};
+        int paramFormats[3] = {1, 0, 1};
 
-        PGresult *res = PQexecParams(
-                conn,
-                "INSERT INTO nzx.prices (time, code, price) VALUES ($1, $2, $3::real);",
+        if (storageBatchAdd(
+                batch,
+                "INSERT INTO nzx.prices (time, code, price) VALUES ($1::timestamptz, $2, $3::real) "
+                "ON CONFLICT (code, time) DO NOTHING;",
                 3,
-                NULL,
                 paramValues,
                 paramLengths,
                 paramFormats,
-                0);
-
-        if (res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK) {
-            logError("Problem is: %s", PQerrorMessage(conn))
+                NULL,
+                NULL) == -1) {
+            logError("Could not add %s to the price batch.", head->listing.Code)
         }
         head = head->next;
-        PQclear(res);
     }
-    PQclear(tm);
-    PQfinish(conn);
+    /* Spooled so an outage or restart does not lose the minute. */
+    if (storageSubmitDurable(batch) == -1) {
+        return -1;
+    }
+    refreshAggregates(observed);
     return 0;
 }
 
@@ -166,44 +236,115 @@ generateCoreListing(char **ptr) {
     return listing;
 }
 
-int
-nzxStoreMarketListings(nzxNode_t *head) {
-
-    PGconn *conn;
-    conn = postgresConnect();
+typedef struct listingsRequest {
+    nzxListingsFunc onInserted;     /* told about the new listings */
+    void *arg;                      /* its argument */
+} listingsRequest_t;
 
-    if (!conn) {
-        logCrit("Failed to connect to the Postgres server.")
-        return -1;
+static void
+listingsInserted(const PGresult *res, void *arg) {
+    listingsRequest_t *request = (listingsRequest_t *) arg;
+    nzxNode_t *inserted = NULL;
+    int i;
+
+    /* Only rows that did not already exist are returned. */
+    logDebug("Stored %d new listings.", PQntuples(res))
+    if (request->onInserted == NULL) {
+        return;
     }
+    for (i = 0; i < PQntuples(res); i++) {
+        listing_t listing;
+        char *code = PQgetvalue(res, i, 0);
+        size_t len = strlen(code) + 1;
+
+        listing.Code = malloc(len * sizeof(char));
+        strncpy(listing.Code, code, len);
+        listing.Company = NULL;
+        nzxPushListing(&inserted, listing);
+    }
+    request->onInserted(inserted, request->arg);
+    nzxDrainListings(&inserted);
+}
 
-    while (head) {
-        const char *const paramValues[2] = {head->listing.Code, head->listing.Company};
-
-        PGresult *res = PQexecParams(
-                conn,
-                "INSERT INTO nzx.listings (code, company) VALUES ($1, $2) ON CONFLICT (code) DO NOTHING;",
-                2,
-                NULL,
-                paramValues,
-                NULL,
-                NULL,
-                0);
+static void
+listingsDone(const char *name, int status, void *arg) {
+    (void) name;
+    (void) status;
+    free(arg);
+}
 
-        if (res == NULL) {
-            logError("Problem is: %s", PQerrorMessage(conn))
-        }
+int
+nzxStoreMarketListings(nzxNode_t *head, nzxListingsFunc onInserted, void *arg) {
+    storageBatch_t *batch;
+    listingsRequest_t *request;
+    nzxNode_t *iter;
+    const char **codes, **companies;
+    char *codeArray, *companyArray;
+    int count, i, result;
+
+    count = nzxListingsCount(head);
+    if (count == 0) {
+        return 0;
+    }
+    if ((batch = storageBatchCreate("listings")) == NULL) {
+        return -1;
+    }
+    /* Send the whole batch as two parallel arrays so it is one statement. */
+    codes = malloc(count * sizeof(char *));
+    companies = malloc(count * sizeof(char *));
+    request = malloc(sizeof(listingsRequest_t));
+    if (codes == NULL || companies == NULL || request == NULL) {
+        free(codes);
+        free(companies);
+        free(request);
+        storageBatchFree(batch);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0, iter = head; iter != NULL; i++, iter = iter->next) {
+        codes[i] = iter->listing.Code;
+        companies[i] = iter->listing.Company;
+    }
+    codeArray = postgresTextArray(codes, count);
+    companyArray = postgresTextArray(companies, count);
+    free(codes);
+    free(companies);
+    if (codeArray == NULL || companyArray == NULL) {
+        logError("Could not build the listings arrays.")
+        free(codeArray);
+        free(companyArray);
+        free(request);
+        storageBatchFree(batch);
+        errno = ENOMEM;
+        return -1;
+    }
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            logError("Problem is: %s", PQerrorMessage(conn))
-        } else {
-            logDebug("Inserted into Postgres successfully.")
-        }
-        head = head->next;
-        PQclear(res);
+    request->onInserted = onInserted;
+    request->arg = arg;
+
+    const char *const paramValues[2] = {codeArray, companyArray};
+
+    result = storageBatchAdd(
+            batch,
+            "INSERT INTO nzx.listings (code, company) SELECT * FROM unnest($1::text[], $2::text[]) "
+            "ON CONFLICT (code) DO NOTHING RETURNING code;",
+            2,
+            paramValues,
+            NULL,
+            NULL,
+            listingsInserted,
+            request);
+    free(codeArray);
+    free(companyArray);
+
+    if (result == -1) {
+        logError("Could not build the listings batch.")
+        storageBatchFree(batch);
+        free(request);
+        return -1;
     }
-    PQfinish(conn);
-    return 0;
+    /* The storage thread owns the batch from here. */
+    return storageSubmit(batch, listingsDone, request);
 }
 
 void
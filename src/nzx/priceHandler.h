@@ -15,6 +15,8 @@
 #include <netinet/in.h>
 #include <sys/time.h>
 #include "../helpers/postgres.h"
+#include "../storage/storage.h"
+#include "../helpers/tz.h"
 
 
 #include "models.h"
@@ -28,13 +30,46 @@
 #define NZX_PRICE_IDF "<td class=\"text-right\" data-title=\"Price\">\n      "
 
 
+/*
+ * Called from the storage thread with the codes of the listings that did
+ * not exist yet. The list is drained once the callback returns.
+ */
+typedef void (*nzxListingsFunc)(nzxNode_t *inserted, void *arg);
+
 void nzxExtractMarketPrices(memoryChunk_t *chunk, nzxNode_t **head);
 
-int nzxStoreMarketPrices(nzxNode_t *head);
+/*
+ * The zone market time is kept in (NZX_TZ, default Pacific/Auckland).
+ * Loaded once, safe to call from any thread. Returns NULL if it could
+ * not be loaded.
+ */
+tzZone_t *nzxMarketZone(void);
+
+/*
+ * Seconds the board lags real time (NZX_PRICE_DELAY, default 20 minutes).
+ */
+long nzxPriceDelay(void);
+
+/*
+ * The minute the prices in a fetched board were observed, the fetch time
+ * less the board delay, in NZX_TZ local time.
+ */
+time_t nzxPriceObserved(const memoryChunk_t *chunk);
+
+/*
+ * Hand the prices to the storage thread through the spool, stamped with
+ * the observed time, then queue a refresh of the bar aggregates for that
+ * minute. Returns once the batch is on the spool.
+ */
+int nzxStoreMarketPrices(nzxNode_t *head, time_t observed);
 
 void nzxExtractMarketListings(memoryChunk_t *chunk, nzxNode_t **head);
 
-int nzxStoreMarketListings(nzxNode_t *head);
+/*
+ * Queue an insert of any listings that do not exist yet. Returns once the
+ * batch is queued, onInserted (can be NULL) is told about the new codes.
+ */
+int nzxStoreMarketListings(nzxNode_t *head, nzxListingsFunc onInserted, void *arg);
 
 
 #endif //INVEST_FETCH_C_PRICEHANDLER_H
@@ -0,0 +1,435 @@
+//
+// Created by Matthew Johnson on 24/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "rotation.h"
+
+#define NZX_RESYNC_ENV "NZX_ROTATION_RESYNC"
+#define NZX_RESYNC_DEFAULT 3600
+
+/*
+ * A listing in the rotation.
+ */
+typedef struct rotationEntry {
+    char *code;
+    int update;             /* refresh requested */
+    time_t lastUpdated;     /* last refresh, 0 if never */
+    int heapIndex;          /* position in the heap, -1 while taken */
+    unsigned int generation; /* last resync that saw the listing */
+    int removed;            /* gone from the database while taken */
+} rotationEntry_t;
+
+static struct nzxRotation {
+    pthread_mutex_t rotationMutex;  /* protects everything below */
+    rotationEntry_t **heap;         /* min-heap of entries not taken */
+    int nHeap;
+    rotationEntry_t **table;        /* open addressed on code, power of 2 */
+    int nTable;
+    int nEntries;
+    time_t syncedAt;                /* last load from the database */
+    long resync;                    /* seconds between loads */
+    int resyncing;                  /* a load is running outside the lock */
+    unsigned int generation;        /* bumped by every resync */
+} Rotation = {.rotationMutex = PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned int
+hashCode(const char *code) {
+    unsigned int hash = 2166136261u;
+
+    while (*code) {
+        hash = (hash ^ (unsigned char) *code++) * 16777619u;
+    }
+    return hash;
+}
+
+static rotationEntry_t **
+findSlot(const char *code) {
+    unsigned int i = hashCode(code) & (Rotation.nTable - 1);
+
+    while (Rotation.table[i] != NULL && strcmp(Rotation.table[i]->code, code) != 0) {
+        i = (i + 1) & (Rotation.nTable - 1);
+    }
+    return &Rotation.table[i];
+}
+
+/*
+ * Double the table and the heap's room with it. On error the rotation is
+ * left as it was and growTable() returns -1.
+ */
+static int
+growTable(void) {
+    rotationEntry_t **old = Rotation.table, **heap, **table;
+    int i, nOld = Rotation.nTable, nTable = nOld ? nOld * 2 : 64;
+
+    /* A larger heap is harmless if the table cannot follow. */
+    if ((heap = realloc(Rotation.heap, nTable * sizeof(rotationEntry_t *))) == NULL) {
+        return -1;
+    }
+    Rotation.heap = heap;
+    if ((table = calloc(nTable, sizeof(rotationEntry_t *))) == NULL) {
+        return -1;
+    }
+    Rotation.table = table;
+    Rotation.nTable = nTable;
+    for (i = 0; i < nOld; i++) {
+        if (old[i] != NULL) {
+            *findSlot(old[i]->code) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * Remove an entry from the table, shifting back the entries that probed
+ * past it so no lookup stops short.
+ */
+static void
+tableRemove(const char *code) {
+    unsigned int mask = Rotation.nTable - 1, i, j, home;
+
+    i = findSlot(code) - Rotation.table;
+    Rotation.table[i] = NULL;
+    for (j = (i + 1) & mask; Rotation.table[j] != NULL; j = (j + 1) & mask) {
+        home = hashCode(Rotation.table[j]->code) & mask;
+        /* It can fill the hole unless its home lies cyclically in (i, j]. */
+        if (i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+            Rotation.table[i] = Rotation.table[j];
+            Rotation.table[j] = NULL;
+            i = j;
+        }
+    }
+    Rotation.nEntries--;
+}
+
+static void
+dropEntry(rotationEntry_t *entry) {
+    tableRemove(entry->code);
+    free(entry->code);
+    free(entry);
+}
+
+/* Flagged listings first, then the least recently updated. */
+static inline int
+staler(const rotationEntry_t *a, const rotationEntry_t *b) {
+    if (a->update != b->update) {
+        return a->update > b->update;
+    }
+    return a->lastUpdated < b->lastUpdated;
+}
+
+static inline void
+heapSet(int i, rotationEntry_t *entry) {
+    Rotation.heap[i] = entry;
+    entry->heapIndex = i;
+}
+
+static void
+siftUp(int i) {
+    rotationEntry_t *entry = Rotation.heap[i];
+
+    while (i > 0 && staler(entry, Rotation.heap[(i - 1) / 2])) {
+        heapSet(i, Rotation.heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heapSet(i, entry);
+}
+
+static void
+siftDown(int i) {
+    rotationEntry_t *entry = Rotation.heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < Rotation.nHeap) {
+        if (child + 1 < Rotation.nHeap && staler(Rotation.heap[child + 1], Rotation.heap[child])) {
+            child++;
+        }
+        if (!staler(Rotation.heap[child], entry)) {
+            break;
+        }
+        heapSet(i, Rotation.heap[child]);
+        i = child;
+    }
+    heapSet(i, entry);
+}
+
+static void
+heapPush(rotationEntry_t *entry) {
+    heapSet(Rotation.nHeap++, entry);
+    siftUp(entry->heapIndex);
+}
+
+static void
+heapRemove(rotationEntry_t *entry) {
+    int i = entry->heapIndex;
+
+    if (--Rotation.nHeap > i) {
+        heapSet(i, Rotation.heap[Rotation.nHeap]);
+        siftUp(i);
+        siftDown(Rotation.heap[i]->heapIndex);
+    }
+    entry->heapIndex = -1;
+}
+
+/*
+ * The frontier of a stalest first walk over the heap that moves nothing,
+ * a min-heap of the positions whose parents have been visited.
+ */
+static void
+frontierPush(int *frontier, int *nFrontier, int i) {
+    int at = (*nFrontier)++;
+
+    while (at > 0 && staler(Rotation.heap[i], Rotation.heap[frontier[(at - 1) / 2]])) {
+        frontier[at] = frontier[(at - 1) / 2];
+        at = (at - 1) / 2;
+    }
+    frontier[at] = i;
+}
+
+static int
+frontierPop(int *frontier, int *nFrontier) {
+    int top = frontier[0], last = frontier[--(*nFrontier)], at = 0, child;
+
+    while ((child = 2 * at + 1) < *nFrontier) {
+        if (child + 1 < *nFrontier && staler(Rotation.heap[frontier[child + 1]], Rotation.heap[frontier[child]])) {
+            child++;
+        }
+        if (!staler(Rotation.heap[frontier[child]], Rotation.heap[last])) {
+            break;
+        }
+        frontier[at] = frontier[child];
+        at = child;
+    }
+    frontier[at] = last;
+    return top;
+}
+
+/*
+ * Set an entry's ordering, creating it if needed. Entries that are
+ * currently taken keep the new values for when they are released.
+ * Returns NULL if a new entry could not be allocated.
+ */
+static rotationEntry_t *
+setEntry(const char *code, int update, time_t lastUpdated) {
+    rotationEntry_t **slot, *entry;
+
+    /* Keep the table at most half full. */
+    if (Rotation.nEntries * 2 >= Rotation.nTable && growTable() == -1) {
+        return NULL;
+    }
+    slot = findSlot(code);
+    if ((entry = *slot) == NULL) {
+        if ((entry = calloc(1, sizeof(rotationEntry_t))) == NULL) {
+            return NULL;
+        }
+        if ((entry->code = strdup(code)) == NULL) {
+            free(entry);
+            return NULL;
+        }
+        entry->update = update;
+        entry->lastUpdated = lastUpdated;
+        entry->generation = Rotation.generation;
+        *slot = entry;
+        Rotation.nEntries++;
+        heapPush(entry);
+        return entry;
+    }
+    entry->update = update;
+    entry->lastUpdated = lastUpdated;
+    entry->removed = 0;
+    if (entry->heapIndex >= 0) {
+        siftUp(entry->heapIndex);
+        siftDown(entry->heapIndex);
+    }
+    return entry;
+}
+
+/*
+ * Read every listing's freshness from the database. Called without the
+ * rotation lock as it blocks on Postgres. Returns NULL on error.
+ */
+static PGresult *
+loadListings(void) {
+    struct pg_conn *conn;
+    PGresult *res;
+
+    conn = postgresConnect();
+
+    if (!conn) {
+        logCrit("Could not connect to Postgres Server.")
+        return NULL;
+    }
+
+    res = PQexec(conn, "SELECT code, coalesce(update, false), "
+                       "coalesce(extract(epoch from last_updated), 0)::bigint FROM nzx.listings;");
+
+    if (res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
+        logError("Problem is: %s", PQerrorMessage(conn))
+        PQclear(res);
+        PQfinish(conn);
+        return NULL;
+    }
+    PQfinish(conn);
+    return res;
+}
+
+/*
+ * Bring the rotation in line with a snapshot of nzx.listings, the caller
+ * holds the lock. Listings missing from it are removed, straight away if
+ * they are in the heap or once released if they are taken.
+ */
+static void
+mergeListings(const PGresult *res) {
+    rotationEntry_t *entry;
+    int i, row, nHeap = 0, failed = 0, removed = 0;
+
+    Rotation.generation++;
+    for (row = 0; row < PQntuples(res); row++) {
+        if (PQgetisnull(res, row, 0)) {
+            continue;
+        }
+        if ((entry = setEntry(PQgetvalue(res, row, 0), PQgetvalue(res, row, 1)[0] == 't',
+                              (time_t) strtoll(PQgetvalue(res, row, 2), NULL, 10))) == NULL) {
+            failed = 1;
+            continue;
+        }
+        entry->generation = Rotation.generation;
+    }
+    /* Without every row there is no telling which listings are gone. */
+    if (failed) {
+        logError("Out of memory loading the refresh rotation, some listings are missing.")
+        return;
+    }
+    for (i = 0; i < Rotation.nTable; i++) {
+        if ((entry = Rotation.table[i]) != NULL && entry->heapIndex == -1 &&
+            entry->generation != Rotation.generation) {
+            entry->removed = 1;
+        }
+    }
+    for (i = 0; i < Rotation.nHeap; i++) {
+        if ((entry = Rotation.heap[i])->generation == Rotation.generation) {
+            heapSet(nHeap++, entry);
+        } else {
+            dropEntry(entry);
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        Rotation.nHeap = nHeap;
+        for (i = nHeap / 2 - 1; i >= 0; i--) {
+            siftDown(i);
+        }
+        logInfo("Removed %d delisted codes from the refresh rotation.", removed)
+    }
+    logDebug("Loaded %d listings into the refresh rotation.", PQntuples(res))
+}
+
+/* Whether a code falls in [from, to], either bound may be NULL. */
+static inline int
+inRange(const char *code, const char *from, const char *to) {
+    return (from == NULL || strcmp(code, from) >= 0) && (to == NULL || strcmp(code, to) <= 0);
+}
+
+int
+nzxRotationTake(int budget, const char *from, const char *to, char **codes) {
+    rotationEntry_t **picked;
+    PGresult *res = NULL;
+    char *env;
+    int *frontier, count = 0, nPicked = 0, nFrontier = 0, i, due;
+
+    pthread_mutex_lock(&Rotation.rotationMutex);
+    if (Rotation.resync == 0) {
+        env = getenv(NZX_RESYNC_ENV);
+        Rotation.resync = env ? strtol(env, NULL, 10) : NZX_RESYNC_DEFAULT;
+    }
+    /* One caller loads the snapshot, the rest carry on with the rotation as it is. */
+    if ((due = !Rotation.resyncing && time(NULL) - Rotation.syncedAt >= Rotation.resync)) {
+        Rotation.resyncing = 1;
+        pthread_mutex_unlock(&Rotation.rotationMutex);
+        res = loadListings();
+        pthread_mutex_lock(&Rotation.rotationMutex);
+        Rotation.resyncing = 0;
+        if (res != NULL) {
+            mergeListings(res);
+            Rotation.syncedAt = time(NULL);
+        }
+    }
+    if (due && res == NULL && Rotation.nEntries == 0) {
+        pthread_mutex_unlock(&Rotation.rotationMutex);
+        return -1;
+    }
+    /*
+     * Walk the heap stalest first, a code outside the range is only
+     * stepped past so it keeps its place. Each visit costs log of the
+     * frontier, not of the whole rotation.
+     */
+    frontier = malloc((Rotation.nHeap + 1) * sizeof(int));
+    picked = malloc((budget > 0 ? budget : 1) * sizeof(rotationEntry_t *));
+    if (frontier == NULL || picked == NULL) {
+        pthread_mutex_unlock(&Rotation.rotationMutex);
+        free(frontier);
+        free(picked);
+        PQclear(res);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (Rotation.nHeap > 0) {
+        frontierPush(frontier, &nFrontier, 0);
+    }
+    while (nPicked < budget && nFrontier > 0) {
+        i = frontierPop(frontier, &nFrontier);
+        if (inRange(Rotation.heap[i]->code, from, to)) {
+            picked[nPicked++] = Rotation.heap[i];
+        }
+        if (2 * i + 1 < Rotation.nHeap) {
+            frontierPush(frontier, &nFrontier, 2 * i + 1);
+        }
+        if (2 * i + 2 < Rotation.nHeap) {
+            frontierPush(frontier, &nFrontier, 2 * i + 2);
+        }
+    }
+    /* Only now is anything moved, codes that cannot be copied stay in the heap. */
+    while (count < nPicked && (codes[count] = strdup(picked[count]->code)) != NULL) {
+        heapRemove(picked[count++]);
+    }
+    free(frontier);
+    free(picked);
+    pthread_mutex_unlock(&Rotation.rotationMutex);
+    PQclear(res);
+    return count;
+}
+
+void
+nzxRotationRelease(const char *code, int refreshed) {
+    rotationEntry_t *entry;
+
+    pthread_mutex_lock(&Rotation.rotationMutex);
+    if (Rotation.nTable > 0 && (entry = *findSlot(code)) != NULL && entry->heapIndex == -1) {
+        if (entry->removed) {
+            dropEntry(entry);
+            pthread_mutex_unlock(&Rotation.rotationMutex);
+            return;
+        }
+        if (refreshed) {
+            entry->update = 0;
+            entry->lastUpdated = time(NULL);
+        }
+        heapPush(entry);
+    }
+    pthread_mutex_unlock(&Rotation.rotationMutex);
+}
+
+void
+nzxRotationFlag(const char *code) {
+    rotationEntry_t *entry;
+
+    pthread_mutex_lock(&Rotation.rotationMutex);
+    if ((entry = setEntry(code, 1, 0)) == NULL) {
+        logError("Could not add %s to the refresh rotation.", code)
+    } else if (Rotation.resyncing) {
+        /* The snapshot being loaded may predate it, it must survive the merge. */
+        entry->generation = Rotation.generation + 1;
+    }
+    pthread_mutex_unlock(&Rotation.rotationMutex);
+}
@@ -0,0 +1,49 @@
+//
+// Created by Matthew Johnson on 24/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_ROTATION_H
+#define INVEST_FETCH_C_ROTATION_H
+
+#include <errno.h>
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../helpers/postgres.h"
+#include "../logging/logger.h"
+
+/*
+ * The performance refresh rotation. Every listing is kept in a min-heap
+ * ordered by (update flag set first, least recently updated first) so
+ * each cycle can take the stalest listings without asking the database.
+ * The heap is loaded from nzx.listings on first use and resynced every
+ * NZX_ROTATION_RESYNC seconds (default 3600), outside the rotation lock.
+ * Listings no longer in the table are dropped at each resync.
+ */
+
+/*
+ * Take up to budget of the stalest codes between from and to (inclusive,
+ * either may be NULL for no bound) out of the rotation. Each is copied
+ * into codes (which the caller frees) and must be handed back with
+ * nzxRotationRelease(). Returns the number taken or -1 if the rotation
+ * could not be loaded or there was no memory to take any.
+ */
+int nzxRotationTake(int budget, const char *from, const char *to, char **codes);
+
+/*
+ * Put a taken code back. If refreshed it goes to the back of the rotation,
+ * otherwise it keeps its place.
+ */
+void nzxRotationRelease(const char *code, int refreshed);
+
+/*
+ * Add a listing that needs refreshing as soon as possible, e.g. a newly
+ * inserted one.
+ */
+void nzxRotationFlag(const char *code);
+
+#endif //INVEST_FETCH_C_ROTATION_H
@@ -0,0 +1,171 @@
+//
+// Created by Matthew Johnson on 30/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "reactor.h"
+
+/* Most events taken from the kernel in one wait. */
+#define REACTOR_EVENTS 32
+
+/* Reactor flags */
+#define REACTOR_STOP 0x01u
+
+/*
+ * A watched descriptor.
+ */
+typedef struct reactorHandler {
+    struct reactorHandler *handlerNext;     /* linked list of all handlers */
+    int fd;                                 /* -1 once removed */
+    reactorFunc func;                       /* called when fd is ready */
+    void *arg;                              /* its argument */
+} reactorHandler_t;
+
+struct reactor {
+    int epollFd;                        /* the epoll instance */
+    reactorHandler_t *handlerHead;      /* every handler, removed ones until the end of the wait */
+    unsigned int reactorFlags;          /* see above */
+};
+
+reactor_t *
+reactorCreate(void) {
+    reactor_t *reactor;
+    int error;
+
+    if ((reactor = calloc(1, sizeof(*reactor))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((reactor->epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        error = errno;
+        free(reactor);
+        errno = error;
+        return NULL;
+    }
+    return reactor;
+}
+
+static reactorHandler_t *
+findHandler(reactor_t *reactor, int fd) {
+    reactorHandler_t *handler;
+
+    for (handler = reactor->handlerHead; handler != NULL; handler = handler->handlerNext) {
+        if (handler->fd == fd) {
+            return handler;
+        }
+    }
+    return NULL;
+}
+
+int
+reactorAdd(reactor_t *reactor, int fd, uint32_t events, reactorFunc func, void *arg) {
+    reactorHandler_t *handler;
+    struct epoll_event event;
+    int error;
+
+    if ((handler = malloc(sizeof(*handler))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    handler->fd = fd;
+    handler->func = func;
+    handler->arg = arg;
+
+    event.events = events;
+    event.data.ptr = handler;
+    if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        error = errno;
+        free(handler);
+        errno = error;
+        return -1;
+    }
+    handler->handlerNext = reactor->handlerHead;
+    reactor->handlerHead = handler;
+    return 0;
+}
+
+int
+reactorModify(reactor_t *reactor, int fd, uint32_t events) {
+    reactorHandler_t *handler;
+    struct epoll_event event;
+
+    if ((handler = findHandler(reactor, fd)) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void
+reactorRemove(reactor_t *reactor, int fd) {
+    reactorHandler_t *handler;
+
+    if ((handler = findHandler(reactor, fd)) == NULL) {
+        return;
+    }
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    /* Events for it may still be waiting in this round, it is freed after. */
+    handler->fd = -1;
+}
+
+/*
+ * Free the handlers removed during the last round.
+ */
+static void
+reapHandlers(reactor_t *reactor) {
+    reactorHandler_t **link = &reactor->handlerHead, *handler;
+
+    while ((handler = *link) != NULL) {
+        if (handler->fd == -1) {
+            *link = handler->handlerNext;
+            free(handler);
+        } else {
+            link = &handler->handlerNext;
+        }
+    }
+}
+
+int
+reactorRun(reactor_t *reactor) {
+    struct epoll_event events[REACTOR_EVENTS];
+    reactorHandler_t *handler;
+    int i, n;
+
+    reactor->reactorFlags &= ~REACTOR_STOP;
+    while (!(reactor->reactorFlags & REACTOR_STOP)) {
+        if ((n = epoll_wait(reactor->epollFd, events, REACTOR_EVENTS, -1)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logError("Reactor wait failed: %d", errno)
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            handler = (reactorHandler_t *) events[i].data.ptr;
+            if (handler->fd != -1) {
+                handler->func(handler->fd, events[i].events, handler->arg);
+            }
+        }
+        reapHandlers(reactor);
+    }
+    return 0;
+}
+
+void
+reactorStop(reactor_t *reactor) {
+    reactor->reactorFlags |= REACTOR_STOP;
+}
+
+void
+reactorDestroy(reactor_t *reactor) {
+    reactorHandler_t *handler;
+
+    while ((handler = reactor->handlerHead) != NULL) {
+        reactor->handlerHead = handler->handlerNext;
+        free(handler);
+    }
+    close(reactor->epollFd);
+    free(reactor);
+}
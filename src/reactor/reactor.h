@@ -0,0 +1,72 @@
+//
+// Created by Matthew Johnson on 30/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_REACTOR_H
+#define INVEST_FETCH_C_REACTOR_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "../logging/logger.h"
+
+/*
+ * The reactor_t type is opaque to the client.
+ * A reactor waits on a set of file descriptors with epoll and calls
+ * each one's handler on the thread running reactorRun() when it
+ * becomes ready. Handlers must not block.
+ */
+typedef struct reactor reactor_t;
+
+/*
+ * Called with the ready events (EPOLLIN, EPOLLOUT, EPOLLERR, ...).
+ */
+typedef void (*reactorFunc)(int fd, uint32_t events, void *arg);
+
+/*
+ * Create a reactor.
+ * On error, reactorCreate() returns NULL with errno set to the error code.
+ */
+reactor_t *reactorCreate(void);
+
+/*
+ * Watch fd for events (level triggered). A descriptor can only be
+ * added once.
+ * On error, reactorAdd() returns -1 with errno set to the error code.
+ */
+int reactorAdd(reactor_t *reactor, int fd, uint32_t events, reactorFunc func, void *arg);
+
+/*
+ * Change the events fd is watched for.
+ * On error, reactorModify() returns -1 with errno set to the error code.
+ */
+int reactorModify(reactor_t *reactor, int fd, uint32_t events);
+
+/*
+ * Stop watching fd. Safe to call from any handler, including fd's own,
+ * its handler is not called again. The descriptor is not closed.
+ */
+void reactorRemove(reactor_t *reactor, int fd);
+
+/*
+ * Dispatch events until reactorStop() is called.
+ * On error, reactorRun() returns -1 with errno set to the error code.
+ */
+int reactorRun(reactor_t *reactor);
+
+/*
+ * Make reactorRun() return once the current handlers have finished.
+ * Must be called from a handler.
+ */
+void reactorStop(reactor_t *reactor);
+
+/*
+ * Release a reactor that is not running.
+ */
+void reactorDestroy(reactor_t *reactor);
+
+#endif //INVEST_FETCH_C_REACTOR_H
@@ -20,19 +20,110 @@
 
 #define NZX_BOARD_ENV "NZX_BOARD_SRC"
 #define NZX_INST_ENV "NZX_INST_SRC"
+#define NZX_BUDGET_ENV "NZX_PERF_BUDGET"
+#define NZX_PARALLEL_ENV "NZX_PERF_PARALLEL"
+#define NZX_PERF_PARALLEL 4
+#define NZX_PERF_MAX_PARALLEL 64
+/* Seconds an idle fetch thread is kept. */
+#define NZX_FETCH_LINGER 60
+
+#define SCHEDULE_PATH_ENV "INVEST_SCHEDULE_PATH"
+#define SCHEDULE_DEFAULT_PATH "invest_fetch.schedule"
+
+/*
+ * Arguments a task can give its job, sent after the job number in the
+ * ADD command as key=value fields, e.g. "url=...,from=A,to=M,batch=10".
+ * Anything left out falls back to the environment.
+ */
+typedef struct jobArgs {
+    char *url;      /* board (or instrument base) URL to fetch */
+    char *from;     /* first instrument code to refresh */
+    char *to;       /* last instrument code to refresh */
+    int batch;      /* instruments refreshed per run, 0 for the default */
+} jobArgs_t;
+
+static void freeJobArgs(void *args) {
+    jobArgs_t *jobArgs = (jobArgs_t *) args;
+
+    free(jobArgs->url);
+    free(jobArgs->from);
+    free(jobArgs->to);
+    free(jobArgs);
+}
+
+/*
+ * Parse the key=value fields of an ADD command.
+ * Returns NULL with errno set to EINVAL if a field is unknown or invalid.
+ */
+static jobArgs_t *parseJobArgs(const char *params) {
+    char *copy, *field, *value, *save = NULL, *end;
+    jobArgs_t *args;
+    long batch;
+
+    args = (jobArgs_t *) calloc(1, sizeof(jobArgs_t));
+    copy = strdup(params);
+    for (field = strtok_r(copy, REDIS_DELIM, &save); field != NULL; field = strtok_r(NULL, REDIS_DELIM, &save)) {
+        if ((value = strchr(field, '=')) == NULL) {
+            goto invalid;
+        }
+        *value++ = '\0';
+        if (strcmp(field, "url") == 0 && args->url == NULL) {
+            args->url = strdup(value);
+        } else if (strcmp(field, "from") == 0 && args->from == NULL) {
+            args->from = strdup(value);
+        } else if (strcmp(field, "to") == 0 && args->to == NULL) {
+            args->to = strdup(value);
+        } else if (strcmp(field, "batch") == 0) {
+            batch = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || batch < 1 || batch > NZX_PERF_MAX_BUDGET) {
+                goto invalid;
+            }
+            args->batch = (int) batch;
+        } else {
+            goto invalid;
+        }
+    }
+    free(copy);
+    return args;
+
+    invalid:
+    logError("Invalid job argument: %s", field)
+    free(copy);
+    freeJobArgs(args);
+    errno = EINVAL;
+    return NULL;
+}
+
+/* The URL a job fetches, from its task if it was given one. */
+static char *jobUrl(const jobArgs_t *args, const char *env) {
+    char *url = args != NULL && args->url != NULL ? args->url : getenv(env);
+
+    if (!url) {
+        logCrit("ENV %s is not set!", env)
+    }
+    return url;
+}
+
+static void listingsInserted(nzxNode_t *inserted, void *args) {
+    (void) args;
+    for (; inserted != NULL; inserted = inserted->next) {
+        logInfo("New listing: %s", inserted->listing.Code)
+        /* Get its performance on the next refresh. */
+        nzxRotationFlag(inserted->listing.Code);
+    }
+}
 
 void *collectListings(void *args) {
     /* Download the market data. */
-    char *url = getenv(NZX_BOARD_ENV);
+    char *url = jobUrl((jobArgs_t *) args, NZX_BOARD_ENV);
     if (!url) {
-        logCrit("ENV %s is not set!", NZX_BOARD_ENV);
         return NULL;
     }
     memoryChunk_t *chunk = nzxFetchData(url);
     nzxNode_t *head = NULL;
-    /* Process and store the market listings. */
+    /* Process and queue the market listings for storage. */
     nzxExtractMarketListings(chunk, &head);
-    nzxStoreMarketListings(head);
+    nzxStoreMarketListings(head, listingsInserted, NULL);
     /* Finished with the data so free the memory. */
     nzxDrainListings(&head);
     nzxFreeMemoryChunk(chunk);
@@ -41,51 +132,237 @@ void *collectListings(void *args) {
 
 void *collectPrices(void *args) {
     /* Download the market data. */
-    char *url = getenv(NZX_BOARD_ENV);
+    char *url = jobUrl((jobArgs_t *) args, NZX_BOARD_ENV);
     if (!url) {
-        logCrit("ENV %s is not set!", NZX_BOARD_ENV);
         return NULL;
     }
     memoryChunk_t *chunk = nzxFetchData(url);
     nzxNode_t *head = NULL;
-    /* Process and store the market listings. */
+    time_t observed;
+    /* Process and queue the market prices for storage. */
     nzxExtractMarketPrices(chunk, &head);
-    nzxStoreMarketPrices(head);
+    observed = nzxPriceObserved(chunk);
+    nzxStoreMarketPrices(head, observed);
+    nzxBarsUpdate(head, observed);
     /* Finished with the data so free the memory. */
     nzxDrainListings(&head);
     nzxFreeMemoryChunk(chunk);
     return NULL;
 }
 
+/*
+ * Instrument fetches run on their own pool, sized by NZX_PERF_PARALLEL
+ * (default 4). On the scheduler's pool they would bypass its class
+ * admission and could take the workers kept for critical jobs, and a
+ * job waiting on them would run other jobs on its own stack.
+ */
+static threadPool_t *fetchPool = NULL;
+static int fetchParallel = NZX_PERF_PARALLEL;
+
+static void startFetchPool(void) {
+    char *env = getenv(NZX_PARALLEL_ENV);
+
+    if (env != NULL) {
+        fetchParallel = (int) strtol(env, NULL, 10);
+    }
+    if (fetchParallel < 1) {
+        fetchParallel = 1;
+    } else if (fetchParallel > NZX_PERF_MAX_PARALLEL) {
+        fetchParallel = NZX_PERF_MAX_PARALLEL;
+    }
+    /* Without it the fetches run one at a time on the job itself. */
+    if ((fetchPool = thrPoolCreate(0, (uint16_t) fetchParallel, NZX_FETCH_LINGER, NULL)) == NULL) {
+        logError("Could not create the fetch pool: %d", errno)
+    }
+}
+
+/*
+ * One instrument's fetch, run as a future of the performance job.
+ */
+typedef struct perfFetch {
+    const char *url;
+    nzxPerformanceList_t *entry;
+} perfFetch_t;
+
+static void *fetchPerformance(void *arg) {
+    perfFetch_t *fetch = (perfFetch_t *) arg;
+
+    char buff[strlen(fetch->url) + strlen(fetch->entry->node->code) + 1];
+    snprintf(buff, sizeof(buff), "%s%s", fetch->url, fetch->entry->node->code);
+    memoryChunk_t *chunk = nzxFetchData(buff);
+    int rc = nzxExtractListingPerformance(chunk, fetch->entry->node);
+    nzxFreeMemoryChunk(chunk);
+    /* Any non-NULL result marks a failure. */
+    return rc == -1 ? fetch : NULL;
+}
+
+/* Collect a fetch's outcome, clearing its entry if it succeeded. */
+static void joinPerformance(thrFuture_t *future, perfFetch_t *fetch) {
+    void *failed;
+
+    if (thrFutureWait(future, &failed) == 0 && failed == NULL) {
+        fetch->entry = NULL;
+    }
+    thrFutureRelease(future);
+}
+
 void *collectPerformance(void *args) {
+    jobArgs_t *jobArgs = (jobArgs_t *) args;
     nzxPerformanceList_t *head = NULL;
     nzxPerformanceList_t *iter;
+    perfFetch_t *fetches;
+    thrFuture_t **futures;
+    char *budget;
+    int batch, count, i;
 
-    char *url = getenv(NZX_INST_ENV);
+    char *url = jobUrl(jobArgs, NZX_INST_ENV);
     if (!url) {
-        logCrit("ENV %s is not set!", NZX_INST_ENV);
         return NULL;
     }
+    if (jobArgs != NULL && jobArgs->batch > 0) {
+        batch = jobArgs->batch;
+    } else {
+        budget = getenv(NZX_BUDGET_ENV);
+        batch = budget ? (int) strtol(budget, NULL, 10) : NZX_PERF_BUDGET;
+    }
+    if (batch > NZX_PERF_MAX_BUDGET) {
+        batch = NZX_PERF_MAX_BUDGET;
+    }
 
-    nzxGetUpdateCodes(&head);
-    iter = head;
-    while (iter != NULL) {
-
-        char buff[strlen(url) + sizeof(iter->node->code) + 1];
-        snprintf(buff, sizeof(buff), "%s%s", url, iter->node->code);
-        memoryChunk_t *chunk = nzxFetchData(buff);
-        nzxExtractListingPerformance(chunk, iter->node);
-
-        nzxFreeMemoryChunk(chunk);
-        iter = iter->next;
+    /* A task given a code range only refreshes its shard of the listings. */
+    if ((count = nzxGetUpdateCodes(&head, batch, jobArgs ? jobArgs->from : NULL, jobArgs ? jobArgs->to : NULL)) <= 0) {
+        return NULL;
+    }
+    fetches = malloc(count * sizeof(perfFetch_t));
+    futures = calloc(count, sizeof(thrFuture_t *));
+    if (fetches == NULL || futures == NULL) {
+        logError("Could not allocate the performance fetches.")
+        free(fetches);
+        free(futures);
+        /* Dropping them hands the codes back to the rotation. */
+        while (head != NULL) {
+            nzxDropUpdateCode(&head, head);
+        }
+        return NULL;
+    }
+    for (i = 0, iter = head; iter != NULL; iter = iter->next, i++) {
+        fetches[i].url = url;
+        fetches[i].entry = iter;
+    }
+    /*
+     * Keep up to fetchParallel instruments in flight on the fetch pool.
+     * If it is missing, or a fetch can't be queued, the fetch runs here.
+     */
+    for (i = 0; i < count; i++) {
+        if (i >= fetchParallel && futures[i - fetchParallel] != NULL) {
+            joinPerformance(futures[i - fetchParallel], &fetches[i - fetchParallel]);
+        }
+        futures[i] = fetchPool ? thrPoolSubmit(fetchPool, fetchPerformance, &fetches[i]) : NULL;
+        if (futures[i] == NULL && fetchPerformance(&fetches[i]) == NULL) {
+            fetches[i].entry = NULL;
+        }
+    }
+    for (i = count > fetchParallel ? count - fetchParallel : 0; i < count; i++) {
+        if (futures[i] != NULL) {
+            joinPerformance(futures[i], &fetches[i]);
+        }
     }
+    /* Entries still set failed or never ran. */
+    for (i = 0; i < count; i++) {
+        if (fetches[i].entry != NULL) {
+            nzxDropUpdateCode(&head, fetches[i].entry);
+        }
+    }
+    free(fetches);
+    free(futures);
     nzxStoreListingPerformance(&head);
     return NULL;
 }
 
-static void processRedisStream(scheduler_t *scheduler, redisReply *data) {
+/*
+ * State shared with the Redis handler.
+ */
+typedef struct managerStream {
+    redisContext *conn;
+    scheduler_t *scheduler;
+    reactor_t *reactor;
+    journal_t *journal;     /* NULL if the schedule is not kept */
+} managerStream_t;
+
+static int scheduleJob(scheduler_t *scheduler, const char *taskId, const char *taskCron, int repeatable, int job,
+                       const char *params) {
+    jobArgs_t *args = NULL;
     task_t *task;
-    char *taskOpt, *taskId, *taskRepeat, *taskCron, *taskFunc, *raw;
+
+    if (params != NULL && *params != '\0' && (args = parseJobArgs(params)) == NULL) {
+        logError("Invalid arguments for task %s: %s", taskId, params)
+        errno = EINVAL;
+        return -1;
+    }
+    switch (job) {
+        case JOB_PRICE:
+            task = taskCreate(taskId, taskCron, repeatable, collectPrices);
+            break;
+        case JOB_LISTINGS:
+            task = taskCreate(taskId, taskCron, repeatable, collectListings);
+            break;
+        case JOB_PERFORMANCE:
+            task = taskCreate(taskId, taskCron, repeatable, collectPerformance);
+            break;
+        default:
+            logError("Unknown task function requested: %d", job);
+            errno = EINVAL;
+            task = NULL;
+    }
+    if (task == NULL) {
+        if (job >= JOB_PRICE && job <= JOB_PERFORMANCE && errno == ENOMEM) {
+            logError("No memory for task %s.", taskId)
+        } else if (job >= JOB_PRICE && job <= JOB_PERFORMANCE) {
+            logError("Invalid CRON expression for task %s: %s", taskId, taskCron)
+        }
+        if (args != NULL) {
+            freeJobArgs(args);
+        }
+        return -1;
+    }
+    if (args != NULL) {
+        taskSetArg(task, args, freeJobArgs);
+    }
+    /*
+     * Prices can overlap and always get a worker, a slow listings or
+     * performance fetch must not pile up behind itself.
+     */
+    switch (job) {
+        case JOB_PRICE:
+            taskSetClass(task, TASK_CLASS_CRITICAL);
+            taskSetKind(task, "prices");
+            break;
+        case JOB_LISTINGS:
+            taskSetOverlap(task, TASK_OVERLAP_COALESCE);
+            taskSetKind(task, "listings");
+            break;
+        case JOB_PERFORMANCE:
+            taskSetOverlap(task, TASK_OVERLAP_SKIP);
+            taskSetClass(task, TASK_CLASS_BULK);
+            taskSetKind(task, "performance");
+            break;
+        default:
+            break;
+    }
+    return taskAdd(scheduler, task);
+}
+
+/* A task that can never be scheduled is dropped, one that ran out of memory is kept for the next start. */
+static int journalRestored(const char *id, const char *pattern, int repeat, int job, const char *params,
+                           void *args) {
+    if (scheduleJob((scheduler_t *) args, id, pattern, repeat, job, params) == -1 && errno != ENOMEM) {
+        return -1;
+    }
+    return 0;
+}
+
+static void processRedisStream(managerStream_t *stream, redisReply *data) {
+    char *taskOpt, *taskId, *taskRepeat, *taskCron, *taskFunc, *taskParams, *raw;
     int op, job, repeatable;
 
     /* Extract the header data from the message. */
@@ -114,6 +391,8 @@ static void processRedisStream(scheduler_t *scheduler, redisReply *data) {
             taskCron = strtok_r(raw, REDIS_DELIM, &raw);
             taskRepeat = strtok_r(raw, REDIS_DELIM, &raw);
             taskFunc = strtok_r(raw, REDIS_DELIM, &raw);
+            /* Whatever follows the job is its key=value arguments. */
+            taskParams = raw;
             /* Check if there was enough data in the pkt. */
             if (taskCron == NULL || taskRepeat == NULL || taskFunc == NULL) {
                 logError("Not enough data to form packet body")
@@ -144,24 +423,17 @@ static void processRedisStream(scheduler_t *scheduler, redisReply *data) {
                 logError("Invalid repeat option: %d", repeatable)
                 return;
             }
-            switch (job) {
-                case JOB_PRICE:
-                    task = taskCreate(taskId, taskCron, repeatable, collectPrices);
-                    break;
-                case JOB_LISTINGS:
-                    task = taskCreate(taskId, taskCron, repeatable, collectListings);
-                    break;
-                case JOB_PERFORMANCE:
-                    task = taskCreate(taskId, taskCron, repeatable, collectPerformance);
-                    break;
-                default:
-                    logError("Unknown task function requested: %d", job);
-                    return;
+            if (scheduleJob(stream->scheduler, taskId, taskCron, repeatable, job, taskParams) == 0 && repeatable &&
+                stream->journal != NULL &&
+                journalAdd(stream->journal, taskId, taskCron, repeatable, job, taskParams) == -1) {
+                logError("Could not journal task %s: %d", taskId, errno)
             }
-            taskAdd(scheduler, task);
             break;
         case OP_TASK_DEL:
-            taskDelete(scheduler, taskId);
+            taskDelete(stream->scheduler, taskId);
+            if (stream->journal != NULL && journalDelete(stream->journal, taskId) == -1) {
+                logError("Could not journal the delete of task %s: %d", taskId, errno)
+            }
             break;
         default:
             logError("Unknown op code: %d", op)
@@ -202,26 +474,104 @@ static redisContext *connectRedis(void) {
     return context;
 }
 
+/* Handle every complete message hiredis has buffered. */
+static void drainReplies(managerStream_t *stream) {
+    redisReply *reply;
+
+    for (;;) {
+        if (redisGetReplyFromReader(stream->conn, (void *) &reply) != REDIS_OK) {
+            logCrit("Invalid REDIS reply: %s", stream->conn->errstr)
+            reactorStop(stream->reactor);
+            return;
+        }
+        /* Wait for the rest of a partial message. */
+        if (reply == NULL) {
+            return;
+        }
+        if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
+            processRedisStream(stream, reply);
+        }
+        freeReplyObject(reply);
+    }
+}
+
+/* The Redis socket is readable. */
+static void redisReadable(int fd, uint32_t events, void *args) {
+    managerStream_t *stream = (managerStream_t *) args;
+
+    (void) fd;
+    (void) events;
+    if (redisBufferRead(stream->conn) != REDIS_OK) {
+        logCrit("Lost the REDIS connection: %s", stream->conn->errstr)
+        reactorStop(stream->reactor);
+        return;
+    }
+    drainReplies(stream);
+}
+
 void managerStreamTasks(void) {
-    redisContext *conn;
+    managerStream_t stream;
     redisReply *reply;
-    pthread_t t1;
-    scheduler_t *scheduler;
+    char *path;
     /* Connect to the redis server. */
-    conn = connectRedis();
-    if (conn == NULL) {
+    stream.conn = connectRedis();
+    if (stream.conn == NULL) {
+        return;
+    }
+    /* Commands and task deadlines are both handled on this thread. */
+    if ((stream.reactor = reactorCreate()) == NULL) {
+        logCrit("Could not create the reactor: %d", errno)
+        redisFree(stream.conn);
         return;
     }
+    /* Jobs may fetch on it as soon as the scheduler runs them. */
+    startFetchPool();
+    /* Bars that no later price batch closes are written by the sweeper. */
+    if (nzxBarsStart() == -1) {
+        logError("Could not start the bar sweeper: %d", errno)
+    }
     /* Create the scheduler. */
-    scheduler = schedulerCreate();
-    pthread_create(&t1, NULL, schedulerProcess, scheduler);
+    if ((stream.scheduler = schedulerCreate()) == NULL || schedulerAttach(stream.scheduler, stream.reactor) == -1) {
+        logCrit("Could not start the scheduler: %d", errno)
+        if (stream.scheduler) {
+            schedulerDestroy(stream.scheduler);
+        }
+        if (fetchPool != NULL) {
+            thrPoolDestroy(fetchPool);
+            fetchPool = NULL;
+        }
+        nzxBarsStop();
+        reactorDestroy(stream.reactor);
+        redisFree(stream.conn);
+        return;
+    }
+
+    /* Arm the last known schedule before the control plane has said anything. */
+    path = getenv(SCHEDULE_PATH_ENV);
+    if ((stream.journal = journalOpen(path ? path : SCHEDULE_DEFAULT_PATH, journalRestored, stream.scheduler)) == NULL) {
+        logError("Could not open the schedule journal: %d", errno)
+    }
 
-    reply = redisCommand(conn, REDIS_SUB_COMMAND);
+    reply = redisCommand(stream.conn, REDIS_SUB_COMMAND);
     freeReplyObject(reply);
-    while (redisGetReply(conn, (void *) &reply) == REDIS_OK) {
-        if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
-            processRedisStream(scheduler, reply);
-        }
-        freeReplyObject(reply);
+    if (reactorAdd(stream.reactor, stream.conn->fd, EPOLLIN, redisReadable, &stream) == -1) {
+        logCrit("Could not watch the REDIS connection: %d", errno)
+    } else {
+        /* Messages may have arrived along with the subscribe reply. */
+        drainReplies(&stream);
+        reactorRun(stream.reactor);
     }
-}
\ No newline at end of file
+    if (stream.journal != NULL) {
+        journalClose(stream.journal);
+    }
+    schedulerDestroy(stream.scheduler);
+    /* After the scheduler, no job is left waiting on a fetch. */
+    if (fetchPool != NULL) {
+        thrPoolDestroy(fetchPool);
+        fetchPool = NULL;
+    }
+    /* No price job is left to update the bars. */
+    nzxBarsStop();
+    reactorDestroy(stream.reactor);
+    redisFree(stream.conn);
+}
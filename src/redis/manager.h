@@ -15,7 +15,10 @@
 #include "../logging/logger.h"
 #include "../nzx/priceHandler.h"
 #include "../nzx/performance.h"
+#include "../nzx/bars.h"
+#include "../reactor/reactor.h"
 #include "../scheduler/schedule.h"
+#include "../scheduler/journal.h"
 
 void managerStreamTasks(void);
 
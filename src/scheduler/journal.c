@@ -0,0 +1,582 @@
+//
+// Created by Matthew Johnson on 02/05/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "journal.h"
+
+#define JOURNAL_BUCKETS 1024
+/* Compact once the log holds this many records more than there are tasks. */
+#define JOURNAL_SLACK 1024
+
+/*
+ * A live task.
+ */
+typedef struct journalEntry {
+    struct journalEntry *entryNext;     /* chained in its bucket */
+    char *id;
+    char *pattern;
+    int repeat;
+    int job;
+    char *params;                       /* job arguments, "" if none */
+} journalEntry_t;
+
+/*
+ * An add or delete waiting for the journal thread.
+ */
+typedef struct journalChange {
+    struct journalChange *changeNext;   /* in submission order */
+    journalEntry_t *entry;              /* the task added */
+    char *id;                           /* the task deleted, if entry is NULL */
+} journalChange_t;
+
+/* Journal flags */
+#define JOURNAL_EXIT 0x01               /* write what is queued and stop */
+
+struct journal {
+    char *snapshotPath;                 /* every live task */
+    char *logPath;                      /* changes since the snapshot */
+    int logFd;                          /* opened for appending, -1 if not */
+    off_t logSize;                      /* bytes of whole records in the log */
+    journalEntry_t *buckets[JOURNAL_BUCKETS];
+    int nEntries;                       /* live tasks */
+    int nRecords;                       /* records in the log */
+    pthread_mutex_t journalMutex;       /* protects the change queue */
+    pthread_cond_t journalWorkcv;       /* signaled when a change is queued */
+    pthread_t journalTid;               /* writes the changes */
+    journalChange_t *changeHead;        /* waiting to be written */
+    journalChange_t **changeTail;
+    unsigned int journalFlags;          /* see above */
+    int running;                        /* journalTid was started */
+};
+
+static unsigned int
+hashId(const char *id) {
+    unsigned int hash = 2166136261u;
+
+    while (*id) {
+        hash = (hash ^ (unsigned char) *id++) * 16777619u;
+    }
+    return hash;
+}
+
+static journalEntry_t **
+findEntry(journal_t *journal, const char *id) {
+    journalEntry_t **link = &journal->buckets[hashId(id) % JOURNAL_BUCKETS];
+
+    while (*link != NULL && strcmp((*link)->id, id) != 0) {
+        link = &(*link)->entryNext;
+    }
+    return link;
+}
+
+static void
+freeEntry(journalEntry_t *entry) {
+    free(entry->id);
+    free(entry->pattern);
+    free(entry->params);
+    free(entry);
+}
+
+/*
+ * Copy a task's fields. On error, newEntry() returns NULL with errno set
+ * to ENOMEM.
+ */
+static journalEntry_t *
+newEntry(const char *id, const char *pattern, int repeat, int job, const char *params) {
+    journalEntry_t *entry;
+
+    if ((entry = calloc(1, sizeof(journalEntry_t))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->id = strdup(id);
+    entry->pattern = strdup(pattern);
+    entry->params = strdup(params);
+    if (entry->id == NULL || entry->pattern == NULL || entry->params == NULL) {
+        freeEntry(entry);
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->repeat = repeat;
+    entry->job = job;
+    return entry;
+}
+
+/*
+ * Add an entry, replacing any with the same id. Cannot fail.
+ */
+static void
+installEntry(journal_t *journal, journalEntry_t *entry) {
+    journalEntry_t **link = findEntry(journal, entry->id), *old;
+
+    if ((old = *link) != NULL) {
+        entry->entryNext = old->entryNext;
+        freeEntry(old);
+    } else {
+        entry->entryNext = NULL;
+        journal->nEntries++;
+    }
+    *link = entry;
+}
+
+static void
+removeEntry(journal_t *journal, const char *id) {
+    journalEntry_t **link = findEntry(journal, id), *entry;
+
+    if ((entry = *link) != NULL) {
+        *link = entry->entryNext;
+        freeEntry(entry);
+        journal->nEntries--;
+    }
+}
+
+/*
+ * Apply one record:
+ *  A <id> <pattern> <repeat> <job> [<params>]
+ *  D <id>
+ */
+static int
+applyRecord(journal_t *journal, char *line) {
+    char *fields[6], *field, *save = NULL;
+    journalEntry_t *entry;
+    int n = 0;
+
+    for (field = strtok_r(line, "\t", &save); field != NULL && n < 6; field = strtok_r(NULL, "\t", &save)) {
+        fields[n++] = field;
+    }
+    if (n == 2 && strcmp(fields[0], "D") == 0) {
+        removeEntry(journal, fields[1]);
+        return 0;
+    }
+    if ((n == 5 || n == 6) && strcmp(fields[0], "A") == 0) {
+        if ((entry = newEntry(fields[1], fields[2], (int) strtol(fields[3], NULL, 10),
+                              (int) strtol(fields[4], NULL, 10), n == 6 ? fields[5] : "")) == NULL) {
+            return -1;
+        }
+        installEntry(journal, entry);
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Apply every complete line of a file, a torn last line is ignored.
+ * A missing file is empty.
+ */
+static int
+loadFile(journal_t *journal, const char *path) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    FILE *file;
+    int count = 0;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((len = getline(&line, &capacity, file)) > 0) {
+        if (line[len - 1] != '\n') {
+            logWarn("Ignoring a torn record at the end of %s.", path)
+            break;
+        }
+        line[len - 1] = '\0';
+        if (applyRecord(journal, line) == -1) {
+            if (errno == ENOMEM) {
+                free(line);
+                fclose(file);
+                errno = ENOMEM;
+                return -1;
+            }
+            logWarn("Ignoring a malformed record in %s.", path)
+        }
+        count++;
+    }
+    free(line);
+    fclose(file);
+    return count;
+}
+
+static int
+writeEntry(FILE *file, const journalEntry_t *entry) {
+    return fprintf(file, "A\t%s\t%s\t%d\t%d%s%s\n", entry->id, entry->pattern, entry->repeat, entry->job,
+                   *entry->params ? "\t" : "", entry->params) < 0 ? -1 : 0;
+}
+
+/*
+ * Make sure a rename into dir survives a crash.
+ */
+static void
+syncDirectory(const char *path) {
+    char *dir = strdup(path), *slash;
+    int fd;
+
+    if ((slash = strrchr(dir, '/')) != NULL) {
+        *(slash == dir ? slash + 1 : slash) = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+
+/*
+ * Write every live task to a new snapshot and start an empty log. The
+ * snapshot replaces the old one before the log is truncated, a crash in
+ * between replays the log over it again which changes nothing.
+ */
+static int
+compact(journal_t *journal) {
+    size_t len = strlen(journal->snapshotPath) + sizeof(".tmp");
+    char tmpPath[len];
+    journalEntry_t *entry;
+    FILE *file;
+    int i, error = 0;
+
+    snprintf(tmpPath, len, "%s.tmp", journal->snapshotPath);
+    if ((file = fopen(tmpPath, "w")) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < JOURNAL_BUCKETS && error == 0; i++) {
+        for (entry = journal->buckets[i]; entry != NULL && error == 0; entry = entry->entryNext) {
+            error = writeEntry(file, entry);
+        }
+    }
+    if (error == -1 || fflush(file) == EOF || fsync(fileno(file)) == -1) {
+        error = errno;
+        fclose(file);
+        unlink(tmpPath);
+        errno = error;
+        return -1;
+    }
+    fclose(file);
+    if (rename(tmpPath, journal->snapshotPath) == -1) {
+        return -1;
+    }
+    syncDirectory(journal->snapshotPath);
+
+    if (journal->logFd != -1) {
+        close(journal->logFd);
+    }
+    if ((journal->logFd = open(journal->logPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1) {
+        return -1;
+    }
+    journal->logSize = 0;
+    journal->nRecords = 0;
+    return 0;
+}
+
+/*
+ * Compact once the log has grown, after the changes are in memory. The
+ * records are already durable so a failure here is only reported.
+ */
+static void
+compactIfDue(journal_t *journal) {
+    if (journal->nRecords > journal->nEntries + JOURNAL_SLACK && compact(journal) == -1) {
+        logWarn("Could not compact %s: %d", journal->snapshotPath, errno)
+    }
+}
+
+static void
+freeChange(journalChange_t *change) {
+    if (change->entry != NULL) {
+        freeEntry(change->entry);
+    }
+    free(change->id);
+    free(change);
+}
+
+/*
+ * Whether a delete has a task to remove, it may have been added earlier
+ * in the same batch and not be in memory yet.
+ */
+static int
+deleteNeeded(journal_t *journal, journalChange_t *batch, journalChange_t *change) {
+    if (*findEntry(journal, change->id) != NULL) {
+        return 1;
+    }
+    for (; batch != change; batch = batch->changeNext) {
+        if (batch->entry != NULL && strcmp(batch->entry->id, change->id) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+writeAll(int fd, const char *data, size_t len) {
+    ssize_t written;
+
+    while (len > 0) {
+        if ((written = write(fd, data, len)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t) written;
+    }
+    return 0;
+}
+
+/*
+ * Cut a failed append back to the last whole record. If even that fails
+ * the log is closed and the next write starts from a new snapshot, so a
+ * torn record never has another written after it.
+ */
+static void
+rewindLog(journal_t *journal) {
+    if (ftruncate(journal->logFd, journal->logSize) == -1) {
+        logWarn("Could not rewind %s: %d", journal->logPath, errno)
+        close(journal->logFd);
+        journal->logFd = -1;
+    }
+}
+
+/*
+ * Append a batch of changes with one sync and then apply them in memory.
+ * A change is only applied once its record is durable, so a compaction
+ * never writes a task the log does not have. A batch that cannot be
+ * written is logged and dropped.
+ */
+static void
+writeChanges(journal_t *journal, journalChange_t *batch) {
+    journalChange_t *change;
+    char *buffer = NULL;
+    size_t len = 0;
+    FILE *stream;
+    int nChanges = 0, nRecords = 0, error = 0;
+
+    /* A failed compaction or rewind leaves no log open, start over from the tasks in memory. */
+    if (journal->logFd == -1 && compact(journal) == -1) {
+        error = errno;
+    } else if ((stream = open_memstream(&buffer, &len)) == NULL) {
+        error = ENOMEM;
+    } else {
+        for (change = batch; change != NULL && error == 0; change = change->changeNext) {
+            if (change->entry != NULL) {
+                error = writeEntry(stream, change->entry) == -1 ? ENOMEM : 0;
+                nRecords++;
+            } else if (deleteNeeded(journal, batch, change)) {
+                error = fprintf(stream, "D\t%s\n", change->id) < 0 ? ENOMEM : 0;
+                nRecords++;
+            }
+        }
+        if (fclose(stream) == EOF && error == 0) {
+            error = ENOMEM;
+        }
+        if (error == 0 && nRecords > 0 &&
+            (writeAll(journal->logFd, buffer, len) == -1 || fdatasync(journal->logFd) == -1)) {
+            error = errno;
+            rewindLog(journal);
+        }
+        free(buffer);
+    }
+
+    while ((change = batch) != NULL) {
+        batch = change->changeNext;
+        nChanges++;
+        if (error == 0 && change->entry != NULL) {
+            installEntry(journal, change->entry);
+            change->entry = NULL;
+        } else if (error == 0) {
+            removeEntry(journal, change->id);
+        }
+        freeChange(change);
+    }
+    if (error != 0) {
+        logError("Could not journal %d changes to %s: %d", nChanges, journal->logPath, error)
+        return;
+    }
+    journal->logSize += (off_t) len;
+    journal->nRecords += nRecords;
+    compactIfDue(journal);
+}
+
+/*
+ * The journal thread, everything after journalOpen() that touches the
+ * files or the live tasks runs here.
+ */
+static void *
+journalThread(void *arg) {
+    journal_t *journal = (journal_t *) arg;
+    journalChange_t *batch;
+
+    pthread_mutex_lock(&journal->journalMutex);
+    for (;;) {
+        while (journal->changeHead == NULL && !(journal->journalFlags & JOURNAL_EXIT)) {
+            pthread_cond_wait(&journal->journalWorkcv, &journal->journalMutex);
+        }
+        /* Everything queued before the exit is written first. */
+        if ((batch = journal->changeHead) == NULL) {
+            break;
+        }
+        journal->changeHead = NULL;
+        journal->changeTail = &journal->changeHead;
+        pthread_mutex_unlock(&journal->journalMutex);
+        writeChanges(journal, batch);
+        pthread_mutex_lock(&journal->journalMutex);
+    }
+    pthread_mutex_unlock(&journal->journalMutex);
+    return NULL;
+}
+
+/*
+ * Call func for every live task, dropping the ones it cannot restore.
+ */
+static void
+restoreEntries(journal_t *journal, journalFunc func, void *arg) {
+    journalEntry_t **link, *entry;
+    int i;
+
+    for (i = 0; i < JOURNAL_BUCKETS; i++) {
+        link = &journal->buckets[i];
+        while ((entry = *link) != NULL) {
+            if (func(entry->id, entry->pattern, entry->repeat, entry->job, entry->params, arg) == -1) {
+                logWarn("Dropping task %s from the journal, it could not be restored.", entry->id)
+                *link = entry->entryNext;
+                freeEntry(entry);
+                journal->nEntries--;
+            } else {
+                link = &entry->entryNext;
+            }
+        }
+    }
+}
+
+journal_t *
+journalOpen(const char *path, journalFunc func, void *arg) {
+    journal_t *journal;
+    size_t len;
+    int error;
+
+    if ((journal = calloc(1, sizeof(journal_t))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    journal->logFd = -1;
+    journal->changeTail = &journal->changeHead;
+    pthread_mutex_init(&journal->journalMutex, NULL);
+    pthread_cond_init(&journal->journalWorkcv, NULL);
+    len = strlen(path) + sizeof(".log");
+    if ((journal->snapshotPath = strdup(path)) == NULL || (journal->logPath = malloc(len)) == NULL) {
+        journalClose(journal);
+        errno = ENOMEM;
+        return NULL;
+    }
+    snprintf(journal->logPath, len, "%s.log", path);
+
+    if (loadFile(journal, journal->snapshotPath) == -1 || loadFile(journal, journal->logPath) == -1) {
+        error = errno;
+        journalClose(journal);
+        errno = error;
+        return NULL;
+    }
+    /* Restored first so the new snapshot leaves out whatever was dropped. */
+    restoreEntries(journal, func, arg);
+    if (compact(journal) == -1) {
+        error = errno;
+        journalClose(journal);
+        errno = error;
+        return NULL;
+    }
+    if ((error = pthread_create(&journal->journalTid, NULL, journalThread, journal)) != 0) {
+        journalClose(journal);
+        errno = error;
+        return NULL;
+    }
+    journal->running = 1;
+    logInfo("Restored %d tasks from %s.", journal->nEntries, path)
+    return journal;
+}
+
+/*
+ * Hand a change to the journal thread.
+ */
+static void
+queueChange(journal_t *journal, journalChange_t *change) {
+    pthread_mutex_lock(&journal->journalMutex);
+    *journal->changeTail = change;
+    journal->changeTail = &change->changeNext;
+    pthread_cond_signal(&journal->journalWorkcv);
+    pthread_mutex_unlock(&journal->journalMutex);
+}
+
+int
+journalAdd(journal_t *journal, const char *id, const char *pattern, int repeat, int job, const char *params) {
+    journalChange_t *change;
+
+    if (params == NULL) {
+        params = "";
+    }
+    if (strpbrk(id, "\t\n") != NULL || strpbrk(pattern, "\t\n") != NULL || strpbrk(params, "\t\n") != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((change = calloc(1, sizeof(journalChange_t))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if ((change->entry = newEntry(id, pattern, repeat, job, params)) == NULL) {
+        free(change);
+        return -1;
+    }
+    queueChange(journal, change);
+    return 0;
+}
+
+int
+journalDelete(journal_t *journal, const char *id) {
+    journalChange_t *change;
+
+    /* Such an id could never have been added. */
+    if (strpbrk(id, "\t\n") != NULL) {
+        return 0;
+    }
+    if ((change = calloc(1, sizeof(journalChange_t))) == NULL || (change->id = strdup(id)) == NULL) {
+        free(change);
+        errno = ENOMEM;
+        return -1;
+    }
+    queueChange(journal, change);
+    return 0;
+}
+
+void
+journalClose(journal_t *journal) {
+    journalChange_t *change;
+    journalEntry_t *entry;
+    int i;
+
+    if (journal->running) {
+        pthread_mutex_lock(&journal->journalMutex);
+        journal->journalFlags |= JOURNAL_EXIT;
+        pthread_cond_signal(&journal->journalWorkcv);
+        pthread_mutex_unlock(&journal->journalMutex);
+        pthread_join(journal->journalTid, NULL);
+    }
+    while ((change = journal->changeHead) != NULL) {
+        journal->changeHead = change->changeNext;
+        freeChange(change);
+    }
+    for (i = 0; i < JOURNAL_BUCKETS; i++) {
+        while ((entry = journal->buckets[i]) != NULL) {
+            journal->buckets[i] = entry->entryNext;
+            freeEntry(entry);
+        }
+    }
+    if (journal->logFd != -1) {
+        close(journal->logFd);
+    }
+    pthread_mutex_destroy(&journal->journalMutex);
+    pthread_cond_destroy(&journal->journalWorkcv);
+    free(journal->snapshotPath);
+    free(journal->logPath);
+    free(journal);
+}
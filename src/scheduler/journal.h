@@ -0,0 +1,66 @@
+//
+// Created by Matthew Johnson on 02/05/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_JOURNAL_H
+#define INVEST_FETCH_C_JOURNAL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../logging/logger.h"
+
+/*
+ * The journal_t type is opaque to the client.
+ * A journal keeps the repeating tasks on disk so a restart can arm the
+ * schedule without waiting for the control plane to publish it again.
+ * It is a snapshot of every live task plus a log of the adds and
+ * deletes made since, both one tab separated record per line. The log
+ * is folded into a new snapshot when it is opened and whenever it grows
+ * well past the number of live tasks. The files are written by the
+ * journal's own thread so adding or deleting never waits on the disk.
+ */
+typedef struct journal journal_t;
+
+/*
+ * Called for every live task when the journal is opened, params is ""
+ * if the task has none. Returning -1 drops the task from the journal.
+ */
+typedef int (*journalFunc)(const char *id, const char *pattern, int repeat, int job, const char *params, void *arg);
+
+/*
+ * Open the journal at path (the log is path.log), creating it if needed,
+ * call func for each task it holds and start the journal thread.
+ * On error, journalOpen() returns NULL with errno set to the error code,
+ * func may already have been called.
+ */
+journal_t *journalOpen(const char *path, journalFunc func, void *arg);
+
+/*
+ * Queue a record of a task and its job params (may be NULL), replacing
+ * any with the same id. The journal thread writes it shortly after, a
+ * write that fails is logged and the change is not kept.
+ * On error, journalAdd() returns -1 with errno set to the error code and
+ * nothing is queued.
+ */
+int journalAdd(journal_t *journal, const char *id, const char *pattern, int repeat, int job, const char *params);
+
+/*
+ * Queue a record that a task was deleted, written like journalAdd().
+ * On error, journalDelete() returns -1 with errno set to the error code and
+ * the task is kept.
+ */
+int journalDelete(journal_t *journal, const char *id);
+
+/*
+ * Write whatever is still queued and close the journal.
+ */
+void journalClose(journal_t *journal);
+
+#endif //INVEST_FETCH_C_JOURNAL_H
@@ -4,239 +4,782 @@
 //
 #include "schedule.h"
 
-#define SCHEDULER_DEL_CURRENT 0x02u
-#define SCHEDULER_EXIT 0x01u
+/* Dispatches later than this are logged as warnings. */
+#define SCHEDULER_LAG_WARN_NS 1000000000LL
+/* Lag histogram buckets, bucket b counts lags under 2^b microseconds. */
+#define SCHEDULER_LAG_BUCKETS 24
+/* Each task's lag is summarised in the log after this many runs. */
+#define SCHEDULER_REPORT_RUNS 60
+#define NS_PER_SEC 1000000000LL
+
+#define CLASS_CAPS_ENV "INVEST_CLASS_CAPS"
+/* Runs each class may have in the pool at once: critical, normal, bulk. */
+#define CLASS_DEFAULT_CAPS {2, 1, 1}
+
+/* Pool bounds, the maximum defaults to enough for every class slot or every CPU. */
+#define POOL_MIN_ENV "INVEST_POOL_MIN"
+#define POOL_MAX_ENV "INVEST_POOL_MAX"
+#define POOL_LINGER_ENV "INVEST_POOL_LINGER"
+#define POOL_DEFAULT_LINGER 120
+/* Milliseconds between autoscaling decisions, unset or 0 keeps the pool at its bounds. */
+#define POOL_TUNE_ENV "INVEST_POOL_TUNE_MS"
+#define POOL_TARGET_WAIT_ENV "INVEST_POOL_TARGET_WAIT_MS"
+#define POOL_DEFAULT_TARGET_WAIT 50
+/* Worker pinning: compact, scatter or node:N, optionally within a CPU list. */
+#define POOL_PLACEMENT_ENV "INVEST_POOL_PLACEMENT"
+#define POOL_CPUS_ENV "INVEST_POOL_CPUS"
+/* Milliseconds between pool statistics in the log, unset or 0 for none. */
+#define POOL_STATS_ENV "INVEST_POOL_STATS_MS"
+
+/*
+ * A run waiting for its class to have room in the pool.
+ */
+typedef struct taskRun {
+    struct taskRun *runNext;    // FIFO of waiting runs.
+    task_t *task;               // Holds a reference.
+} taskRun_t;
+
+/*
+ * Admission state of a priority class.
+ */
+typedef struct taskClassQueue {
+    taskRun_t *runHead;         // Runs waiting for room.
+    taskRun_t *runTail;
+    unsigned int running;       // Runs of this class in the pool.
+    unsigned int cap;           // Most it may have in the pool.
+    unsigned long deferred;     // Runs that had to wait for room.
+} taskClassQueue_t;
 
 struct scheduler {
     pthread_mutex_t queueMutex;     // Protects the scheduler queue.
-    pthread_cond_t waitingCond;     // Signaled when the queue is non empty
-    taskNode_t *head;               // Pointer to the task as the head of the queue.
+    task_t **heap;                  // Min-heap of the queued tasks on their next execution time.
+    task_t **table;                 // Queued tasks open addressed on their id, a power of 2 in size.
+    unsigned int tableSize;         // Number of slots in the table.
     unsigned int schedulerNTasks;   // Number of tasks in the queue.
-    unsigned int schedulerFlags;    // Args passed to the scheduler.
-    char *currentTaskId;            // The id of the current task the scheduler is processing;
+    threadPool_t *threadPool;       // Runs the tasks, one worker for every class slot.
+    taskClassQueue_t classes[TASK_CLASSES]; // Admission to the pool by priority class.
+    int timerFd;                    // Armed for the earliest deadline once attached to a reactor, else -1.
 };
 
+/*
+ * A compiled cron expression, shared by every task with the same pattern.
+ */
+typedef struct cronEntry {
+    struct cronEntry *next;     // Linked list of the cached expressions.
+    char *pattern;              // The expression as given.
+    cron_expr expr;             // Only ever read once compiled.
+    unsigned int refs;          // Tasks using it.
+} cronEntry_t;
+
+/* There are only ever a handful of distinct patterns. */
+static cronEntry_t *cronCache = NULL;
+static pthread_mutex_t cronLock = PTHREAD_MUTEX_INITIALIZER;
+
 struct task {
     char *id;               // Id of the task, must be unique
-    time_t next;            // Next execution time of the task
+    int64_t next;           // Next execution time of the task, nanoseconds since the epoch.
     int repeat;             // Repeat the job until removed or single run
-    char *pattern;          // Cron expression used to determine the next execution time.
+    cronEntry_t *cron;      // Cron expression used to determine the next execution time.
     void *(*func)(void *);  // Function to execute when the task is called.
+    void *arg;              // Passed to func, shared by overlapping runs.
+    void (*argFree)(void *);// Releases arg with the task, may be NULL.
+    unsigned int heapIndex; // Position of the task in the heap while it is queued.
+    unsigned long runs;     // Number of times the task has been dispatched.
+    int64_t lagNs;          // How late the last dispatch was.
+    int64_t maxLagNs;       // The latest any dispatch has been.
+    unsigned long lagHistogram[SCHEDULER_LAG_BUCKETS]; // Dispatch lags, see above.
+    taskOverlap_t overlap;  // What to do when it is due while a run is still going.
+    taskClass_t priority;   // Priority class, bounds how many of its runs share the pool.
+    const char *kind;       // Runs are counted under it in the pool statistics, NULL for func.
+    unsigned int running;   // Runs in the pool.
+    int pending;            // A coalesced run is waiting for the current one.
+    unsigned long skipped;  // Runs dropped because the last was still going.
+    unsigned long coalesced;// Runs folded into one that was already pending.
+    unsigned int refs;      // One for the queue (or creator) plus one per run.
+    scheduler_t *scheduler; // The scheduler it was added to.
 };
 
+/* Get the compiled expression for a pattern, compiling it on first use. */
+static cronEntry_t *cronAcquire(const char *pattern) {
+    cronEntry_t *entry;
+    const char *err = NULL;
+
+    pthread_mutex_lock(&cronLock);
+    for (entry = cronCache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->pattern, pattern) == 0) {
+            entry->refs++;
+            pthread_mutex_unlock(&cronLock);
+            return entry;
+        }
+    }
+    if ((entry = (cronEntry_t *) calloc(1, sizeof(cronEntry_t))) == NULL) {
+        pthread_mutex_unlock(&cronLock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    cron_parse_expr(pattern, &entry->expr, &err);
+    if (err) {
+        pthread_mutex_unlock(&cronLock);
+        logError("Error in CRON expression %s: %s", pattern, err)
+        free(entry);
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((entry->pattern = strdup(pattern)) == NULL) {
+        pthread_mutex_unlock(&cronLock);
+        free(entry);
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->refs = 1;
+    entry->next = cronCache;
+    cronCache = entry;
+    pthread_mutex_unlock(&cronLock);
+    return entry;
+}
+
+static void cronRelease(cronEntry_t *entry) {
+    cronEntry_t **link;
+
+    pthread_mutex_lock(&cronLock);
+    if (--entry->refs == 0) {
+        for (link = &cronCache; *link != entry; link = &(*link)->next);
+        *link = entry->next;
+        free(entry->pattern);
+        free(entry);
+    }
+    pthread_mutex_unlock(&cronLock);
+}
+
 static inline void taskFree(task_t *task) {
     free(task->id);
-    free(task->pattern);
+    cronRelease(task->cron);
+    if (task->argFree != NULL) {
+        task->argFree(task->arg);
+    }
     free(task);
 }
 
-static inline void taskNodeFree(taskNode_t *node) {
-    taskFree(node->task);
-    free(node);
+/* Drop a reference, the last one frees the task. */
+static inline void taskRelease(task_t *task) {
+    if (--task->refs == 0) {
+        taskFree(task);
+    }
+}
+
+/* The queue is done with the task, it is freed once no run is using it. */
+static inline void taskDrop(task_t *task) {
+    task->pending = 0;
+    taskRelease(task);
+}
+
+void taskSetOverlap(task_t *task, taskOverlap_t overlap) {
+    task->overlap = overlap;
+}
+
+void taskSetClass(task_t *task, taskClass_t priority) {
+    task->priority = priority;
+}
+
+void taskSetKind(task_t *task, const char *kind) {
+    task->kind = kind;
+}
+
+void taskSetArg(task_t *task, void *arg, void (*argFree)(void *)) {
+    if (task->argFree != NULL) {
+        task->argFree(task->arg);
+    }
+    task->arg = arg;
+    task->argFree = argFree;
 }
 
 task_t *taskCreate(const char *id, const char *pattern, int repeat, void *(*func)(void *)) {
     task_t *task;
     size_t len;
 
-    task = (task_t *) malloc(sizeof(task_t));
+    if ((task = (task_t *) calloc(1, sizeof(task_t))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* Rejected here so a bad expression never reaches the queue. */
+    if ((task->cron = cronAcquire(pattern)) == NULL) {
+        free(task);
+        return NULL;
+    }
     task->func = func;
     task->repeat = repeat;
-
-    len = strlen(pattern) + 1;
-    task->pattern = (char *) malloc(len * sizeof(char));
-    strncpy(task->pattern, pattern, len);
+    task->overlap = TASK_OVERLAP_ALLOW;
+    task->priority = TASK_CLASS_NORMAL;
+    task->refs = 1;
 
     len = strlen(id) + 1;
-    task->id = (char *) malloc(len * sizeof(char));
+    if ((task->id = (char *) malloc(len * sizeof(char))) == NULL) {
+        cronRelease(task->cron);
+        free(task);
+        errno = ENOMEM;
+        return NULL;
+    }
     strncpy(task->id, id, len);
 
     return task;
 }
 
-/* Get the next task to be executed. Remove the node from the
- * queue but do not free the task contained.
+static unsigned int hashId(const char *id) {
+    unsigned int hash = 2166136261u;
+
+    while (*id) {
+        hash = (hash ^ (unsigned char) *id++) * 16777619u;
+    }
+    return hash;
+}
+
+/* Find the slot holding the id, or the empty slot it would go in. */
+static unsigned int findSlot(scheduler_t *scheduler, const char *id) {
+    unsigned int i = hashId(id) & (scheduler->tableSize - 1);
+
+    while (scheduler->table[i] != NULL && strcmp(scheduler->table[i]->id, id) != 0) {
+        i = (i + 1) & (scheduler->tableSize - 1);
+    }
+    return i;
+}
+
+/*
+ * Double the table and the heap once the table is half full. Both are
+ * left as they were if either can't grow.
  */
-task_t *taskPop(scheduler_t *scheduler) {
-    task_t *task;
-    taskNode_t *next;
+static int growQueue(scheduler_t *scheduler) {
+    task_t **old = scheduler->table, **table, **heap;
+    unsigned int i, oldSize = scheduler->tableSize, size = oldSize ? oldSize * 2 : 64;
 
-    pthread_mutex_lock(&(scheduler->queueMutex));
-    if (scheduler->head == NULL) {
-        task = NULL;
-    } else {
-        task = scheduler->head->task;
-        next = scheduler->head->next;
-        free(scheduler->head);
-        scheduler->head = next;
-        scheduler->schedulerNTasks -= 1;
+    if ((table = calloc(size, sizeof(task_t *))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    /* The heap can never hold more than half the table. */
+    if ((heap = realloc(scheduler->heap, (size / 2) * sizeof(task_t *))) == NULL) {
+        free(table);
+        errno = ENOMEM;
+        return -1;
+    }
+    scheduler->heap = heap;
+    scheduler->table = table;
+    scheduler->tableSize = size;
+    for (i = 0; i < oldSize; i++) {
+        if (old[i] != NULL) {
+            scheduler->table[findSlot(scheduler, old[i]->id)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* Remove an id from the table, shifting back any entries that probed past it. */
+static void tableRemove(scheduler_t *scheduler, unsigned int i) {
+    unsigned int j = i, home, mask = scheduler->tableSize - 1;
+
+    scheduler->table[i] = NULL;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (scheduler->table[j] == NULL) {
+            return;
+        }
+        home = hashId(scheduler->table[j]->id) & mask;
+        /* Move it into the hole unless its home lies cyclically in (i, j]. */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            scheduler->table[i] = scheduler->table[j];
+            scheduler->table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static inline void heapSet(scheduler_t *scheduler, unsigned int i, task_t *task) {
+    scheduler->heap[i] = task;
+    task->heapIndex = i;
+}
+
+static void siftUp(scheduler_t *scheduler, unsigned int i) {
+    task_t *task = scheduler->heap[i];
+
+    while (i > 0 && task->next < scheduler->heap[(i - 1) / 2]->next) {
+        heapSet(scheduler, i, scheduler->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heapSet(scheduler, i, task);
+}
+
+static void siftDown(scheduler_t *scheduler, unsigned int i) {
+    task_t *task = scheduler->heap[i];
+    unsigned int child;
+
+    while ((child = 2 * i + 1) < scheduler->schedulerNTasks) {
+        if (child + 1 < scheduler->schedulerNTasks &&
+            scheduler->heap[child + 1]->next < scheduler->heap[child]->next) {
+            child++;
+        }
+        if (scheduler->heap[child]->next >= task->next) {
+            break;
+        }
+        heapSet(scheduler, i, scheduler->heap[child]);
+        i = child;
+    }
+    heapSet(scheduler, i, task);
+}
+
+/*
+ * Point the timer at the earliest deadline, or disarm it when the queue
+ * is empty. The caller holds the queue mutex.
+ */
+static void armTimer(scheduler_t *scheduler) {
+    struct itimerspec spec;
+
+    if (scheduler->timerFd == -1) {
+        return;
+    }
+    memset(&spec, 0, sizeof(spec));
+    if (scheduler->schedulerNTasks > 0) {
+        spec.it_value.tv_sec = scheduler->heap[0]->next / NS_PER_SEC;
+        spec.it_value.tv_nsec = scheduler->heap[0]->next % NS_PER_SEC;
+    }
+    /* A deadline that has already passed fires straight away. */
+    if (timerfd_settime(scheduler->timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        logError("Could not arm the scheduler timer: %d", errno)
+    }
+}
+
+/* Take a queued task out of the heap and the table. The caller holds the queue mutex. */
+static void taskUnlink(scheduler_t *scheduler, task_t *task) {
+    unsigned int i = task->heapIndex;
+    task_t *moved;
+
+    tableRemove(scheduler, findSlot(scheduler, task->id));
+    scheduler->schedulerNTasks -= 1;
+    /* Fill the hole with the last task and restore the heap around it. */
+    if (i != scheduler->schedulerNTasks) {
+        moved = scheduler->heap[scheduler->schedulerNTasks];
+        heapSet(scheduler, i, moved);
+        siftUp(scheduler, i);
+        siftDown(scheduler, moved->heapIndex);
     }
-    pthread_mutex_unlock(&(scheduler->queueMutex));
-    return task;
 }
 
 void taskDelete(scheduler_t *scheduler, const char *id) {
-    taskNode_t *curr, *prev;
+    task_t *task;
 
-    prev = NULL;
     pthread_mutex_lock(&(scheduler->queueMutex));
-    /* Check for the special case that it is currently being executed. */
-    if (strcmp(scheduler->currentTaskId, id) == 0) {
-        scheduler->schedulerFlags |= SCHEDULER_DEL_CURRENT;
-    } else {
-        for (curr = scheduler->head; curr != NULL; prev = curr, curr = curr->next) {
-            if (strcmp(curr->task->id, id) == 0) {
-                if (prev == NULL) {
-                    scheduler->head = curr->next;
-                } else {
-                    prev->next = curr->next;
-                }
-                taskNodeFree(curr);
-                scheduler->schedulerNTasks -= 1;
-            }
-        }
+    /* Tasks are only ever out of the queue while the dispatcher holds the mutex. */
+    if (scheduler->tableSize > 0 && (task = scheduler->table[findSlot(scheduler, id)]) != NULL) {
+        taskUnlink(scheduler, task);
+        taskDrop(task);
+        armTimer(scheduler);
     }
     pthread_mutex_unlock(&(scheduler->queueMutex));
 }
 
-static int checkId(taskNode_t *head, const char *id) {
-    while (head != NULL) {
-        if (strcmp(head->task->id, id) == 0) {
-            return 1;
-        }
-        head = head->next;
+/*
+ * Work out when the task next runs and queue it. The caller holds the queue mutex.
+ * On error, taskSchedule() returns -1 with errno set to the error code.
+ */
+static int taskSchedule(scheduler_t *scheduler, task_t *task, time_t now) {
+    unsigned int slot;
+    time_t next;
+
+    /* Keep the table at most half full. */
+    if ((scheduler->schedulerNTasks + 1) * 2 > scheduler->tableSize && growQueue(scheduler) == -1) {
+        logError("No memory to queue task %s.", task->id)
+        return -1;
     }
+    /* Check if there is a task with the same id. */
+    slot = findSlot(scheduler, task->id);
+    if (scheduler->table[slot] != NULL) {
+        logError("task already exists with id: %s", task->id)
+        errno = EEXIST;
+        return -1;
+    }
+    if ((next = cron_next(&task->cron->expr, now)) == (time_t) -1) {
+        logError("CRON expression %s never fires", task->cron->pattern)
+        errno = EINVAL;
+        return -1;
+    }
+
+    task->next = (int64_t) next * NS_PER_SEC;
+    task->scheduler = scheduler;
+    scheduler->table[slot] = task;
+    heapSet(scheduler, scheduler->schedulerNTasks, task);
+    scheduler->schedulerNTasks += 1;
+    siftUp(scheduler, task->heapIndex);
     return 0;
 }
 
-void taskAdd(scheduler_t *scheduler, task_t *task) {
-    /* Get the current UTC time and work out when this task next needs to be called. */
-    taskNode_t *current, *node;
-    time_t now;
-    cron_expr expr;
-    const char *err = NULL;
+int taskAdd(scheduler_t *scheduler, task_t *task) {
+    int result;
 
     /* Acquire the scheduler mutex. */
     pthread_mutex_lock(&(scheduler->queueMutex));
-    /* Check if there is a task with the same id. */
-    if (checkId(scheduler->head, task->id) == 1) {
-        logError("task already exists with id: %s", task->id)
-        taskFree(task);
-        pthread_mutex_unlock(&(scheduler->queueMutex));
+    if ((result = taskSchedule(scheduler, task, time(NULL))) == -1) {
+        taskDrop(task);
+    } else if (scheduler->heap[0] == task) {
+        /* The timer is armed for a later deadline. */
+        armTimer(scheduler);
+    }
+    pthread_mutex_unlock(&(scheduler->queueMutex));
+    return result;
+}
+
+/* Read the class caps, one worker is kept for every slot. */
+static uint16_t configureClasses(scheduler_t *scheduler) {
+    unsigned int caps[TASK_CLASSES] = CLASS_DEFAULT_CAPS;
+    char *env, *end;
+    uint16_t workers = 0;
+    long cap;
+    int c;
+
+    if ((env = getenv(CLASS_CAPS_ENV)) != NULL) {
+        for (c = 0; c < TASK_CLASSES; c++) {
+            cap = strtol(env, &end, 10);
+            if (end == env || cap < 1 || cap > 64) {
+                logWarn("Invalid %s, using the default class caps.", CLASS_CAPS_ENV)
+                memcpy(caps, (unsigned int[TASK_CLASSES]) CLASS_DEFAULT_CAPS, sizeof(caps));
+                break;
+            }
+            caps[c] = (unsigned int) cap;
+            env = *end == ',' ? end + 1 : end;
+        }
+    }
+    for (c = 0; c < TASK_CLASSES; c++) {
+        memset(&scheduler->classes[c], 0, sizeof(taskClassQueue_t));
+        scheduler->classes[c].cap = caps[c];
+        workers += caps[c];
+    }
+    return workers;
+}
+
+/* Read a bounded integer setting, falling back to the default if it is unset or invalid. */
+static long envSetting(const char *name, long value, long min, long max) {
+    char *env, *end;
+    long parsed;
+
+    if ((env = getenv(name)) == NULL) {
+        return value;
+    }
+    parsed = strtol(env, &end, 10);
+    if (end == env || *end != '\0' || parsed < min || parsed > max) {
+        logWarn("Invalid %s, using %ld.", name, value)
+        return value;
+    }
+    return parsed;
+}
+
+/* Pin the pool's workers if a placement or CPU list is set. */
+static void placePool(threadPool_t *pool) {
+    thrPlacement_t placement = THR_PLACE_NONE;
+    char *env = getenv(POOL_PLACEMENT_ENV), *cpus = getenv(POOL_CPUS_ENV), *end;
+    long node = 0;
+
+    if (env == NULL && cpus == NULL) {
         return;
     }
-    /* Get the current UTC time.*/
-    now = time(NULL);
-    memset(&expr, 0, sizeof(expr));
-    cron_parse_expr(task->pattern, &expr, &err);
-    if (err) {
-        logError("Error in CRON expression")
-        pthread_mutex_unlock(&(scheduler->queueMutex));
+    if (env == NULL || strcmp(env, "none") == 0) {
+        placement = THR_PLACE_NONE;
+    } else if (strcmp(env, "compact") == 0) {
+        placement = THR_PLACE_COMPACT;
+    } else if (strcmp(env, "scatter") == 0) {
+        placement = THR_PLACE_SCATTER;
+    } else if (strncmp(env, "node:", 5) == 0 && (node = strtol(env + 5, &end, 10)) >= 0 && end != env + 5 &&
+               *end == '\0') {
+        placement = THR_PLACE_NODE;
+    } else {
+        logWarn("Invalid %s, workers are not pinned.", POOL_PLACEMENT_ENV)
+        return;
+    }
+    if (thrPoolPlace(pool, placement, cpus, (int) node) == -1) {
+        logWarn("Could not place the pool's workers as %s on %s: %d", env ? env : "none", cpus ? cpus : "all CPUs",
+                errno)
         return;
     }
-    task->next = cron_next(&expr, now);
+    logInfo("Pool workers placed %s on %s.", env ? env : "anywhere", cpus ? cpus : "all CPUs")
+}
 
-    node = (taskNode_t *) malloc(sizeof(taskNode_t));
-    node->task = task;
-    /* Check if the queue is empty of the task should be the first in the queue. */
-    if (scheduler->head == NULL || ((scheduler->head)->task->next >= node->task->next)) {
-        node->next = scheduler->head;
-        scheduler->head = node;
-    } else {
-        current = scheduler->head;
-        /* Move to the correct position this task should be added. */
-        while (current->next != NULL && (current->next->task->next < node->task->next)) {
-            current = current->next;
-        }
-        node->next = current->next;
-        current->next = node;
+/*
+ * Create the pool from its settings, starting the controller if asked to.
+ * An autoscaled pool keeps a worker for every class slot unless told
+ * otherwise so the controller only sizes the work beyond them.
+ */
+static threadPool_t *configurePool(uint16_t slots) {
+    threadPool_t *pool;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long min, max, tune, stats;
+
+    tune = envSetting(POOL_TUNE_ENV, 0, 0, 3600000);
+    max = envSetting(POOL_MAX_ENV, slots > cpus ? slots : cpus, 1, UINT16_MAX);
+    min = envSetting(POOL_MIN_ENV, tune == 0 ? 1 : slots < max ? slots : max, 0, max);
+    if (max < slots) {
+        logWarn("%s is below the %u class slots, admitted runs may queue.", POOL_MAX_ENV, slots)
     }
-    scheduler->schedulerNTasks += 1;
-    pthread_mutex_unlock(&(scheduler->queueMutex));
-    pthread_cond_signal(&(scheduler->waitingCond));
+    if ((pool = thrPoolCreate((uint16_t) min, (uint16_t) max,
+                              (uint16_t) envSetting(POOL_LINGER_ENV, POOL_DEFAULT_LINGER, 0, UINT16_MAX),
+                              NULL)) == NULL) {
+        return NULL;
+    }
+    placePool(pool);
+    stats = envSetting(POOL_STATS_ENV, 0, 0, 86400000);
+    if (stats > 0 && thrPoolStatsDump(pool, (unsigned int) stats) == -1) {
+        logError("Could not start the pool statistics: %d", errno)
+    }
+    if (tune > 0 &&
+        thrPoolAutoscale(pool, (unsigned int) tune,
+                         (unsigned int) envSetting(POOL_TARGET_WAIT_ENV, POOL_DEFAULT_TARGET_WAIT, 1, 60000)) == -1) {
+        logError("Could not start the pool controller: %d", errno)
+    }
+    logInfo("Thread pool sized %ld to %ld workers%s.", min, max, tune > 0 ? ", autoscaling" : "")
+    return pool;
 }
 
 scheduler_t *schedulerCreate(void) {
     scheduler_t *scheduler;
+    uint16_t workers;
 
     if ((scheduler = malloc(sizeof(scheduler_t))) == NULL) {
         return NULL;
     }
 
     pthread_mutex_init(&scheduler->queueMutex, NULL);
-    pthread_cond_init(&scheduler->waitingCond, NULL);
-    scheduler->head = NULL;
+    scheduler->heap = NULL;
+    scheduler->table = NULL;
+    scheduler->tableSize = 0;
     scheduler->schedulerNTasks = 0;
-    scheduler->schedulerFlags = 0;
-    scheduler->currentTaskId = NULL;
+    scheduler->timerFd = -1;
+    /* Admitted runs never outnumber the workers unless the pool is configured smaller. */
+    workers = configureClasses(scheduler);
+    if ((scheduler->threadPool = configurePool(workers)) == NULL) {
+        free(scheduler);
+        return NULL;
+    }
 
     return scheduler;
 }
 
-void *schedulerProcess(void *args) {
-    scheduler_t *scheduler;
-    threadPool_t *threadPool;
-    task_t *task;
-    struct timespec waitTime;
+static inline int64_t timespecNs(const struct timespec *ts) {
+    return (int64_t) ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
 
-    scheduler = (scheduler_t *) args;
+/* Upper bound in microseconds of the lag the given share of dispatches were within. */
+static int64_t lagQuantile(const task_t *task, double share) {
+    unsigned long total = 0, seen = 0;
+    int b;
 
-    threadPool = thrPoolCreate(1, 2, 120, NULL);
-    while (1) {
-        /* Get the next task to execute. */
-        pthread_mutex_lock(&(scheduler->queueMutex));
-        if (scheduler->schedulerFlags & SCHEDULER_EXIT) {
+    for (b = 0; b < SCHEDULER_LAG_BUCKETS; b++) {
+        total += task->lagHistogram[b];
+    }
+    for (b = 0; b < SCHEDULER_LAG_BUCKETS; b++) {
+        seen += task->lagHistogram[b];
+        if (seen >= total * share) {
             break;
         }
-        pthread_mutex_unlock(&(scheduler->queueMutex));
-        if ((task = taskPop(scheduler)) == NULL) {
-            /* Get the scheduler mutex */
-            pthread_mutex_lock(&(scheduler->queueMutex));
-            /* Wait until there is data in the queue. */
-            timespec_get(&waitTime, TIME_UTC);
-            waitTime.tv_sec += 10;
-            pthread_cond_timedwait(&(scheduler->waitingCond), &(scheduler->queueMutex), &waitTime);
-            pthread_mutex_unlock(&(scheduler->queueMutex));
-            continue;
-        } else {
-            /* Get the scheduler mutex */
-            pthread_mutex_lock(&(scheduler->queueMutex));
-            /* Set the id of the current task*/
-            scheduler->currentTaskId = task->id;
-            /* Finished with the mutex so release. */
-            pthread_mutex_unlock(&(scheduler->queueMutex));
-        }
-        /* Calculate and wait until the task should be executed. */
-        long int duration = task->next - time(NULL);
-        /* Sleep if we need to. */
-        if (duration > 0) {
-            char buffer[80];
-            /* Produce the date/time in a format that is easy to read in log files etc. */
-            strftime(buffer, 80, "%Y-%m-%d %H:%M:%S", gmtime(&task->next));
-            logInfo("Next task executing at: %s.", buffer)
-            sleep(duration);
-        }
-        if (thrPoolQueue(threadPool, task->func, NULL) == -1) {
-            logError("Failed to send a task to the threadpool.")
-        } else {
-            logInfo("Sent a task to the threadpool.")
-        }
-        /* Add the task back into the queue if it is to be repeated. */
-        pthread_mutex_lock(&(scheduler->queueMutex));
-        if (scheduler->schedulerFlags & SCHEDULER_DEL_CURRENT) {
-            taskFree(task);
-            scheduler->schedulerFlags &= ~SCHEDULER_DEL_CURRENT;
-            scheduler->currentTaskId = NULL;
+    }
+    return (int64_t) 1 << (b < SCHEDULER_LAG_BUCKETS ? b : SCHEDULER_LAG_BUCKETS - 1);
+}
+
+/* Add a dispatch to the task's lag histogram. */
+static void recordLag(task_t *task, int64_t lagNs) {
+    int64_t lagUs = lagNs / 1000;
+    int b = 0;
+
+    task->lagNs = lagNs;
+    if (lagNs > task->maxLagNs) {
+        task->maxLagNs = lagNs;
+    }
+    while (b < SCHEDULER_LAG_BUCKETS - 1 && lagUs >= ((int64_t) 1 << b)) {
+        b++;
+    }
+    task->lagHistogram[b]++;
+    if (lagNs > SCHEDULER_LAG_WARN_NS) {
+        logWarn("Task %s dispatched %lld ms late.", task->id, (long long) (lagNs / 1000000))
+    }
+    if (task->runs % SCHEDULER_REPORT_RUNS == 0) {
+        logInfo("Task %s dispatch lag over %lu runs: p50 < %lld us, p99 < %lld us, max %lld us.", task->id,
+                task->runs, (long long) lagQuantile(task, 0.5), (long long) lagQuantile(task, 0.99),
+                (long long) (task->maxLagNs / 1000))
+    }
+}
+
+static void taskDone(void *arg);
+
+/* Hand a run to the pool. The caller holds the queue mutex. */
+static void taskStart(scheduler_t *scheduler, task_t *task) {
+    taskClassQueue_t *queue = &scheduler->classes[task->priority];
+
+    queue->running++;
+    if (thrPoolQueueNamed(scheduler->threadPool, task->kind, task->func, task->arg, taskDone, task) == -1) {
+        logError("Failed to send task %s to the threadpool.", task->id)
+        queue->running--;
+        task->running--;
+        taskRelease(task);
+    } else {
+        logDebug("Sent task %s to the threadpool %lld us after it was due.", task->id,
+                 (long long) (task->lagNs / 1000))
+    }
+}
+
+/* Start a run now if its class has room, otherwise queue it. The caller holds the queue mutex. */
+static void taskRun(scheduler_t *scheduler, task_t *task) {
+    taskClassQueue_t *queue = &scheduler->classes[task->priority];
+    taskRun_t *run;
+
+    task->refs++;
+    task->running++;
+    if (queue->running < queue->cap) {
+        taskStart(scheduler, task);
+        return;
+    }
+    if ((run = (taskRun_t *) malloc(sizeof(taskRun_t))) == NULL) {
+        logError("Dropped a run of task %s, no memory to wait for its class.", task->id)
+        task->running--;
+        taskRelease(task);
+        return;
+    }
+    run->task = task;
+    run->runNext = NULL;
+    if (queue->runTail == NULL) {
+        queue->runHead = run;
+    } else {
+        queue->runTail->runNext = run;
+    }
+    queue->runTail = run;
+    queue->deferred++;
+    logDebug("Task %s waits for its class to have room (%lu deferred).", task->id, queue->deferred)
+}
+
+/* Start waiting runs while their class has room, most urgent class first. */
+static void admitWaiting(scheduler_t *scheduler) {
+    taskClassQueue_t *queue;
+    taskRun_t *run;
+    int c;
+
+    for (c = 0; c < TASK_CLASSES; c++) {
+        queue = &scheduler->classes[c];
+        while (queue->runHead != NULL && queue->running < queue->cap) {
+            run = queue->runHead;
+            if ((queue->runHead = run->runNext) == NULL) {
+                queue->runTail = NULL;
+            }
+            taskStart(scheduler, run->task);
+            free(run);
         }
-        pthread_mutex_unlock(&(scheduler->queueMutex));
-        if (task->repeat) {
-            taskAdd(scheduler, task);
-        } else {
-            taskFree(task);
+    }
+}
+
+/* Called on the worker once a run has finished, starts the coalesced run if there is one. */
+static void taskDone(void *arg) {
+    task_t *task = (task_t *) arg;
+    scheduler_t *scheduler = task->scheduler;
+
+    pthread_mutex_lock(&(scheduler->queueMutex));
+    task->running--;
+    scheduler->classes[task->priority].running--;
+    if (task->pending) {
+        task->pending = 0;
+        taskRun(scheduler, task);
+    }
+    taskRelease(task);
+    admitWaiting(scheduler);
+    pthread_mutex_unlock(&(scheduler->queueMutex));
+}
+
+/*
+ * Send a due task to the pool and queue its next run. The caller holds
+ * the queue mutex, queueing a job on the pool never blocks.
+ */
+static void taskDispatch(scheduler_t *scheduler, task_t *task, const struct timespec *now) {
+    taskUnlink(scheduler, task);
+    task->runs++;
+    recordLag(task, timespecNs(now) - task->next);
+    if (task->running == 0 || task->overlap == TASK_OVERLAP_ALLOW) {
+        taskRun(scheduler, task);
+    } else if (task->overlap == TASK_OVERLAP_SKIP) {
+        task->skipped++;
+        logWarn("Skipped task %s, its last run is still going (%lu skipped).", task->id, task->skipped)
+    } else if (task->pending) {
+        task->coalesced++;
+        logWarn("Coalesced task %s into its pending run (%lu coalesced).", task->id, task->coalesced)
+    } else {
+        /* Runs as soon as the current one finishes. */
+        task->pending = 1;
+    }
+    /* Add the task back into the queue if it is to be repeated. */
+    if (!task->repeat || taskSchedule(scheduler, task, now->tv_sec) == -1) {
+        taskDrop(task);
+    }
+}
+
+/* Dispatch everything that is due. The caller holds the queue mutex. */
+static void dispatchDue(scheduler_t *scheduler) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    while (scheduler->schedulerNTasks > 0 && scheduler->heap[0]->next <= timespecNs(&now)) {
+        taskDispatch(scheduler, scheduler->heap[0], &now);
+    }
+}
+
+/* The timer fired, or a change re-armed it for a deadline that has passed. */
+static void timerReady(int fd, uint32_t events, void *arg) {
+    scheduler_t *scheduler = (scheduler_t *) arg;
+    uint64_t expirations;
+
+    (void) events;
+    /* Nothing to read if the timer was re-armed since it became readable. */
+    if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        logError("Could not read the scheduler timer: %d", errno)
+    }
+    pthread_mutex_lock(&(scheduler->queueMutex));
+    dispatchDue(scheduler);
+    armTimer(scheduler);
+    pthread_mutex_unlock(&(scheduler->queueMutex));
+}
+
+int schedulerAttach(scheduler_t *scheduler, reactor_t *reactor) {
+    int fd, error;
+
+    if ((fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (reactorAdd(reactor, fd, EPOLLIN, timerReady, scheduler) == -1) {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    pthread_mutex_lock(&(scheduler->queueMutex));
+    scheduler->timerFd = fd;
+    armTimer(scheduler);
+    pthread_mutex_unlock(&(scheduler->queueMutex));
+    return 0;
+}
+
+void schedulerDestroy(scheduler_t *scheduler) {
+    taskRun_t *run;
+    unsigned int i;
+    int c;
+
+    /* Let the running tasks finish. */
+    thrPoolWait(scheduler->threadPool);
+    thrPoolDestroy(scheduler->threadPool);
+    for (c = 0; c < TASK_CLASSES; c++) {
+        while ((run = scheduler->classes[c].runHead) != NULL) {
+            scheduler->classes[c].runHead = run->runNext;
+            taskRelease(run->task);
+            free(run);
         }
     }
-    /* We have been asked to exit. */
-    thrPoolWait(threadPool);
-    thrPoolDestroy(threadPool);
-    pthread_exit(0);
-}
\ No newline at end of file
+    for (i = 0; i < scheduler->schedulerNTasks; i++) {
+        taskDrop(scheduler->heap[i]);
+    }
+    if (scheduler->timerFd != -1) {
+        close(scheduler->timerFd);
+    }
+    free(scheduler->heap);
+    free(scheduler->table);
+    pthread_mutex_destroy(&scheduler->queueMutex);
+    free(scheduler);
+}
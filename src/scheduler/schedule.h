@@ -6,6 +6,7 @@
 #ifndef INVEST_FETCH_C_SCHEDULE_H
 #define INVEST_FETCH_C_SCHEDULE_H
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -13,7 +14,9 @@
 #include <string.h>
 #include <semaphore.h>
 #include <time.h>
+#include <sys/timerfd.h>
 #include "../helpers/cron.h"
+#include "../reactor/reactor.h"
 
 #include "../threading/threadPool.h"
 #include "../logging/logger.h"
@@ -22,19 +25,104 @@ typedef struct task task_t;
 
 typedef struct scheduler scheduler_t;
 
-typedef struct taskNode {
-    task_t *task;
-    struct taskNode *next;
-} taskNode_t;
+/*
+ * What to do when a task is due while its previous run is still going.
+ */
+typedef enum taskOverlap {
+    TASK_OVERLAP_ALLOW,     // Start another run alongside it.
+    TASK_OVERLAP_SKIP,      // Drop this run.
+    TASK_OVERLAP_COALESCE   // Run once when it finishes, however many runs came due meanwhile.
+} taskOverlap_t;
 
-void taskAdd(scheduler_t *scheduler, task_t *task);
+/*
+ * Priority classes. Each may only have so many runs in the pool at once
+ * (INVEST_CLASS_CAPS, default "2,1,1"), by default the pool can have a
+ * worker for every slot so an admitted run never queues behind another
+ * class. Runs over
+ * their class cap wait in the scheduler and the most urgent class is
+ * admitted first when a slot frees up.
+ */
+typedef enum taskClass {
+    TASK_CLASS_CRITICAL,    // Time sensitive captures.
+    TASK_CLASS_NORMAL,      // The default.
+    TASK_CLASS_BULK,        // Large refreshes that can wait.
+    TASK_CLASSES
+} taskClass_t;
+
+/*
+ * Set the argument func is called with, NULL by default. Overlapping runs
+ * share it so jobs must treat it as read only. argFree, if given, is
+ * called on it when the task is freed. Must be called before the task is
+ * added.
+ */
+void taskSetArg(task_t *task, void *arg, void (*argFree)(void *));
+
+/*
+ * Set the priority class, TASK_CLASS_NORMAL by default. Must be called
+ * before the task is added.
+ */
+void taskSetClass(task_t *task, taskClass_t priority);
+
+/*
+ * Set what the task's runs are counted under in the pool statistics, e.g.
+ * "prices". Kinds are shared by many tasks, the pool only keeps so many,
+ * so they must not be per task. By default runs are counted under func.
+ * kind is not copied and must outlive the task. Must be called before the
+ * task is added.
+ */
+void taskSetKind(task_t *task, const char *kind);
+
+/*
+ * Set the overlap policy, TASK_OVERLAP_ALLOW by default. Must be called
+ * before the task is added. Skipped and coalesced runs are counted and
+ * logged.
+ */
+void taskSetOverlap(task_t *task, taskOverlap_t overlap);
+
+/*
+ * Queue a task, the scheduler takes ownership of it. Returns -1 and frees
+ * the task if one with the same id is already queued (errno EEXIST), its
+ * expression never fires (EINVAL) or there is no memory to queue it
+ * (ENOMEM).
+ */
+int taskAdd(scheduler_t *scheduler, task_t *task);
 
 void taskDelete(scheduler_t *scheduler, const char *id);
 
+/*
+ * Create a scheduler and its thread pool. The pool is sized by
+ * INVEST_POOL_MIN (default 1), INVEST_POOL_MAX (default the larger of
+ * the class slots and the CPUs) and INVEST_POOL_LINGER (default 120s).
+ * INVEST_POOL_TUNE_MS turns on autoscaling towards
+ * INVEST_POOL_TARGET_WAIT_MS of queue wait (default 50), the minimum
+ * then defaults to the class slots. INVEST_POOL_PLACEMENT (compact,
+ * scatter or node:N) and INVEST_POOL_CPUS (a CPU list such as "0-7")
+ * pin the workers, see thrPoolPlace(). INVEST_POOL_STATS_MS logs the
+ * pool's statistics, with every task's jobs counted under its kind.
+ */
 scheduler_t *schedulerCreate(void);
 
-void *schedulerProcess(void *args);
+/*
+ * Run the scheduler from a reactor, a timerfd armed for the earliest
+ * deadline dispatches the due tasks on the reactor thread. Nothing is
+ * dispatched until it is attached. The reactor must outlive the
+ * scheduler's use of it.
+ * On error, schedulerAttach() returns -1 with errno set to the error code.
+ */
+int schedulerAttach(scheduler_t *scheduler, reactor_t *reactor);
+
+/*
+ * Wait for the running tasks and release the scheduler and its queue.
+ * It must no longer be attached to a running reactor.
+ */
+void schedulerDestroy(scheduler_t *scheduler);
 
+/*
+ * Create a task that runs func on the cron pattern. Tasks with the same
+ * pattern share one compiled copy of it.
+ * Returns NULL with errno set to EINVAL if the pattern is not a valid cron
+ * expression, or ENOMEM.
+ */
 task_t *taskCreate(const char *id, const char *pattern, int repeat, void *(*func)(void *));
 
 #endif //INVEST_FETCH_C_SCHEDULE_H
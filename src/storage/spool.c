@@ -0,0 +1,469 @@
+//
+// Created by Matthew Johnson on 20/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "spool.h"
+
+#define SPOOL_MAGIC 0x4c4f4f53u      /* "SOOL" */
+#define SPOOL_VERSION 1u
+#define SPOOL_RECORD_MAGIC 0x44524352u  /* "RCRD" */
+/* Records start on the page after the header so it can be synced alone. */
+#define SPOOL_DATA_START 4096u
+#define SPOOL_ALIGN(x) (((x) + 7u) & ~(uint64_t) 7u)
+
+/*
+ * The header lives at the start of the file.
+ */
+typedef struct spoolHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation;    /* bumped every time the spool is rewound */
+    uint32_t reserved;
+    uint64_t readOffset;    /* first record that has not been consumed */
+    uint64_t writeOffset;   /* where the next record is appended */
+} spoolHeader_t;
+
+/*
+ * Every record is prefixed by this, records are 8 byte aligned.
+ */
+typedef struct spoolRecord {
+    uint32_t magic;
+    uint32_t length;        /* length of the payload */
+    uint32_t crc;           /* crc32 of the payload */
+    uint32_t generation;    /* must match the header */
+} spoolRecord_t;
+
+struct spool {
+    pthread_mutex_t spoolMutex;     /* protects the mapping and offsets */
+    int fd;                         /* the backing file */
+    uint8_t *map;                   /* the whole file */
+    size_t size;                    /* size of the mapping */
+    spoolFsync_t policy;            /* see spool.h */
+    unsigned int intervalMs;        /* for SPOOL_FSYNC_INTERVAL */
+    struct timespec lastSync;       /* last time the records were synced */
+    int unsynced;                   /* records appended since lastSync */
+    uint64_t moved;                 /* bytes records have moved towards the front */
+};
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void
+crcInit(void) {
+    uint32_t c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (uint32_t) n;
+        for (k = 0; k < 8; k++) {
+            c = c & 1u ? 0xedb88320u ^ (c >> 1u) : c >> 1u;
+        }
+        crcTable[n] = c;
+    }
+}
+
+static uint32_t
+crc32(const uint8_t *data, size_t len) {
+    uint32_t c = 0xffffffffu;
+
+    while (len--) {
+        c = crcTable[(c ^ *data++) & 0xffu] ^ (c >> 8u);
+    }
+    return c ^ 0xffffffffu;
+}
+
+static inline spoolHeader_t *
+spoolHeader(spool_t *spool) {
+    return (spoolHeader_t *) spool->map;
+}
+
+/*
+ * msync needs a page aligned start address.
+ */
+static void
+syncRange(spool_t *spool, uint64_t from, uint64_t to) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = from & ~((uint64_t) page - 1);
+
+    if (to > start) {
+        msync(spool->map + start, to - start, MS_SYNC);
+    }
+}
+
+/*
+ * Sync everything appended so far, the caller holds spoolMutex.
+ */
+static void
+syncAppended(spool_t *spool, const struct timespec *now) {
+    msync(spool->map, spoolHeader(spool)->writeOffset + sizeof(spoolRecord_t), MS_SYNC);
+    spool->lastSync = *now;
+    spool->unsynced = 0;
+}
+
+static inline long
+elapsedMs(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void
+syncHeader(spool_t *spool) {
+    if (spool->policy != SPOOL_FSYNC_NONE) {
+        syncRange(spool, 0, sizeof(spoolHeader_t));
+    }
+}
+
+/*
+ * Write an empty record header after the last record so a recovery scan
+ * can never run on into stale data.
+ */
+static void
+terminate(spool_t *spool, uint64_t offset) {
+    if (offset + sizeof(spoolRecord_t) <= spool->size) {
+        memset(spool->map + offset, 0, sizeof(spoolRecord_t));
+    }
+}
+
+static int
+validRecord(spool_t *spool, uint64_t offset) {
+    spoolRecord_t *record;
+
+    if (offset + sizeof(spoolRecord_t) > spool->size) {
+        return 0;
+    }
+    record = (spoolRecord_t *) (spool->map + offset);
+    if (record->magic != SPOOL_RECORD_MAGIC || record->generation != spoolHeader(spool)->generation ||
+        offset + sizeof(spoolRecord_t) + record->length > spool->size) {
+        return 0;
+    }
+    return crc32(spool->map + offset + sizeof(spoolRecord_t), record->length) == record->crc;
+}
+
+/*
+ * Find the end of the valid records, the stored write offset may be
+ * behind if the process died between appending and updating it.
+ */
+static void
+recover(spool_t *spool) {
+    spoolHeader_t *header = spoolHeader(spool);
+    uint64_t offset;
+    int count = 0;
+
+    if (header->readOffset < SPOOL_DATA_START || header->readOffset > spool->size) {
+        header->readOffset = SPOOL_DATA_START;
+    }
+    offset = header->readOffset;
+    while (validRecord(spool, offset)) {
+        offset += SPOOL_ALIGN(sizeof(spoolRecord_t) + ((spoolRecord_t *) (spool->map + offset))->length);
+        count++;
+    }
+    header->writeOffset = offset;
+    terminate(spool, offset);
+    syncHeader(spool);
+    if (count > 0) {
+        logWarn("Recovered %d unwritten batches from the spool.", count)
+    }
+}
+
+static int
+resize(spool_t *spool, size_t size) {
+    void *map;
+
+    if (ftruncate(spool->fd, (off_t) size) == -1) {
+        return -1;
+    }
+    /* The mapping is shared so nothing is lost by mapping it again. */
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (spool->map != NULL) {
+        munmap(spool->map, spool->size);
+    }
+    spool->map = map;
+    spool->size = size;
+    return 0;
+}
+
+spool_t *
+spoolOpen(const char *path, size_t size, spoolFsync_t policy, unsigned int intervalMs) {
+    spool_t *spool;
+    spoolHeader_t *header;
+    struct stat st;
+    int error;
+
+    pthread_once(&crcOnce, crcInit);
+
+    if ((spool = calloc(1, sizeof(*spool))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((spool->fd = open(path, O_RDWR | O_CREAT, 0600)) == -1 || fstat(spool->fd, &st) == -1) {
+        goto fail;
+    }
+    if (size < 2 * SPOOL_DATA_START) {
+        size = 2 * SPOOL_DATA_START;
+    }
+    if ((size_t) st.st_size > size) {
+        size = st.st_size;
+    }
+    if (resize(spool, size) == -1) {
+        goto fail;
+    }
+    pthread_mutex_init(&spool->spoolMutex, NULL);
+    spool->policy = policy;
+    spool->intervalMs = intervalMs;
+    clock_gettime(CLOCK_MONOTONIC, &spool->lastSync);
+
+    header = spoolHeader(spool);
+    if (header->magic != SPOOL_MAGIC || header->version != SPOOL_VERSION) {
+        if (st.st_size >= (off_t) sizeof(spoolHeader_t) && header->magic != 0) {
+            logError("%s is not a spool file.", path)
+            errno = EINVAL;
+            goto fail;
+        }
+        header->magic = SPOOL_MAGIC;
+        header->version = SPOOL_VERSION;
+        header->generation = 1;
+        header->readOffset = SPOOL_DATA_START;
+        header->writeOffset = SPOOL_DATA_START;
+    }
+    recover(spool);
+    return spool;
+
+    fail:
+    error = errno;
+    if (spool->map) {
+        munmap(spool->map, spool->size);
+    }
+    if (spool->fd != -1) {
+        close(spool->fd);
+    }
+    free(spool);
+    errno = error;
+    return NULL;
+}
+
+/*
+ * Move the unconsumed records to the front of the file under the next
+ * generation. Only done when they fit entirely in the consumed space, so
+ * the originals stay intact until the header switches over and a crash at
+ * any point recovers one copy or the other.
+ */
+static int
+compact(spool_t *spool) {
+    spoolHeader_t *header = spoolHeader(spool);
+    spoolRecord_t *record;
+    uint64_t live, from, to;
+    uint32_t generation;
+
+    live = header->writeOffset - header->readOffset;
+    if (live + sizeof(spoolRecord_t) > header->readOffset - SPOOL_DATA_START) {
+        return 0;
+    }
+    generation = header->generation + 1;
+    memcpy(spool->map + SPOOL_DATA_START, spool->map + header->readOffset, live);
+    to = SPOOL_DATA_START;
+    while (to < SPOOL_DATA_START + live) {
+        record = (spoolRecord_t *) (spool->map + to);
+        record->generation = generation;
+        to += SPOOL_ALIGN(sizeof(spoolRecord_t) + record->length);
+    }
+    terminate(spool, to);
+    if (spool->policy != SPOOL_FSYNC_NONE) {
+        syncRange(spool, SPOOL_DATA_START, to + sizeof(spoolRecord_t));
+    }
+
+    from = header->readOffset;
+    header->generation = generation;
+    header->readOffset = SPOOL_DATA_START;
+    header->writeOffset = to;
+    syncHeader(spool);
+    spool->moved += from - SPOOL_DATA_START;
+    return 1;
+}
+
+/*
+ * Make room for len more bytes, first by compacting the unconsumed records
+ * to the front and only then by growing the file. A spool that is being
+ * consumed stays within about twice the most it has ever held unconsumed.
+ */
+static int
+reserve(spool_t *spool, uint64_t len) {
+    spoolHeader_t *header = spoolHeader(spool);
+    size_t size;
+
+    if (header->writeOffset + len + sizeof(spoolRecord_t) <= spool->size) {
+        return 0;
+    }
+    if (compact(spool) && header->writeOffset + len + sizeof(spoolRecord_t) <= spool->size) {
+        return 0;
+    }
+    for (size = spool->size * 2; header->writeOffset + len + sizeof(spoolRecord_t) > size; size *= 2);
+    logWarn("Growing the spool to %lu bytes.", (unsigned long) size)
+    return resize(spool, size);
+}
+
+int
+spoolAppend(spool_t *spool, const void *data, uint32_t len) {
+    spoolHeader_t *header;
+    spoolRecord_t *record;
+    struct timespec now;
+    uint64_t start, total;
+
+    total = SPOOL_ALIGN(sizeof(spoolRecord_t) + len);
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    if (reserve(spool, total) == -1) {
+        pthread_mutex_unlock(&spool->spoolMutex);
+        return -1;
+    }
+    header = spoolHeader(spool);
+    start = header->writeOffset;
+    record = (spoolRecord_t *) (spool->map + start);
+    memcpy(spool->map + start + sizeof(spoolRecord_t), data, len);
+    record->length = len;
+    record->crc = crc32(data, len);
+    record->generation = header->generation;
+    record->magic = SPOOL_RECORD_MAGIC;
+    terminate(spool, start + total);
+
+    /* The record must be on disk before the header points past it. */
+    switch (spool->policy) {
+        case SPOOL_FSYNC_ALWAYS:
+            syncRange(spool, start, start + total + sizeof(spoolRecord_t));
+            header->writeOffset = start + total;
+            syncHeader(spool);
+            break;
+        case SPOOL_FSYNC_INTERVAL:
+            header->writeOffset = start + total;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            /* Otherwise spoolFlush() syncs it once the interval is up. */
+            if (elapsedMs(&spool->lastSync, &now) >= spool->intervalMs) {
+                syncAppended(spool, &now);
+            } else {
+                spool->unsynced = 1;
+            }
+            break;
+        default:
+            header->writeOffset = start + total;
+    }
+    pthread_mutex_unlock(&spool->spoolMutex);
+    return 0;
+}
+
+int
+spoolRead(spool_t *spool, int maxRecords, spoolRecordFunc func, void *arg, uint64_t *next) {
+    spoolHeader_t *header;
+    spoolRecord_t *record;
+    uint64_t offset;
+    int count = 0;
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    header = spoolHeader(spool);
+    offset = header->readOffset;
+    while (count < maxRecords && offset < header->writeOffset) {
+        record = (spoolRecord_t *) (spool->map + offset);
+        if (func(spool->map + offset + sizeof(spoolRecord_t), record->length, arg) != 0) {
+            break;
+        }
+        offset += SPOOL_ALIGN(sizeof(spoolRecord_t) + record->length);
+        count++;
+    }
+    /* Offsets handed out stay valid across compaction. */
+    *next = offset + spool->moved;
+    pthread_mutex_unlock(&spool->spoolMutex);
+    return count;
+}
+
+void
+spoolConsume(spool_t *spool, uint64_t offset) {
+    spoolHeader_t *header;
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    header = spoolHeader(spool);
+    offset -= spool->moved;
+    if (offset >= header->readOffset && offset <= header->writeOffset) {
+        header->readOffset = offset;
+        if (header->readOffset == header->writeOffset) {
+            /*
+             * Everything has been written, start again at the front. The
+             * generation goes first so old records can never be recovered.
+             */
+            header->generation++;
+            spool->moved += header->readOffset - SPOOL_DATA_START;
+            header->readOffset = SPOOL_DATA_START;
+            header->writeOffset = SPOOL_DATA_START;
+            terminate(spool, SPOOL_DATA_START);
+        }
+        syncHeader(spool);
+    }
+    pthread_mutex_unlock(&spool->spoolMutex);
+}
+
+int
+spoolFlush(spool_t *spool, struct timespec *next) {
+    struct timespec now;
+    long left;
+    int unsynced = 0;
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    if (spool->policy == SPOOL_FSYNC_INTERVAL && spool->unsynced) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((left = (long) spool->intervalMs - elapsedMs(&spool->lastSync, &now)) <= 0) {
+            syncAppended(spool, &now);
+        } else {
+            clock_gettime(CLOCK_REALTIME, next);
+            next->tv_sec += left / 1000;
+            next->tv_nsec += (left % 1000) * 1000000;
+            if (next->tv_nsec >= 1000000000) {
+                next->tv_sec++;
+                next->tv_nsec -= 1000000000;
+            }
+            unsynced = 1;
+        }
+    }
+    pthread_mutex_unlock(&spool->spoolMutex);
+    return unsynced;
+}
+
+uint64_t
+spoolTail(spool_t *spool) {
+    uint64_t tail;
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    tail = spoolHeader(spool)->writeOffset + spool->moved;
+    pthread_mutex_unlock(&spool->spoolMutex);
+    return tail;
+}
+
+int
+spoolConsumed(spool_t *spool, uint64_t offset) {
+    int consumed;
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    consumed = spoolHeader(spool)->readOffset + spool->moved >= offset;
+    pthread_mutex_unlock(&spool->spoolMutex);
+    return consumed;
+}
+
+uint64_t
+spoolPending(spool_t *spool) {
+    uint64_t pending;
+
+    pthread_mutex_lock(&spool->spoolMutex);
+    pending = spoolHeader(spool)->writeOffset - spoolHeader(spool)->readOffset;
+    pthread_mutex_unlock(&spool->spoolMutex);
+    return pending;
+}
+
+void
+spoolClose(spool_t *spool) {
+    pthread_mutex_lock(&spool->spoolMutex);
+    msync(spool->map, spool->size, MS_SYNC);
+    munmap(spool->map, spool->size);
+    close(spool->fd);
+    pthread_mutex_unlock(&spool->spoolMutex);
+    pthread_mutex_destroy(&spool->spoolMutex);
+    free(spool);
+}
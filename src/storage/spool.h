@@ -0,0 +1,105 @@
+//
+// Created by Matthew Johnson on 20/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_SPOOL_H
+#define INVEST_FETCH_C_SPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../logging/logger.h"
+
+/*
+ * When appended records are forced to disk.
+ *  SPOOL_FSYNC_NONE:       left to the kernel, survives a process crash.
+ *  SPOOL_FSYNC_INTERVAL:   at most one msync per interval, a record is
+ *                          synced within the interval of being appended
+ *                          as long as spoolFlush() is called.
+ *  SPOOL_FSYNC_ALWAYS:     msync before every append returns.
+ */
+typedef enum spoolFsync {
+    SPOOL_FSYNC_NONE,
+    SPOOL_FSYNC_INTERVAL,
+    SPOOL_FSYNC_ALWAYS
+} spoolFsync_t;
+
+/*
+ * The spool_t type is opaque to the client.
+ * A spool is an append only, memory mapped file of length prefixed
+ * records with a separately committed read offset. Unconsumed records are
+ * moved to the front of the file when it fills up, it only grows when
+ * they don't fit in the space already consumed.
+ */
+typedef struct spool spool_t;
+
+/*
+ * Called for each record read from the spool. Returning non zero
+ * stops the read early, that record is not counted.
+ */
+typedef int (*spoolRecordFunc)(const void *data, uint32_t len, void *arg);
+
+/*
+ * Open or create the spool at path. Records that were appended but not
+ * yet consumed when the file was last closed (or the process died) are
+ * recovered. size is the initial file size, the file grows when needed.
+ * On error, spoolOpen() returns NULL with errno set to the error code.
+ */
+spool_t *spoolOpen(const char *path, size_t size, spoolFsync_t policy, unsigned int intervalMs);
+
+/*
+ * Append a record. On error, spoolAppend() returns -1 with errno set.
+ */
+int spoolAppend(spool_t *spool, const void *data, uint32_t len);
+
+/*
+ * Pass up to maxRecords unconsumed records, oldest first, to func. The
+ * offset to hand to spoolConsume() once they are processed is written
+ * to next, it stays valid if the records are moved in the meantime.
+ * Returns the number of records read.
+ */
+int spoolRead(spool_t *spool, int maxRecords, spoolRecordFunc func, void *arg, uint64_t *next);
+
+/*
+ * Mark every record before offset as processed.
+ */
+void spoolConsume(spool_t *spool, uint64_t offset);
+
+/*
+ * Sync records appended under SPOOL_FSYNC_INTERVAL once their interval
+ * is up. Returns 1 with next set to when (CLOCK_REALTIME) to call again
+ * if some are still waiting, 0 if everything appended is synced.
+ */
+int spoolFlush(spool_t *spool, struct timespec *next);
+
+/*
+ * Offset just past the last record appended, comparable with the ones
+ * spoolRead() hands out.
+ */
+uint64_t spoolTail(spool_t *spool);
+
+/*
+ * Whether every record before offset has been consumed.
+ */
+int spoolConsumed(spool_t *spool, uint64_t offset);
+
+/*
+ * Number of bytes of records that have not been consumed.
+ */
+uint64_t spoolPending(spool_t *spool);
+
+/*
+ * Flush and close the spool.
+ */
+void spoolClose(spool_t *spool);
+
+#endif //INVEST_FETCH_C_SPOOL_H
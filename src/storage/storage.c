@@ -0,0 +1,1267 @@
+//
+// Created by Matthew Johnson on 18/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "storage.h"
+#include "spool.h"
+
+/* Milliseconds to wait on the socket before checking the connection again. */
+#define STORAGE_POLL_MS 1000
+/* Milliseconds to wait before replaying the spool again after a failure. */
+#define STORAGE_RETRY_MS 5000
+/* Batches the storage thread makes room for up front, it grows as needed. */
+#define STORAGE_INITIAL_BATCHES 16
+/* Most spooled batches merged into a single replay transaction. */
+#define STORAGE_REPLAY_BATCHES 256
+
+#define FLUSH_MS_ENV "INVEST_STORAGE_FLUSH_MS"
+#define FLUSH_STATEMENTS_ENV "INVEST_STORAGE_FLUSH_STATEMENTS"
+#define FLUSH_DEFAULT_MS 250
+#define FLUSH_DEFAULT_STATEMENTS 10000
+
+#define SPOOL_PATH_ENV "INVEST_SPOOL_PATH"
+#define SPOOL_SIZE_ENV "INVEST_SPOOL_SIZE"
+#define SPOOL_FSYNC_ENV "INVEST_SPOOL_FSYNC"
+#define SPOOL_FSYNC_MS_ENV "INVEST_SPOOL_FSYNC_MS"
+#define SPOOL_DEFAULT_PATH "invest_fetch.spool"
+#define SPOOL_DEFAULT_SIZE (16u * 1024u * 1024u)
+/* Spooled batches that can never be written are moved to <spool>.dead */
+#define SPOOL_DEAD_SUFFIX ".dead"
+
+/* Writer flags */
+#define STORAGE_RUNNING 0x01u
+#define STORAGE_EXIT 0x02u
+
+/*
+ * A single parameterised statement in a batch.
+ */
+typedef struct storageQuery {
+    struct storageQuery *queryNext;     /* next statement in the batch */
+    char *command;                      /* SQL text */
+    char *label;                        /* names the statement in failure reports, can be NULL */
+    int nParams;                        /* number of parameters */
+    char **values;                      /* copies of the parameter values */
+    int *lengths;                       /* lengths of the parameter values */
+    int *formats;                       /* 0 text, 1 binary */
+    storageResultFunc onResult;         /* called with a successful result */
+    void *resultArg;                    /* its argument */
+    PGresult *result;                   /* kept until the transaction commits */
+} storageQuery_t;
+
+struct storageBatch {
+    storageBatch_t *batchNext;  /* linked list of submitted batches */
+    char *name;                 /* used when reporting */
+    storageQuery_t *queryHead;  /* statements in execution order */
+    storageQuery_t *queryTail;
+    int nQueries;               /* number of statements */
+    int autocommit;             /* run outside a transaction */
+    int afterDurable;           /* held until the spool is written up to spoolMark */
+    uint64_t spoolMark;         /* spool tail when the batch was submitted */
+    storageDoneFunc done;       /* completion notification */
+    void *doneArg;              /* its argument */
+};
+
+static struct storageWriter {
+    pthread_mutex_t writerMutex;    /* protects the submission queue */
+    pthread_cond_t writerWorkcv;    /* signaled when a batch is submitted */
+    pthread_t writerTid;            /* the storage thread */
+    storageBatch_t *batchHead;      /* head of the FIFO batch queue */
+    storageBatch_t *batchTail;      /* tail of the FIFO batch queue */
+    storageBatch_t *heldHead;       /* batches waiting on earlier durable ones */
+    storageBatch_t *heldTail;
+    PGconn *conn;                   /* only used by the storage thread */
+    spool_t *spool;                 /* durable batches, NULL if unavailable */
+    struct timespec replayAt;       /* earliest time to replay the spool */
+    int replayIsolate;              /* replays left to run one spooled batch at a time */
+    spool_t *dead;                  /* rejected spool records, opened when first needed */
+    char *deadPath;                 /* where they are kept */
+    struct timespec firstQueued;    /* when the oldest queued batch arrived */
+    int nQueued;                    /* statements in the queued batches */
+    unsigned int flushMs;           /* longest a batch waits for others to join it */
+    int flushStatements;            /* flush early once this many are queued */
+    unsigned int writerFlags;       /* see above */
+} Writer = {.writerMutex = PTHREAD_MUTEX_INITIALIZER, .writerWorkcv = PTHREAD_COND_INITIALIZER};
+
+storageBatch_t *
+storageBatchCreate(const char *name) {
+    storageBatch_t *batch;
+    size_t len;
+
+    if ((batch = calloc(1, sizeof(*batch))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    len = strlen(name) + 1;
+    if ((batch->name = (char *) malloc(len * sizeof(char))) == NULL) {
+        free(batch);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strncpy(batch->name, name, len);
+    return batch;
+}
+
+static void
+freeQuery(storageQuery_t *query) {
+    int i;
+
+    if (query->values != NULL) {
+        for (i = 0; i < query->nParams; i++) {
+            free(query->values[i]);
+        }
+    }
+    free(query->values);
+    free(query->lengths);
+    free(query->formats);
+    free(query->command);
+    free(query->label);
+    free(query);
+}
+
+int
+storageBatchAdd(storageBatch_t *batch, const char *command, int nParams, const char *const *values,
+                const int *lengths, const int *formats, storageResultFunc onResult, void *resultArg) {
+    storageQuery_t *query;
+    size_t len;
+    int i;
+
+    if ((query = calloc(1, sizeof(*query))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    len = strlen(command) + 1;
+    query->nParams = nParams;
+    query->command = (char *) malloc(len * sizeof(char));
+    /* calloc(0) may return NULL, keep at least one slot. */
+    query->values = calloc(nParams ? nParams : 1, sizeof(char *));
+    query->lengths = calloc(nParams ? nParams : 1, sizeof(int));
+    query->formats = calloc(nParams ? nParams : 1, sizeof(int));
+    if (query->command == NULL || query->values == NULL || query->lengths == NULL || query->formats == NULL) {
+        freeQuery(query);
+        errno = ENOMEM;
+        return -1;
+    }
+    strncpy(query->command, command, len);
+    for (i = 0; i < nParams; i++) {
+        query->formats[i] = formats ? formats[i] : 0;
+        if (values[i] == NULL) {
+            continue;
+        }
+        /* Binary values carry their own length, text is nul terminated. */
+        if (query->formats[i]) {
+            len = lengths[i];
+        } else {
+            len = strlen(values[i]) + 1;
+        }
+        query->lengths[i] = (int) len;
+        if ((query->values[i] = malloc(len)) == NULL) {
+            freeQuery(query);
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(query->values[i], values[i], len);
+    }
+    query->onResult = onResult;
+    query->resultArg = resultArg;
+
+    if (batch->queryTail == NULL)
+        batch->queryHead = query;
+    else
+        batch->queryTail->queryNext = query;
+    batch->queryTail = query;
+    batch->nQueries++;
+    return 0;
+}
+
+int
+storageBatchLabel(storageBatch_t *batch, const char *label) {
+    char *copy;
+
+    if (batch->queryTail == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((copy = strdup(label)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    free(batch->queryTail->label);
+    batch->queryTail->label = copy;
+    return 0;
+}
+
+void
+storageBatchAutocommit(storageBatch_t *batch) {
+    batch->autocommit = 1;
+}
+
+void
+storageBatchAfterDurable(storageBatch_t *batch) {
+    batch->afterDurable = 1;
+}
+
+int
+storageBatchCount(storageBatch_t *batch) {
+    return batch->nQueries;
+}
+
+static int
+storageBatchTotal(storageBatch_t **batches, int nBatches) {
+    int total = 0;
+
+    while (nBatches-- > 0) {
+        total += batches[nBatches]->nQueries;
+    }
+    return total;
+}
+
+void
+storageBatchFree(storageBatch_t *batch) {
+    storageQuery_t *query;
+
+    while ((query = batch->queryHead) != NULL) {
+        batch->queryHead = query->queryNext;
+        freeQuery(query);
+    }
+    free(batch->name);
+    free(batch);
+}
+
+/*
+ * Growable buffer used to encode batches for the spool. Once an
+ * allocation fails everything else is dropped and failed is set.
+ */
+typedef struct encoder {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+} encoder_t;
+
+static void
+encode(encoder_t *enc, const void *data, size_t len) {
+    uint8_t *grown;
+    size_t capacity = enc->capacity;
+
+    if (enc->failed) {
+        return;
+    }
+    if (enc->size + len > capacity) {
+        while (enc->size + len > capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+        }
+        if ((grown = realloc(enc->data, capacity)) == NULL) {
+            enc->failed = 1;
+            return;
+        }
+        enc->data = grown;
+        enc->capacity = capacity;
+    }
+    memcpy(enc->data + enc->size, data, len);
+    enc->size += len;
+}
+
+static void
+encodeInt(encoder_t *enc, int32_t value) {
+    encode(enc, &value, sizeof(value));
+}
+
+static void
+encodeString(encoder_t *enc, const char *str) {
+    int32_t len = (int32_t) strlen(str);
+    encodeInt(enc, len);
+    encode(enc, str, len);
+}
+
+/*
+ * Spooled batches are only ever replayed on the same host so values are
+ * kept in native byte order:
+ *  name, nQueries, then per query: command, nParams and per parameter
+ *  format, length (-1 for NULL) and the value bytes.
+ */
+static void
+encodeBatch(encoder_t *enc, storageBatch_t *batch) {
+    storageQuery_t *query;
+    int i;
+
+    encodeString(enc, batch->name);
+    encodeInt(enc, batch->nQueries);
+    for (query = batch->queryHead; query != NULL; query = query->queryNext) {
+        encodeString(enc, query->command);
+        encodeInt(enc, query->nParams);
+        for (i = 0; i < query->nParams; i++) {
+            encodeInt(enc, query->formats[i]);
+            if (query->values[i] == NULL) {
+                encodeInt(enc, -1);
+            } else {
+                encodeInt(enc, query->lengths[i]);
+                encode(enc, query->values[i], query->lengths[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Read cursor over an encoded batch, fails once it runs off the end.
+ */
+typedef struct decoder {
+    const uint8_t *data;
+    uint32_t remaining;
+} decoder_t;
+
+static const void *
+decode(decoder_t *dec, uint32_t len) {
+    const void *ptr = dec->data;
+
+    if (len > dec->remaining) {
+        return NULL;
+    }
+    dec->data += len;
+    dec->remaining -= len;
+    return ptr;
+}
+
+static int
+decodeInt(decoder_t *dec, int32_t *value) {
+    const void *ptr = decode(dec, sizeof(*value));
+
+    if (ptr == NULL) {
+        return -1;
+    }
+    memcpy(value, ptr, sizeof(*value));
+    return 0;
+}
+
+static char *
+decodeString(decoder_t *dec) {
+    const char *ptr;
+    char *str;
+    int32_t len;
+
+    if (decodeInt(dec, &len) == -1 || len < 0 || (ptr = decode(dec, len)) == NULL) {
+        return NULL;
+    }
+    if ((str = malloc(len + 1)) == NULL) {
+        return NULL;
+    }
+    memcpy(str, ptr, len);
+    str[len] = '\0';
+    return str;
+}
+
+/*
+ * A slice of the spool being replayed as one batch.
+ */
+typedef struct replay {
+    storageBatch_t *batch;  /* every statement of the slice */
+    uint64_t next;          /* spool offset after the slice */
+    int count;              /* spooled batches in the slice */
+    int corrupt;            /* the read stopped at a corrupt record */
+} replay_t;
+
+/*
+ * Decode every statement of an encoded batch into entry. On error,
+ * decodeEntry() returns -1 with errno set to EINVAL if the record is
+ * corrupt or ENOMEM.
+ */
+static int
+decodeEntry(storageBatch_t *entry, decoder_t *dec) {
+    char *command;
+    const char **values;
+    int *lengths, *formats;
+    int32_t nQueries, nParams, value;
+    int i, result = 0;
+
+    if (decodeInt(dec, &nQueries) == -1 || nQueries < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (; result == 0 && nQueries > 0; nQueries--) {
+        errno = EINVAL;
+        if ((command = decodeString(dec)) == NULL || decodeInt(dec, &nParams) == -1 || nParams < 0) {
+            free(command);
+            return -1;
+        }
+        values = calloc(nParams ? nParams : 1, sizeof(char *));
+        lengths = calloc(nParams ? nParams : 1, sizeof(int));
+        formats = calloc(nParams ? nParams : 1, sizeof(int));
+        if (values == NULL || lengths == NULL || formats == NULL) {
+            errno = ENOMEM;
+            result = -1;
+        }
+        for (i = 0; i < nParams && result == 0; i++) {
+            if (decodeInt(dec, &formats[i]) == -1 || decodeInt(dec, &value) == -1 ||
+                (value >= 0 && (values[i] = decode(dec, value)) == NULL)) {
+                errno = EINVAL;
+                result = -1;
+            }
+            lengths[i] = value;
+        }
+        /* Text values are stored with their terminator. */
+        if (result == 0) {
+            result = storageBatchAdd(entry, command, nParams, values, lengths, formats, NULL, NULL);
+        }
+        free(values);
+        free(lengths);
+        free(formats);
+        free(command);
+    }
+    if (result == 0 && dec->remaining != 0) {
+        errno = EINVAL;
+        result = -1;
+    }
+    return result;
+}
+
+/*
+ * Append every statement of an encoded batch to the replay batch. The
+ * whole record is decoded before any of it is added, so a corrupt one is
+ * never replayed in part, the read stops there instead.
+ */
+static int
+decodeBatch(const void *data, uint32_t len, void *arg) {
+    replay_t *replay = (replay_t *) arg;
+    storageBatch_t *entry;
+    decoder_t dec = {data, len};
+    char *name;
+
+    errno = EINVAL;
+    if ((name = decodeString(&dec)) == NULL || (entry = storageBatchCreate(name)) == NULL) {
+        replay->corrupt = errno != ENOMEM;
+        free(name);
+        return 1;
+    }
+    free(name);
+    if (decodeEntry(entry, &dec) == -1) {
+        replay->corrupt = errno != ENOMEM;
+        storageBatchFree(entry);
+        return 1;
+    }
+    if (entry->queryHead != NULL) {
+        if (replay->batch->queryTail == NULL) {
+            replay->batch->queryHead = entry->queryHead;
+        } else {
+            replay->batch->queryTail->queryNext = entry->queryHead;
+        }
+        replay->batch->queryTail = entry->queryTail;
+        replay->batch->nQueries += entry->nQueries;
+        entry->queryHead = NULL;
+    }
+    storageBatchFree(entry);
+    return 0;
+}
+
+/*
+ * Push any pending output, then wait for the socket to become readable
+ * and pull in whatever the server has sent.
+ */
+static int
+pumpConnection(PGconn *conn) {
+    struct pollfd pfd;
+    int flush;
+
+    if ((flush = PQflush(conn)) == -1) {
+        return -1;
+    }
+    pfd.fd = PQsocket(conn);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (flush == 1) {
+        pfd.events |= POLLOUT;
+    }
+    if (poll(&pfd, 1, STORAGE_POLL_MS) == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+        if (PQconsumeInput(conn) == 0) {
+            return -1;
+        }
+    }
+    return PQstatus(conn) == CONNECTION_OK ? 0 : -1;
+}
+
+/*
+ * Get the next result without ever blocking inside libpq. Returns -1 if
+ * the connection failed, the result (which can be NULL) otherwise.
+ */
+static int
+awaitResult(PGconn *conn, PGresult **res) {
+    *res = NULL;
+    while (PQisBusy(conn)) {
+        if (pumpConnection(conn) == -1) {
+            return -1;
+        }
+    }
+    *res = PQgetResult(conn);
+    return 0;
+}
+
+/*
+ * Read the result of a single statement and consume the NULL that
+ * terminates it. Results with a callback are kept until the transaction
+ * commits so a rolled back statement is never reported.
+ */
+static int
+collectResult(PGconn *conn, const char *name, storageQuery_t *query, int index) {
+    PGresult *res;
+    ExecStatusType status;
+    int result = 0, terminated;
+
+    if (awaitResult(conn, &res) == -1) {
+        return -1;
+    }
+    terminated = res == NULL;
+    status = res ? PQresultStatus(res) : PGRES_FATAL_ERROR;
+    switch (status) {
+        case PGRES_COMMAND_OK:
+        case PGRES_TUPLES_OK:
+            if (query && query->onResult) {
+                query->result = res;
+                res = NULL;
+            }
+            break;
+#ifdef LIBPQ_HAS_PIPELINING
+        case PGRES_PIPELINE_ABORTED:
+            logWarn("%s statement %d%s%s skipped after an earlier failure.", name, index,
+                    query && query->label ? " for " : "", query && query->label ? query->label : "")
+            result = 1;
+            break;
+#endif
+        default:
+            logError("%s statement %d%s%s failed: %s", name, index,
+                     query && query->label ? " for " : "", query && query->label ? query->label : "",
+                     res ? PQresultErrorMessage(res) : PQerrorMessage(conn))
+            result = 1;
+    }
+    PQclear(res);
+    /* Each statement's results are terminated by a NULL. */
+    while (!terminated) {
+        if (awaitResult(conn, &res) == -1) {
+            return -1;
+        }
+        terminated = res == NULL;
+        PQclear(res);
+    }
+    return result;
+}
+
+static int
+sendQuery(PGconn *conn, storageQuery_t *query, const char *command) {
+    if (query) {
+        return PQsendQueryParams(conn, query->command, query->nParams, NULL, (const char *const *) query->values,
+                                 query->lengths, query->formats, 0);
+    }
+    return PQsendQueryParams(conn, command, 0, NULL, NULL, NULL, NULL, 0);
+}
+
+/*
+ * Pass the kept results to their callbacks if the transaction committed,
+ * release them either way.
+ */
+static void
+deliverResults(storageBatch_t *batch, int committed) {
+    storageQuery_t *query;
+
+    for (query = batch->queryHead; query != NULL; query = query->queryNext) {
+        if (query->result) {
+            if (committed) {
+                query->onResult(query->result, query->resultArg);
+            }
+            PQclear(query->result);
+            query->result = NULL;
+        }
+    }
+}
+
+/*
+ * Leave a failed transaction so the connection can be used again.
+ */
+static int
+rollback(PGconn *conn) {
+    if (PQtransactionStatus(conn) == PQTRANS_IDLE) {
+        return 0;
+    }
+    if (sendQuery(conn, NULL, "ROLLBACK") != 1) {
+        return -1;
+    }
+    return collectResult(conn, "rollback", NULL, 0) == 0 ? 0 : -1;
+}
+
+/*
+ * Send a single command and wait for its result on the poll loop.
+ */
+static int
+executeQuery(PGconn *conn, const char *name, storageQuery_t *query, const char *command, int index) {
+    if (sendQuery(conn, query, command) != 1) {
+        logError("Could not send %s statement: %s", name, PQerrorMessage(conn))
+        return -1;
+    }
+    return collectResult(conn, name, query, index);
+}
+
+/*
+ * Run each statement of an autocommit batch on its own.
+ * Returns 0 if they all succeeded, 1 if one failed and -1 if the
+ * connection failed.
+ */
+static int
+executeAutocommit(PGconn *conn, storageBatch_t *batch) {
+    storageQuery_t *query;
+    int index, result = 0;
+
+    for (index = 0, query = batch->queryHead; query != NULL && result == 0; index++, query = query->queryNext) {
+        result = executeQuery(conn, batch->name, query, NULL, index);
+    }
+    return result;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+/*
+ * Queue every statement of every batch back to back inside one explicit
+ * transaction and only then collect the results.
+ * Returns 0 if it committed, 1 if a statement failed and -1 if the
+ * connection failed.
+ */
+static int
+executeGroup(PGconn *conn, storageBatch_t **batches, int nBatches) {
+    storageQuery_t *query;
+    PGresult *res;
+    int i, index, failed = 0, sent = 0, total = 0;
+
+    if (PQenterPipelineMode(conn) != 1) {
+        logError("Could not enter pipeline mode: %s", PQerrorMessage(conn))
+        return -1;
+    }
+    if (sendQuery(conn, NULL, "BEGIN") != 1) {
+        return -1;
+    }
+    for (i = 0; i < nBatches && !failed; i++) {
+        for (query = batches[i]->queryHead; query != NULL; query = query->queryNext) {
+            if (sendQuery(conn, query, NULL) != 1) {
+                logError("Could not queue %s statement: %s", batches[i]->name, PQerrorMessage(conn))
+                failed = 1;
+                break;
+            }
+            sent++;
+        }
+    }
+    if ((!failed && sendQuery(conn, NULL, "COMMIT") != 1) || PQpipelineSync(conn) != 1) {
+        return -1;
+    }
+    /* Results arrive in the order the statements were sent. */
+    if (collectResult(conn, "begin", NULL, 0) != 0) {
+        failed = 1;
+    }
+    for (i = 0; i < nBatches && total < sent; i++) {
+        for (index = 0, query = batches[i]->queryHead; query != NULL && total < sent;
+             index++, total++, query = query->queryNext) {
+            switch (collectResult(conn, batches[i]->name, query, index)) {
+                case -1:
+                    return -1;
+                case 1:
+                    failed = 1;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    if (total == sent && sent == storageBatchTotal(batches, nBatches) && collectResult(conn, "commit", NULL, 0) != 0) {
+        failed = 1;
+    }
+    /* Consume the sync point before leaving pipeline mode. */
+    do {
+        if (awaitResult(conn, &res) == -1) {
+            return -1;
+        }
+        if (res == NULL) {
+            continue;
+        }
+        if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+            PQclear(res);
+            break;
+        }
+        PQclear(res);
+    } while (1);
+    if (PQexitPipelineMode(conn) != 1) {
+        return -1;
+    }
+    if (failed) {
+        return rollback(conn) == -1 ? -1 : 1;
+    }
+    return 0;
+}
+
+#else
+
+/*
+ * libpq without pipeline support, one statement is in flight at a time
+ * inside an explicit transaction.
+ * Returns 0 if it committed, 1 if a statement failed and -1 if the
+ * connection failed.
+ */
+static int
+executeGroup(PGconn *conn, storageBatch_t **batches, int nBatches) {
+    storageQuery_t *query;
+    int i, index, result;
+
+    if ((result = executeQuery(conn, "begin", NULL, "BEGIN", 0)) != 0) {
+        return result;
+    }
+    for (i = 0; i < nBatches && result == 0; i++) {
+        for (index = 0, query = batches[i]->queryHead; query != NULL && result == 0;
+             index++, query = query->queryNext) {
+            result = executeQuery(conn, batches[i]->name, query, NULL, index);
+        }
+    }
+    if (result == 0) {
+        result = executeQuery(conn, "commit", NULL, "COMMIT", 0);
+    }
+    if (result == 1) {
+        return rollback(conn) == -1 ? -1 : 1;
+    }
+    return result;
+}
+
+#endif
+
+/*
+ * Make sure the storage thread has a usable connection.
+ */
+static PGconn *
+writerConnection(void) {
+    if (Writer.conn != NULL && PQstatus(Writer.conn) != CONNECTION_OK) {
+        PQfinish(Writer.conn);
+        Writer.conn = NULL;
+    }
+    if (Writer.conn == NULL) {
+        if ((Writer.conn = postgresConnect()) == NULL) {
+            return NULL;
+        }
+        PQsetnonblocking(Writer.conn, 1);
+    }
+    return Writer.conn;
+}
+
+/*
+ * The connection is in an unknown state, start again with a new one.
+ */
+static void
+dropConnection(void) {
+    logError("Dropping the Postgres connection: %s", PQerrorMessage(Writer.conn))
+    PQfinish(Writer.conn);
+    Writer.conn = NULL;
+}
+
+static void
+finishBatch(storageBatch_t *batch, int status) {
+    deliverResults(batch, status == 0);
+    if (batch->done) {
+        batch->done(batch->name, status, batch->doneArg);
+    }
+    storageBatchFree(batch);
+}
+
+/*
+ * Commit a group of batches as a single transaction. If any statement
+ * fails the batches are retried on their own so only the bad one fails.
+ */
+static void
+writeGroup(storageBatch_t **batches, int nBatches) {
+    struct timespec start, end;
+    PGconn *conn;
+    int i, status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((conn = writerConnection()) == NULL) {
+        logCrit("Failed to connect to the Postgres server.")
+        status = -1;
+    } else {
+        status = executeGroup(conn, batches, nBatches);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    logDebug("Wrote %d batches of %d statements in %ld ms.", nBatches, storageBatchTotal(batches, nBatches),
+             (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000)
+
+    if (status == 1 && nBatches > 1) {
+        for (i = 0; i < nBatches; i++) {
+            deliverResults(batches[i], 0);
+            if (status != -1) {
+                status = executeGroup(conn, &batches[i], 1);
+            }
+            finishBatch(batches[i], status);
+        }
+    } else {
+        for (i = 0; i < nBatches; i++) {
+            finishBatch(batches[i], status);
+        }
+    }
+    if (status == -1 && conn != NULL) {
+        dropConnection();
+    }
+}
+
+/*
+ * Write an autocommit batch, there is no transaction to retry.
+ */
+static void
+writeAutocommit(storageBatch_t *batch) {
+    PGconn *conn;
+    int status;
+
+    if ((conn = writerConnection()) == NULL) {
+        logCrit("Failed to connect to the Postgres server.")
+        status = -1;
+    } else {
+        status = executeAutocommit(conn, batch);
+    }
+    finishBatch(batch, status);
+    if (status == -1 && conn != NULL) {
+        dropConnection();
+    }
+}
+
+/*
+ * Move the autocommit batches behind the others, keeping the order of
+ * both. Returns the number of batches that can share a transaction.
+ */
+static int
+partitionBatches(storageBatch_t **batches, int nBatches) {
+    storageBatch_t *autocommit[nBatches];
+    int i, nGrouped = 0, nAutocommit = 0;
+
+    for (i = 0; i < nBatches; i++) {
+        if (batches[i]->autocommit) {
+            autocommit[nAutocommit++] = batches[i];
+        } else {
+            batches[nGrouped++] = batches[i];
+        }
+    }
+    memcpy(batches + nGrouped, autocommit, nAutocommit * sizeof(storageBatch_t *));
+    return nGrouped;
+}
+
+/*
+ * Add a batch to the submission queue, the caller holds writerMutex.
+ */
+static void
+enqueue(storageBatch_t *batch) {
+    batch->batchNext = NULL;
+    if (Writer.batchHead == NULL) {
+        Writer.batchHead = batch;
+        clock_gettime(CLOCK_REALTIME, &Writer.firstQueued);
+    } else {
+        Writer.batchTail->batchNext = batch;
+    }
+    Writer.batchTail = batch;
+    Writer.nQueued += batch->nQueries;
+}
+
+/*
+ * Queue the held batches whose durable predecessors have all been
+ * consumed from the spool, they were held in submission order.
+ */
+static void
+releaseHeld(void) {
+    storageBatch_t *batch;
+
+    pthread_mutex_lock(&Writer.writerMutex);
+    while ((batch = Writer.heldHead) != NULL && spoolConsumed(Writer.spool, batch->spoolMark)) {
+        if ((Writer.heldHead = batch->batchNext) == NULL) {
+            Writer.heldTail = NULL;
+        }
+        enqueue(batch);
+    }
+    pthread_mutex_unlock(&Writer.writerMutex);
+}
+
+static void
+replayLater(void) {
+    clock_gettime(CLOCK_REALTIME, &Writer.replayAt);
+    Writer.replayAt.tv_sec += STORAGE_RETRY_MS / 1000;
+}
+
+/*
+ * Keep a spooled record that can never be written in the dead letter
+ * spool, or log it as dropped if that is not possible either.
+ */
+static int
+deadLetter(const void *data, uint32_t len, void *arg) {
+    const char *reason = (const char *) arg;
+
+    if (Writer.dead == NULL && Writer.deadPath != NULL &&
+        (Writer.dead = spoolOpen(Writer.deadPath, 0, SPOOL_FSYNC_ALWAYS, 0)) == NULL) {
+        logError("Could not open the dead letter spool %s: %d", Writer.deadPath, errno)
+    }
+    if (Writer.dead == NULL || spoolAppend(Writer.dead, data, len) == -1) {
+        logCrit("Dropped a spooled batch that %s.", reason)
+    } else {
+        logError("Moved a spooled batch that %s to %s.", reason, Writer.deadPath)
+    }
+    return 0;
+}
+
+/*
+ * Move the oldest spooled record out of the way.
+ */
+static void
+skipRecord(const char *reason) {
+    uint64_t next;
+
+    if (spoolRead(Writer.spool, 1, deadLetter, (void *) reason, &next) == 1) {
+        spoolConsume(Writer.spool, next);
+        releaseHeld();
+    }
+}
+
+/*
+ * A replayed slice of the spool is only consumed once it commits. If the
+ * connection failed it is retried as it is after a while. If Postgres
+ * rejected a statement, the batches in the slice are replayed one at a
+ * time to find the rejected one, which is then moved out of the spool.
+ */
+static void
+replayDone(const char *name, int status, void *arg) {
+    replay_t *replay = (replay_t *) arg;
+
+    (void) name;
+    if (status != -1 && Writer.replayIsolate > 0) {
+        Writer.replayIsolate--;
+    }
+    if (status == 0) {
+        spoolConsume(Writer.spool, replay->next);
+        releaseHeld();
+    } else if (status == 1 && replay->count > 1) {
+        logWarn("Postgres rejected a replayed slice of %d spooled batches, replaying them one at a time.",
+                replay->count)
+        Writer.replayIsolate = replay->count;
+    } else if (status == 1) {
+        skipRecord("Postgres rejected");
+    } else {
+        logError("Could not replay the spool, retrying in %d ms.", STORAGE_RETRY_MS)
+        replayLater();
+    }
+    free(replay);
+}
+
+/*
+ * Gather the oldest spooled batches into one batch. Returns NULL if
+ * there was nothing to replay.
+ */
+static storageBatch_t *
+replayBatch(void) {
+    replay_t *replay;
+
+    if ((replay = calloc(1, sizeof(*replay))) == NULL) {
+        replayLater();
+        return NULL;
+    }
+    do {
+        if (replay->batch == NULL && (replay->batch = storageBatchCreate("spool")) == NULL) {
+            free(replay);
+            replayLater();
+            return NULL;
+        }
+        replay->corrupt = 0;
+        replay->count = spoolRead(Writer.spool, Writer.replayIsolate > 0 ? 1 : STORAGE_REPLAY_BATCHES,
+                                  decodeBatch, replay, &replay->next);
+        /* A corrupt record at the head would otherwise stop every replay. */
+        if (replay->count == 0 && replay->corrupt) {
+            skipRecord("is corrupt");
+        }
+    } while (replay->count == 0 && replay->corrupt);
+    if (replay->count == 0) {
+        storageBatchFree(replay->batch);
+        free(replay);
+        /* Out of memory, the spool still has records. */
+        if (spoolPending(Writer.spool) > 0) {
+            replayLater();
+        }
+        return NULL;
+    }
+    logDebug("Replaying %d spooled batches.", replay->count)
+    replay->batch->done = replayDone;
+    replay->batch->doneArg = replay;
+    return replay->batch;
+}
+
+static int
+replayDue(void) {
+    struct timespec now;
+
+    if (Writer.spool == NULL || spoolPending(Writer.spool) == 0) {
+        return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > Writer.replayAt.tv_sec ||
+           (now.tv_sec == Writer.replayAt.tv_sec && now.tv_nsec >= Writer.replayAt.tv_nsec);
+}
+
+static void *
+writerThread(void *arg) {
+    /* Allocated by storageStart() so a failure is reported there. */
+    storageBatch_t **batches = (storageBatch_t **) arg, **grown, *batch, *held;
+    struct timespec deadline;
+    int i, nBatches, nGrouped, capacity = STORAGE_INITIAL_BATCHES, replay, syncing, waiting;
+
+    pthread_mutex_lock(&Writer.writerMutex);
+    for (;;) {
+        while (Writer.batchHead == NULL && !replayDue() && !(Writer.writerFlags & STORAGE_EXIT)) {
+            /* Spooled records are synced here once their interval is up, even if nothing follows them. */
+            pthread_mutex_unlock(&Writer.writerMutex);
+            syncing = Writer.spool != NULL && spoolFlush(Writer.spool, &deadline);
+            pthread_mutex_lock(&Writer.writerMutex);
+            if (Writer.batchHead != NULL || replayDue() || (Writer.writerFlags & STORAGE_EXIT)) {
+                break;
+            }
+            /* Waiting out a failed replay. */
+            waiting = Writer.spool != NULL && spoolPending(Writer.spool) > 0;
+            if (waiting && (!syncing || Writer.replayAt.tv_sec < deadline.tv_sec ||
+                            (Writer.replayAt.tv_sec == deadline.tv_sec && Writer.replayAt.tv_nsec < deadline.tv_nsec))) {
+                deadline = Writer.replayAt;
+            }
+            if (syncing || waiting) {
+                pthread_cond_timedwait(&Writer.writerWorkcv, &Writer.writerMutex, &deadline);
+            } else {
+                pthread_cond_wait(&Writer.writerWorkcv, &Writer.writerMutex);
+            }
+        }
+        /* Hold the oldest batch for the flush interval so others can join its transaction. */
+        if (Writer.batchHead != NULL) {
+            deadline = Writer.firstQueued;
+            deadline.tv_nsec += (long) (Writer.flushMs % 1000) * 1000000;
+            deadline.tv_sec += Writer.flushMs / 1000 + deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (Writer.nQueued < Writer.flushStatements && !(Writer.writerFlags & STORAGE_EXIT) &&
+                   pthread_cond_timedwait(&Writer.writerWorkcv, &Writer.writerMutex, &deadline) != ETIMEDOUT);
+        }
+        /* Take everything that has been submitted, the spool goes first as it is older. */
+        nBatches = 0;
+        replay = replayDue();
+        if (replay) {
+            nBatches++;
+        }
+        while ((batch = Writer.batchHead) != NULL) {
+            if (nBatches == capacity) {
+                if ((grown = realloc(batches, capacity * 2 * sizeof(storageBatch_t *))) == NULL) {
+                    /* Leave the rest queued for the next pass. */
+                    Writer.batchHead = batch;
+                    break;
+                }
+                batches = grown;
+                capacity *= 2;
+            }
+            Writer.batchHead = batch->batchNext;
+            batches[nBatches++] = batch;
+        }
+        if (Writer.batchHead == NULL) {
+            Writer.batchTail = NULL;
+        }
+        Writer.nQueued = 0;
+        for (batch = Writer.batchHead; batch != NULL; batch = batch->batchNext) {
+            Writer.nQueued += batch->nQueries;
+        }
+        if (nBatches == 0) {
+            /* Asked to exit, anything left in the spool waits for the next start. */
+            break;
+        }
+        pthread_mutex_unlock(&Writer.writerMutex);
+        if (replay && (batches[0] = replayBatch()) == NULL) {
+            memmove(batches, batches + 1, --nBatches * sizeof(storageBatch_t *));
+        }
+        if (nBatches > 0) {
+            nGrouped = partitionBatches(batches, nBatches);
+            if (nGrouped > 0) {
+                writeGroup(batches, nGrouped);
+            }
+            for (i = nGrouped; i < nBatches; i++) {
+                writeAutocommit(batches[i]);
+            }
+        }
+        pthread_mutex_lock(&Writer.writerMutex);
+    }
+    /* Held batches are not spooled, only what they were waiting on survives a restart. */
+    held = Writer.heldHead;
+    Writer.heldHead = NULL;
+    Writer.heldTail = NULL;
+    pthread_mutex_unlock(&Writer.writerMutex);
+    while ((batch = held) != NULL) {
+        held = batch->batchNext;
+        logWarn("Dropped %s batch waiting on the spool.", batch->name)
+        finishBatch(batch, -1);
+    }
+    free(batches);
+    if (Writer.conn) {
+        PQfinish(Writer.conn);
+        Writer.conn = NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Open the spool as configured by the environment. Without it durable
+ * batches are written straight from memory.
+ */
+static void
+openSpool(void) {
+    char *path, *env;
+    spoolFsync_t policy = SPOOL_FSYNC_INTERVAL;
+    unsigned int intervalMs = 1000;
+    size_t size = SPOOL_DEFAULT_SIZE;
+
+    if ((path = getenv(SPOOL_PATH_ENV)) == NULL) {
+        path = SPOOL_DEFAULT_PATH;
+    }
+    if ((env = getenv(SPOOL_SIZE_ENV)) != NULL) {
+        size = strtoul(env, NULL, 10);
+    }
+    if ((env = getenv(SPOOL_FSYNC_MS_ENV)) != NULL) {
+        intervalMs = strtoul(env, NULL, 10);
+    }
+    if ((env = getenv(SPOOL_FSYNC_ENV)) != NULL) {
+        if (strcmp(env, "none") == 0) {
+            policy = SPOOL_FSYNC_NONE;
+        } else if (strcmp(env, "always") == 0) {
+            policy = SPOOL_FSYNC_ALWAYS;
+        } else if (strcmp(env, "interval") != 0) {
+            logWarn("Unknown %s %s, using interval.", SPOOL_FSYNC_ENV, env)
+        }
+    }
+    if ((Writer.spool = spoolOpen(path, size, policy, intervalMs)) == NULL) {
+        logError("Could not open the spool %s: %d", path, errno)
+        return;
+    }
+    /* Without it rejected batches are only logged. */
+    if ((Writer.deadPath = malloc(strlen(path) + sizeof(SPOOL_DEAD_SUFFIX))) != NULL) {
+        strcpy(Writer.deadPath, path);
+        strcat(Writer.deadPath, SPOOL_DEAD_SUFFIX);
+    }
+}
+
+int
+storageStart(void) {
+    storageBatch_t **batches;
+    char *env;
+    int error = 0;
+
+    pthread_mutex_lock(&Writer.writerMutex);
+    if (!(Writer.writerFlags & STORAGE_RUNNING)) {
+        if ((batches = malloc(STORAGE_INITIAL_BATCHES * sizeof(storageBatch_t *))) == NULL) {
+            pthread_mutex_unlock(&Writer.writerMutex);
+            errno = ENOMEM;
+            return -1;
+        }
+        Writer.writerFlags = STORAGE_RUNNING;
+        Writer.flushMs = (env = getenv(FLUSH_MS_ENV)) ? strtoul(env, NULL, 10) : FLUSH_DEFAULT_MS;
+        Writer.flushStatements = (env = getenv(FLUSH_STATEMENTS_ENV)) ? (int) strtol(env, NULL, 10)
+                                                                       : FLUSH_DEFAULT_STATEMENTS;
+        openSpool();
+        if ((error = pthread_create(&Writer.writerTid, NULL, writerThread, batches)) != 0) {
+            Writer.writerFlags = 0;
+            free(batches);
+        }
+    }
+    pthread_mutex_unlock(&Writer.writerMutex);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int
+storageSubmitDurable(storageBatch_t *batch) {
+    encoder_t enc = {NULL, 0, 0, 0};
+    int result;
+
+    pthread_mutex_lock(&Writer.writerMutex);
+    if (Writer.spool == NULL || (Writer.writerFlags & STORAGE_EXIT) || batch->autocommit) {
+        pthread_mutex_unlock(&Writer.writerMutex);
+        return storageSubmit(batch, NULL, NULL);
+    }
+    pthread_mutex_unlock(&Writer.writerMutex);
+
+    /* Encoding and appending happen on the caller, the spool has its own lock. */
+    encodeBatch(&enc, batch);
+    if (enc.failed) {
+        logError("Could not encode %s batch for the spool, writing it from memory.", batch->name)
+        free(enc.data);
+        return storageSubmit(batch, NULL, NULL);
+    }
+    if ((result = spoolAppend(Writer.spool, enc.data, (uint32_t) enc.size)) == -1) {
+        logError("Could not spool %s batch: %d", batch->name, errno)
+        free(enc.data);
+        return storageSubmit(batch, NULL, NULL);
+    }
+    free(enc.data);
+    storageBatchFree(batch);
+
+    pthread_mutex_lock(&Writer.writerMutex);
+    pthread_cond_signal(&Writer.writerWorkcv);
+    pthread_mutex_unlock(&Writer.writerMutex);
+    return 0;
+}
+
+int
+storageSubmit(storageBatch_t *batch, storageDoneFunc done, void *arg) {
+    batch->done = done;
+    batch->doneArg = arg;
+    batch->batchNext = NULL;
+
+    pthread_mutex_lock(&Writer.writerMutex);
+    if (!(Writer.writerFlags & STORAGE_RUNNING) || (Writer.writerFlags & STORAGE_EXIT)) {
+        pthread_mutex_unlock(&Writer.writerMutex);
+        logError("Storage is not running, dropped %s batch.", batch->name)
+        /* The submitter's context is released through done as usual. */
+        if (done) {
+            done(batch->name, -1, arg);
+        }
+        storageBatchFree(batch);
+        return -1;
+    }
+    /* Checked under writerMutex so a release on the storage thread cannot be missed. */
+    if (batch->afterDurable && Writer.spool != NULL) {
+        batch->spoolMark = spoolTail(Writer.spool);
+        if (Writer.heldHead != NULL || !spoolConsumed(Writer.spool, batch->spoolMark)) {
+            if (Writer.heldHead == NULL) {
+                Writer.heldHead = batch;
+            } else {
+                Writer.heldTail->batchNext = batch;
+            }
+            Writer.heldTail = batch;
+            pthread_mutex_unlock(&Writer.writerMutex);
+            return 0;
+        }
+    }
+    enqueue(batch);
+    pthread_cond_signal(&Writer.writerWorkcv);
+    pthread_mutex_unlock(&Writer.writerMutex);
+    return 0;
+}
+
+void
+storageStop(void) {
+    pthread_mutex_lock(&Writer.writerMutex);
+    if (!(Writer.writerFlags & STORAGE_RUNNING)) {
+        pthread_mutex_unlock(&Writer.writerMutex);
+        return;
+    }
+    Writer.writerFlags |= STORAGE_EXIT;
+    pthread_cond_signal(&Writer.writerWorkcv);
+    pthread_mutex_unlock(&Writer.writerMutex);
+
+    pthread_join(Writer.writerTid, NULL);
+    if (Writer.spool) {
+        spoolClose(Writer.spool);
+        Writer.spool = NULL;
+    }
+    if (Writer.dead) {
+        spoolClose(Writer.dead);
+        Writer.dead = NULL;
+    }
+    free(Writer.deadPath);
+    Writer.deadPath = NULL;
+    Writer.writerFlags = 0;
+}
@@ -0,0 +1,132 @@
+//
+// Created by Matthew Johnson on 18/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_STORAGE_H
+#define INVEST_FETCH_C_STORAGE_H
+
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../helpers/postgres.h"
+#include "../logging/logger.h"
+
+/*
+ * The storageBatch_t type is opaque to the client.
+ * A batch is a list of parameterised statements that are
+ * executed in order and committed together. Batches submitted close
+ * together share a transaction, a failing batch is retried alone so
+ * it does not take the others with it.
+ */
+typedef struct storageBatch storageBatch_t;
+
+/*
+ * Called on the storage thread with the result of a statement once
+ * its transaction has committed. The result is cleared afterwards.
+ */
+typedef void (*storageResultFunc)(const PGresult *res, void *arg);
+
+/*
+ * Called on the storage thread once a batch has been committed
+ * (status 0), Postgres rejected one of its statements (status 1) or
+ * the connection failed (status -1). If storage is not running it is
+ * called by storageSubmit() instead, with status -1.
+ */
+typedef void (*storageDoneFunc)(const char *name, int status, void *arg);
+
+/*
+ * Create an empty batch. The name is only used for reporting.
+ */
+storageBatch_t *storageBatchCreate(const char *name);
+
+/*
+ * Append a statement to the batch. The parameters are copied so the
+ * caller's buffers can be released as soon as this returns. Binary
+ * parameters must have their length supplied. onResult can be NULL.
+ * On error, storageBatchAdd() returns -1 with errno set to the error code.
+ */
+int storageBatchAdd(storageBatch_t *batch, const char *command, int nParams, const char *const *values,
+                    const int *lengths, const int *formats, storageResultFunc onResult, void *resultArg);
+
+/*
+ * Name the statement last added to the batch, e.g. after the row it
+ * writes, so a failure report says which one it was. The label is
+ * copied. Labels are not kept for batches replayed from the spool.
+ * On error, storageBatchLabel() returns -1 with errno set to the error code.
+ */
+int storageBatchLabel(storageBatch_t *batch, const char *label);
+
+/*
+ * Run the batch's statements one at a time outside of any transaction,
+ * for commands such as CALL refresh_continuous_aggregate() that refuse to
+ * run inside one. Such batches are never grouped with others, they are
+ * written after the transaction they were taken with has finished. The
+ * first failing statement fails the batch, earlier ones stay committed.
+ */
+void storageBatchAutocommit(storageBatch_t *batch);
+
+/*
+ * Hold the batch back until every durable batch submitted before it has
+ * been written (or moved to the dead letter spool), e.g. to refresh what
+ * they feed. Held batches are dropped if the storage thread stops first.
+ */
+void storageBatchAfterDurable(storageBatch_t *batch);
+
+/*
+ * Number of statements in the batch.
+ */
+int storageBatchCount(storageBatch_t *batch);
+
+/*
+ * Release a batch that was never submitted.
+ */
+void storageBatchFree(storageBatch_t *batch);
+
+/*
+ * Start the storage thread and open the spool. Must be called before
+ * storageSubmit(). Configured through the environment:
+ *  INVEST_STORAGE_FLUSH_MS:            longest a batch waits for others
+ *                                      to share its transaction (250).
+ *  INVEST_STORAGE_FLUSH_STATEMENTS:    commit early once this many
+ *                                      statements are queued (10000).
+ *  INVEST_SPOOL_PATH:      spool file (default invest_fetch.spool).
+ *  INVEST_SPOOL_SIZE:      initial size in bytes, it grows when full.
+ *  INVEST_SPOOL_FSYNC:     none, interval (default) or always.
+ *  INVEST_SPOOL_FSYNC_MS:  interval between syncs (default 1000).
+ */
+int storageStart(void);
+
+/*
+ * Hand a batch to the storage thread and return immediately. The
+ * storage thread takes ownership of the batch and calls done (can be
+ * NULL) once it has been written.
+ * On error, storageSubmit() returns -1, done is called with status -1
+ * and the batch is freed.
+ */
+int storageSubmit(storageBatch_t *batch, storageDoneFunc done, void *arg);
+
+/*
+ * Hand a batch to the storage thread through the on-disk spool. The
+ * batch is not lost if Postgres is down or the process dies before it
+ * has been written, it is replayed (possibly more than once) until it
+ * commits. A batch Postgres rejects, or one that was corrupted in the
+ * spool, is moved to <spool>.dead instead of being retried forever.
+ * Result callbacks are not supported for durable batches.
+ * Without a spool, or for an autocommit batch, this behaves like
+ * storageSubmit().
+ * On error, storageSubmitDurable() returns -1 and the batch is freed.
+ */
+int storageSubmitDurable(storageBatch_t *batch);
+
+/*
+ * Write out everything already submitted and stop the storage thread.
+ */
+void storageStop(void);
+
+#endif //INVEST_FETCH_C_STORAGE_H
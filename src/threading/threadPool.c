@@ -3,24 +3,115 @@
 // Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
 //
 
+/* For cpu_set_t and the affinity calls. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+
 #include "threadPool.h"
 
+/* Jobs a worker's deque holds before spilling into the injection queue. */
+#define POOL_DEQUE_SIZE 256
+#define POOL_DEQUE_MASK (POOL_DEQUE_SIZE - 1)
+/* Most injected jobs a worker moves to its deque at a time. */
+#define POOL_TAKE_JOBS 32
+/* Jobs allocated at a time, they are recycled until the pool is destroyed. */
+#define POOL_SLAB_JOBS 64
+/* Slabs in each chunk of a pool's slab directory, and chunks in the directory. */
+#define POOL_DIR_SLABS 1024
+#define POOL_DIR_CHUNKS 1024
+/* Free jobs a worker keeps to itself before handing half back. */
+#define POOL_CACHE_JOBS 64
+/* Below this share of time busy the controller considers shrinking. */
+#define POOL_TUNE_LOW_UTIL 0.5
+/* Where the kernel describes the NUMA nodes. */
+#define POOL_NODE_PATH "/sys/devices/system/node"
+/* How often a worker waiting on a future looks for jobs to help with. */
+#define POOL_HELP_POLL_NS 1000000L
+
+/*
+ * Queued job
+ */
+/*
+ * A kind of job, named or keyed by its function. Jobs queued are counted
+ * here, the rest is counted by the workers in their own typeCounts_t.
+ */
+typedef struct jobType {
+    atomic_int typeUsed;                /* set once the key below is */
+    void *(*typeFunc)(void *);          /* the key of unnamed jobs */
+    char typeName[THR_STATS_NAME];      /* the key of named jobs */
+    atomic_ulong typeQueued;
+} jobType_t;
+
 /*
- * FIFO queued job
+ * One worker's counts for a kind of job. Only the worker writes them and
+ * readers add up every worker's, so no locked instruction is needed.
  */
+typedef struct typeCounts {
+    atomic_ulong countStarted;
+    atomic_ulong countFinished;
+    atomic_llong countWaitNs;           /* total time spent queued */
+    atomic_llong countRunNs;            /* total time spent running */
+    atomic_llong countMaxWaitNs;
+    atomic_llong countMaxRunNs;
+    atomic_ulong countWaitHistogram[THR_STATS_BUCKETS];
+    atomic_ulong countRunHistogram[THR_STATS_BUCKETS];
+} typeCounts_t;
+
 typedef struct job {
-    struct job *jobNext;        /* linked list of jobs */
+    struct job *jobNext;        /* linked list of injected or cached free jobs */
+    _Atomic uint32_t jobFreeNext;   /* index of the next shared free job, 0 if none */
+    uint32_t jobIndex;          /* its own index, see jobAt() */
     void *(*jobFunc)(void *);    /* function to call */
     void *jobArg;        /* its argument */
+    void (*jobDone)(void *);    /* called once the job has finished */
+    void *jobDoneArg;    /* its argument */
+    int64_t jobQueuedNs;    /* when it was queued */
+    jobType_t *jobType;     /* where it is counted */
 } job_t;
 
 /*
- * List of active worker threads, linked through their stacks.
+ * A block of jobs, never freed before the pool.
  */
-typedef struct active {
-    struct active *activeNext;    /* linked list of threads */
-    pthread_t activeTid;    /* active thread id */
-} active_t;
+typedef struct jobSlab {
+    job_t slabJobs[POOL_SLAB_JOBS];
+} jobSlab_t;
+
+/*
+ * A worker's Chase-Lev deque. The owner pushes and pops at the bottom,
+ * other workers steal from the top, neither takes a lock.
+ */
+typedef struct deque {
+    _Atomic int64_t dequeTop;       /* next job to steal */
+    _Atomic int64_t dequeBottom;    /* next free slot */
+    _Atomic(job_t *) dequeRing[POOL_DEQUE_SIZE];
+} deque_t;
+
+/*
+ * A worker slot, one per possible worker thread.
+ */
+typedef struct worker {
+    deque_t workerDeque;        /* jobs queued by this worker */
+    threadPool_t *workerPool;   /* the pool it belongs to */
+    pthread_t workerTid;        /* thread using the slot */
+    int workerInUse;            /* claimed by a thread, under poolMutex */
+    atomic_int workerBusy;      /* running a job */
+    int workerRetired;          /* left poolNthreads before exiting */
+    int workerDepth;            /* jobs it is running, more than one while helping */
+    int64_t workerStartedNs;    /* when its current job started */
+    int64_t workerRunNs;        /* when its current job first started */
+    int64_t workerDoneNs;       /* when its last job finished, 0 once it has waited */
+    jobType_t *workerType;      /* the kind of its current job */
+    void (*workerDone)(void *); /* its completion callback */
+    void *workerDoneArg;        /* and the callback's argument */
+    job_t *workerFree;          /* free jobs only this worker uses */
+    int workerNFree;            /* jobs in workerFree */
+    atomic_ulong workerStarted; /* jobs it started with their wait timed, for the controller */
+    atomic_llong workerWaitNs;  /* time they spent queued */
+    atomic_llong workerBusyNs;  /* time it spent running jobs */
+    typeCounts_t workerCounts[THR_STATS_TYPES];     /* by the index of the jobType */
+} worker_t;
 
 /*
  * The thread pool, opaque to the clients.
@@ -29,24 +120,83 @@ struct threadPool {
     threadPool_t *poolForw;     /* circular linked list */
     threadPool_t *poolBack;     /* of all thread pools */
     pthread_mutex_t poolMutex;  /* protects the pool data */
-    pthread_cond_t poolBusycv;  /* synchronization in pool_queue */
-    pthread_cond_t poolWorkcv;  /* synchronization with workers */
+    pthread_cond_t poolBusycv;  /* synchronization in pool_destroy() */
+    pthread_cond_t poolTunecv;  /* wakes the controller and dumper to exit */
+    pthread_cond_t poolWorkcv;  /* parked workers */
     pthread_cond_t poolWaitcv;  /* synchronization in pool_wait() */
-    active_t *poolActive;       /* list of threads performing work */
-    job_t *poolHead;            /* head of FIFO job queue */
-    job_t *poolTail;            /* tail of FIFO job queue */
+    worker_t *poolWorkers;      /* poolMaximum worker slots */
+    _Atomic(job_t *) poolInject;    /* injected jobs, newest first, pushed without a lock */
+    pthread_mutex_t poolTakeMutex;  /* held by a worker taking injected jobs */
+    job_t *poolHead;            /* injected jobs in FIFO order, under poolTakeMutex */
+    _Atomic uint64_t poolFree;  /* shared free jobs, a tag above the first index */
+    jobSlab_t **poolSlabDir[POOL_DIR_CHUNKS];   /* every slab, by index */
+    int poolNSlabs;             /* slabs in poolSlabDir, under poolMutex */
+    atomic_int poolInjected;    /* jobs in the injection queue */
+    atomic_long poolPending;    /* jobs queued or running */
+    atomic_int poolWaiters;     /* threads in thrPoolWait() */
     pthread_attr_t poolAttr;    /* attributes of the workers */
-    unsigned int poolFlags;     /* see below */
+    atomic_uint poolFlags;      /* see below */
     unsigned int poolLinger;    /* seconds before idle workers exit */
     int poolMinimum;            /* minimum number of worker threads */
     int poolMaximum;            /* maximum number of worker threads */
-    int poolNthreads;           /* current number of worker threads */
-    int poolIdle;               /* number of idle workers */
+    atomic_int poolLimit;       /* workers allowed now, see thrPoolAutoscale() */
+    atomic_int poolNthreads;    /* current number of worker threads */
+    int poolSlots;              /* worker slots still held by a thread */
+    pthread_t poolTuner;        /* the controller, if started */
+    int poolTuning;             /* poolTuner is running */
+    unsigned int tuneIntervalMs;/* between controller decisions */
+    int64_t tuneTargetNs;       /* queue wait the controller aims below */
+    int64_t tuneAtNs;           /* counters at the last decision */
+    long long tuneStarted;
+    long long tuneWaitNs;
+    long long tuneBusyNs;
+    thrPoolScale_t tuneStats;   /* the controller's decisions */
+    atomic_int poolIdle;        /* number of parked workers not yet signalled */
+    int poolWakeups;            /* signalled and yet to look for work, under poolMutex */
+    cpu_set_t *poolPlaces;      /* CPUs of each worker slot, NULL if unplaced */
+    int poolPeak;               /* most workers at once */
+    atomic_ulong poolCreated;   /* workers started */
+    atomic_ulong poolRetired;   /* workers that left idle */
+    pthread_t poolDumper;       /* logs the statistics, if started */
+    int poolDumping;            /* poolDumper is running */
+    unsigned int dumpIntervalMs;/* between dumps */
+    jobType_t poolTypes[THR_STATS_TYPES];   /* the last counts whatever doesn't fit */
 };
 
 /* poolFlags */
-#define    POOL_WAIT    0x01u        /* waiting in thrPoolWait() */
-#define    POOL_DESTROY    0x02u        /* pool is being destroyed */
+#define    POOL_DESTROY    0x01u        /* pool is being destroyed */
+#define    POOL_TIMED      0x02u        /* jobs are timed, see jobClock() */
+
+/*
+ * A continuation waiting for a future.
+ */
+typedef struct thrContinuation {
+    struct thrContinuation *thenNext;   /* in the order they were added */
+    thrFutureFunc thenFunc;
+    void *thenArg;
+} thrContinuation_t;
+
+/*
+ * A job's eventual result, opaque to the clients.
+ */
+struct thrFuture {
+    pthread_mutex_t futureMutex;    /* protects everything below */
+    pthread_cond_t futureCond;      /* broadcast once it completes */
+    threadPool_t *futurePool;       /* the pool running it */
+    void *(*futureFunc)(void *);    /* the job */
+    void *futureArg;                /* its argument */
+    void *futureResult;             /* what the job returned */
+    int futureReturned;             /* the job returned rather than exiting */
+    int futureState;                /* see below */
+    int futureRefs;                 /* the submitter and the job */
+    thrContinuation_t *futureThen;  /* run once it completes */
+    thrContinuation_t **futureTail;
+};
+
+/* futureState */
+#define    FUTURE_PENDING      0
+#define    FUTURE_DONE         1
+#define    FUTURE_CANCELLED    2
 
 /* the list of all created and not yet destroyed thread pools */
 static threadPool_t *thrPools = NULL;
@@ -57,18 +207,440 @@ static pthread_mutex_t thrPoolLock = PTHREAD_MUTEX_INITIALIZER;
 /* set of all signals */
 static sigset_t signalSet;
 
+/* the slot of the pool worker running on this thread, if any */
+static _Thread_local worker_t *currentWorker = NULL;
+
 static void *workerThread(void *);
 
+static inline int64_t
+monotonicNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * The time for a job's statistics, or 0 until they are first asked for,
+ * so a pool nobody watches doesn't read the clock twice for every job.
+ */
+static inline int64_t
+jobClock(threadPool_t *pool) {
+    return atomic_load_explicit(&pool->poolFlags, memory_order_relaxed) & POOL_TIMED ? monotonicNs() : 0;
+}
+
+/*
+ * Counters with a single writer, a relaxed load and store will do.
+ */
+static inline void
+countAdd(atomic_ulong *count, unsigned long n) {
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void
+timeAdd(atomic_llong *total, long long ns) {
+    atomic_store_explicit(total, atomic_load_explicit(total, memory_order_relaxed) + ns, memory_order_relaxed);
+}
+
+static inline void
+timeMax(atomic_llong *max, long long ns) {
+    if (ns > atomic_load_explicit(max, memory_order_relaxed))
+        atomic_store_explicit(max, ns, memory_order_relaxed);
+}
+
+static inline void
+recordHistogram(atomic_ulong *histogram, int64_t ns) {
+    int64_t us = ns / 1000;
+    int b = us > 0 ? 64 - __builtin_clzll((unsigned long long) us) : 0;
+
+    countAdd(&histogram[b < THR_STATS_BUCKETS - 1 ? b : THR_STATS_BUCKETS - 1], 1);
+}
+
+/*
+ * Find the counters for a kind of job, claiming a slot the first time it
+ * is seen. Slots are never released, kinds beyond THR_STATS_TYPES - 1 are
+ * counted together in the last. The caller must not hold poolMutex.
+ */
+static jobType_t *
+jobType(threadPool_t *pool, void *(*func)(void *), const char *name) {
+    unsigned int hash = 2166136261u, n;
+    const char *c;
+    jobType_t *type;
+
+    if (name != NULL && *name == '\0')
+        name = NULL;
+    if (name != NULL) {
+        for (c = name; *c != '\0'; c++)
+            hash = (hash ^ (unsigned char) *c) * 16777619u;
+    } else {
+        hash = (unsigned int) ((uintptr_t) func >> 4);
+    }
+    for (n = 0; n < THR_STATS_TYPES - 1; n++) {
+        type = &pool->poolTypes[(hash + n) % (THR_STATS_TYPES - 1)];
+        if (!atomic_load_explicit(&type->typeUsed, memory_order_acquire)) {
+            pthread_mutex_lock(&pool->poolMutex);
+            if (!atomic_load_explicit(&type->typeUsed, memory_order_relaxed)) {
+                type->typeFunc = func;
+                if (name != NULL)
+                    snprintf(type->typeName, sizeof(type->typeName), "%s", name);
+                atomic_store_explicit(&type->typeUsed, 1, memory_order_release);
+                pthread_mutex_unlock(&pool->poolMutex);
+                return type;
+            }
+            pthread_mutex_unlock(&pool->poolMutex);
+        }
+        if (name != NULL ? strncmp(type->typeName, name, sizeof(type->typeName) - 1) == 0
+                         : type->typeName[0] == '\0' && type->typeFunc == func)
+            return type;
+    }
+    return &pool->poolTypes[THR_STATS_TYPES - 1];
+}
+
+/*
+ * Push onto the bottom of the owner's deque.
+ * Returns -1 if it is full.
+ */
+static int
+dequePush(deque_t *deque, job_t *job) {
+    int64_t bottom = atomic_load_explicit(&deque->dequeBottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->dequeTop, memory_order_acquire);
+
+    if (bottom - top >= POOL_DEQUE_SIZE)
+        return -1;
+    atomic_store_explicit(&deque->dequeRing[bottom & POOL_DEQUE_MASK], job, memory_order_release);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->dequeBottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Pop the newest job off the owner's deque, racing thieves for the last one.
+ */
+static job_t *
+dequePop(deque_t *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->dequeBottom, memory_order_relaxed) - 1;
+    int64_t top;
+    job_t *job = NULL;
+
+    /* A stale top is only ever behind, so an empty deque skips the fence. */
+    if (bottom < atomic_load_explicit(&deque->dequeTop, memory_order_relaxed))
+        return NULL;
+    atomic_store_explicit(&deque->dequeBottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->dequeTop, memory_order_relaxed);
+    if (top <= bottom) {
+        job = atomic_load_explicit(&deque->dequeRing[bottom & POOL_DEQUE_MASK], memory_order_acquire);
+        if (top != bottom)
+            return job;
+        if (!atomic_compare_exchange_strong_explicit(&deque->dequeTop, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            job = NULL;
+    }
+    atomic_store_explicit(&deque->dequeBottom, bottom + 1, memory_order_relaxed);
+    return job;
+}
+
+/*
+ * Take the oldest job from another worker's deque, trying again if
+ * another thief or the owner got there first.
+ */
+static job_t *
+dequeSteal(deque_t *deque) {
+    int64_t top, bottom;
+    job_t *job;
+
+    for (;;) {
+        top = atomic_load_explicit(&deque->dequeTop, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        bottom = atomic_load_explicit(&deque->dequeBottom, memory_order_acquire);
+        if (top >= bottom)
+            return NULL;
+        job = atomic_load_explicit(&deque->dequeRing[top & POOL_DEQUE_MASK], memory_order_acquire);
+        if (atomic_compare_exchange_strong_explicit(&deque->dequeTop, &top, top + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed))
+            return job;
+    }
+}
+
+/*
+ * Add to the injection queue without a lock. Jobs are pushed onto a
+ * stack that a worker taking them reverses into FIFO order.
+ */
+static void
+injectJob(threadPool_t *pool, job_t *job) {
+    job_t *head = atomic_load_explicit(&pool->poolInject, memory_order_relaxed);
+
+    atomic_fetch_add(&pool->poolInjected, 1);
+    do {
+        job->jobNext = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->poolInject, &head, job, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/*
+ * The oldest injected job, moving everything pushed so far into FIFO
+ * order once the previous lot is used up. The caller holds poolTakeMutex.
+ */
+static job_t *
+injectedHead(threadPool_t *pool) {
+    job_t *job, *next;
+
+    if (pool->poolHead == NULL) {
+        job = atomic_exchange_explicit(&pool->poolInject, NULL, memory_order_acquire);
+        for (; job != NULL; job = next) {
+            next = job->jobNext;
+            job->jobNext = pool->poolHead;
+            pool->poolHead = job;
+        }
+    }
+    return pool->poolHead;
+}
+
+/*
+ * Take the oldest injected job. Workers take turns under poolTakeMutex,
+ * the threads injecting never wait for it. A worker (self, NULL for
+ * thrPoolDestroy()) also moves its share of those still queued, up to
+ * POOL_TAKE_JOBS, to its empty deque where the others can steal them.
+ * They are pushed newest first so it runs them oldest first.
+ */
+static job_t *
+takeInjected(threadPool_t *pool, worker_t *self) {
+    job_t *job, *batch[POOL_TAKE_JOBS];
+    int n = 0, share;
+
+    pthread_mutex_lock(&pool->poolTakeMutex);
+    if ((job = injectedHead(pool)) != NULL) {
+        pool->poolHead = job->jobNext;
+        share = self != NULL ? atomic_load(&pool->poolInjected) / (atomic_load(&pool->poolNthreads) + 1) : 0;
+        while (n < share && n < POOL_TAKE_JOBS && pool->poolHead != NULL) {
+            batch[n++] = pool->poolHead;
+            pool->poolHead = pool->poolHead->jobNext;
+        }
+        atomic_fetch_sub(&pool->poolInjected, n + 1);
+    }
+    pthread_mutex_unlock(&pool->poolTakeMutex);
+    /* Only called with the deque empty, so they all fit. */
+    while (n > 0)
+        (void) dequePush(&self->workerDeque, batch[--n]);
+    return job;
+}
+
+/*
+ * The job with a given index, jobs are numbered from 1 through the slabs.
+ */
+static inline job_t *
+jobAt(threadPool_t *pool, uint32_t index) {
+    uint32_t slab = (index - 1) / POOL_SLAB_JOBS;
+
+    return &pool->poolSlabDir[slab / POOL_DIR_SLABS][slab % POOL_DIR_SLABS]->slabJobs[(index - 1) % POOL_SLAB_JOBS];
+}
+
+/*
+ * Push a chain of jobs linked through jobFreeNext onto the shared free
+ * list. The list is a stack of indices with a tag bumped on every
+ * change, so a pop that read a job since taken and put back fails rather
+ * than corrupting the list.
+ */
+static void
+pushFreeJobs(threadPool_t *pool, job_t *first, job_t *last) {
+    uint64_t head = atomic_load_explicit(&pool->poolFree, memory_order_relaxed), next;
+
+    do {
+        atomic_store_explicit(&last->jobFreeNext, (uint32_t) head, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | first->jobIndex;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->poolFree, &head, next, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+static job_t *
+popFreeJob(threadPool_t *pool) {
+    uint64_t head = atomic_load_explicit(&pool->poolFree, memory_order_acquire), next;
+    job_t *job;
+
+    do {
+        if ((uint32_t) head == 0)
+            return NULL;
+        job = jobAt(pool, (uint32_t) head);
+        next = ((head >> 32) + 1) << 32 | atomic_load_explicit(&job->jobFreeNext, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->poolFree, &head, next, memory_order_acquire,
+                                                    memory_order_acquire));
+    return job;
+}
+
+/*
+ * Take a shared free job, allocating another slab if there are none.
+ * Only a new slab takes poolMutex.
+ */
+static job_t *
+takeFreeJob(threadPool_t *pool) {
+    jobSlab_t *slab;
+    job_t *job;
+    int i, n;
+
+    if ((job = popFreeJob(pool)) != NULL)
+        return job;
+    if ((slab = malloc(sizeof(*slab))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&pool->poolMutex);
+    n = pool->poolNSlabs;
+    if (n == POOL_DIR_SLABS * POOL_DIR_CHUNKS || (pool->poolSlabDir[n / POOL_DIR_SLABS] == NULL &&
+        (pool->poolSlabDir[n / POOL_DIR_SLABS] = malloc(POOL_DIR_SLABS * sizeof(jobSlab_t *))) == NULL)) {
+        pthread_mutex_unlock(&pool->poolMutex);
+        free(slab);
+        return NULL;
+    }
+    pool->poolSlabDir[n / POOL_DIR_SLABS][n % POOL_DIR_SLABS] = slab;
+    pool->poolNSlabs++;
+    pthread_mutex_unlock(&pool->poolMutex);
+    for (i = 0; i < POOL_SLAB_JOBS; i++) {
+        slab->slabJobs[i].jobIndex = (uint32_t) n * POOL_SLAB_JOBS + i + 1;
+        atomic_init(&slab->slabJobs[i].jobFreeNext, slab->slabJobs[i].jobIndex + 1);
+    }
+    /* The first is the caller's, the rest are shared. */
+    pushFreeJobs(pool, &slab->slabJobs[1], &slab->slabJobs[POOL_SLAB_JOBS - 1]);
+    return &slab->slabJobs[0];
+}
+
+/*
+ * Take a free job from a worker's own cache, refilling half of it from
+ * the shared list when it runs dry.
+ */
+static job_t *
+workerTakeJob(worker_t *worker) {
+    threadPool_t *pool = worker->workerPool;
+    job_t *job;
+
+    if (worker->workerFree == NULL) {
+        while (worker->workerNFree < POOL_CACHE_JOBS / 2 && (job = popFreeJob(pool)) != NULL) {
+            job->jobNext = worker->workerFree;
+            worker->workerFree = job;
+            worker->workerNFree++;
+        }
+        if (worker->workerFree == NULL)
+            return takeFreeJob(pool);
+    }
+    job = worker->workerFree;
+    worker->workerFree = job->jobNext;
+    worker->workerNFree--;
+    return job;
+}
+
+/*
+ * Hand back to the shared list every cached job past keep, in one push.
+ */
+static void
+spillJobs(worker_t *worker, int keep) {
+    job_t *first, *last;
+
+    if (worker->workerNFree <= keep)
+        return;
+    first = last = worker->workerFree;
+    while (--worker->workerNFree > keep) {
+        atomic_store_explicit(&last->jobFreeNext, last->jobNext->jobIndex, memory_order_relaxed);
+        last = last->jobNext;
+    }
+    worker->workerFree = last->jobNext;
+    pushFreeJobs(worker->workerPool, first, last);
+}
+
+/*
+ * Recycle a dequeued job into the worker's cache.
+ */
+static void
+workerFreeJob(worker_t *worker, job_t *job) {
+    job->jobNext = worker->workerFree;
+    worker->workerFree = job;
+    if (++worker->workerNFree >= POOL_CACHE_JOBS)
+        spillJobs(worker, POOL_CACHE_JOBS / 2);
+}
+
+/*
+ * Find work for a worker: its own deque first, then the injection queue,
+ * then the other workers' deques starting after its own.
+ */
+static job_t *
+findJob(worker_t *self) {
+    threadPool_t *pool = self->workerPool;
+    int i, start = (int) (self - pool->poolWorkers);
+    job_t *job;
+
+    if ((job = dequePop(&self->workerDeque)) != NULL)
+        return job;
+    if (atomic_load(&pool->poolInjected) > 0 && (job = takeInjected(pool, self)) != NULL)
+        return job;
+    for (i = 1; i < pool->poolMaximum; i++) {
+        if ((job = dequeSteal(&pool->poolWorkers[(start + i) % pool->poolMaximum].workerDeque)) != NULL)
+            return job;
+    }
+    return NULL;
+}
+
+/*
+ * Start a worker in a free slot if the pool is below its limit, the
+ * caller holds poolMutex.
+ */
 static int
 createWorker(threadPool_t *pool) {
     sigset_t oset;
-    int error;
-    pthread_t thread; /* Do not need to keep a reference to this thread. */
+    worker_t *worker = NULL;
+    int i, error;
 
+    if (atomic_load(&pool->poolNthreads) >= atomic_load(&pool->poolLimit))
+        return EAGAIN;
+    for (i = 0; i < pool->poolMaximum; i++) {
+        if (!pool->poolWorkers[i].workerInUse) {
+            worker = &pool->poolWorkers[i];
+            break;
+        }
+    }
+    if (worker == NULL)
+        return EAGAIN;
+    worker->workerInUse = 1;
+    worker->workerRetired = 0;
     pthread_sigmask(SIG_SETMASK, &signalSet, &oset);
-    error = pthread_create(&thread, &pool->poolAttr, workerThread, pool);
+    error = pthread_create(&worker->workerTid, &pool->poolAttr, workerThread, worker);
     pthread_sigmask(SIG_SETMASK, &oset, NULL);
-    return error;
+    if (error != 0) {
+        worker->workerInUse = 0;
+        return error;
+    }
+    if (atomic_fetch_add(&pool->poolNthreads, 1) + 1 > pool->poolPeak)
+        pool->poolPeak = atomic_load(&pool->poolNthreads);
+    atomic_fetch_add(&pool->poolCreated, 1);
+    pool->poolSlots++;
+    return 0;
+}
+
+/*
+ * Signal a parked worker, taking it off the idle count so the jobs queued
+ * before it runs don't signal it again. The caller holds poolMutex.
+ */
+static void
+signalWorker(threadPool_t *pool) {
+    if (atomic_load(&pool->poolIdle) > 0) {
+        atomic_fetch_sub(&pool->poolIdle, 1);
+        pool->poolWakeups++;
+        pthread_cond_signal(&pool->poolWorkcv);
+    }
+}
+
+/*
+ * Wake a parked worker for a new job, or start one if none are parked.
+ * The caller has published the job with a sequentially consistent
+ * operation, pairing with the fence in parkWorker(), so either the job is
+ * seen or the parked worker is.
+ */
+static void
+wakeWorker(threadPool_t *pool) {
+    if (atomic_load(&pool->poolIdle) > 0) {
+        pthread_mutex_lock(&pool->poolMutex);
+        signalWorker(pool);
+        pthread_mutex_unlock(&pool->poolMutex);
+    } else if (atomic_load(&pool->poolNthreads) < atomic_load(&pool->poolLimit)) {
+        pthread_mutex_lock(&pool->poolMutex);
+        (void) createWorker(pool);
+        pthread_mutex_unlock(&pool->poolMutex);
+    }
 }
 
 /*
@@ -76,136 +648,245 @@ createWorker(threadPool_t *pool) {
  * - excess idle thread is terminating because there is no work.
  * - thread was cancelled (pool is being destroyed).
  * - the job function called pthread_exit().
- * In the last case, create another worker thread
- * if necessary to keep the pool populated.
+ * Jobs left in its deque move to the injection queue and, in the last
+ * case, another worker thread is created if necessary to keep the pool
+ * populated.
  */
 static void
 workerCleanup(void *arg) {
-    threadPool_t *pool = (threadPool_t *) arg;
-    --pool->poolNthreads;
-    if (pool->poolFlags & POOL_DESTROY) {
-        if (pool->poolNthreads == 0)
+    worker_t *worker = (worker_t *) arg;
+    threadPool_t *pool = worker->workerPool;
+    job_t *job;
+
+    pthread_mutex_lock(&pool->poolMutex);
+    while ((job = dequePop(&worker->workerDeque)) != NULL)
+        injectJob(pool, job);
+    spillJobs(worker, 0);
+    worker->workerInUse = 0;
+    if (!worker->workerRetired)
+        atomic_fetch_sub(&pool->poolNthreads, 1);
+    pool->poolSlots--;
+    currentWorker = NULL;
+    if (atomic_load(&pool->poolFlags) & POOL_DESTROY) {
+        if (pool->poolSlots == 0)
             (void) pthread_cond_broadcast(&pool->poolBusycv);
-    } else if (pool->poolHead != NULL &&
-               pool->poolNthreads < pool->poolMaximum &&
-               createWorker(pool) == 0) {
-        pool->poolNthreads++;
+    } else if (atomic_load(&pool->poolInjected) > 0) {
+        if (atomic_load(&pool->poolIdle) > 0)
+            signalWorker(pool);
+        else
+            (void) createWorker(pool);
     }
     pthread_mutex_unlock(&pool->poolMutex);
 }
 
+/*
+ * Called by a worker thread once a job's function has returned or the
+ * thread is leaving it. The completion callback runs however the job
+ * ends, outside of the pool lock.
+ */
 static void
-notify_waiters(threadPool_t *pool) {
-    if (pool->poolHead == NULL && pool->poolActive == NULL) {
-        pool->poolFlags &= ~POOL_WAIT;
+jobCleanup(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    threadPool_t *pool = worker->workerPool;
+    typeCounts_t *counts = &worker->workerCounts[worker->workerType - pool->poolTypes];
+    int64_t now;
+
+    if (worker->workerDone != NULL)
+        worker->workerDone(worker->workerDoneArg);
+    now = jobClock(pool);
+
+    countAdd(&counts->countFinished, 1);
+    /* A job started before timing was turned on isn't timed. */
+    if (now != 0 && worker->workerRunNs != 0) {
+        timeAdd(&worker->workerBusyNs, now - worker->workerStartedNs);
+        timeAdd(&counts->countRunNs, now - worker->workerRunNs);
+        timeMax(&counts->countMaxRunNs, now - worker->workerRunNs);
+        recordHistogram(counts->countRunHistogram, now - worker->workerRunNs);
+    }
+    worker->workerDoneNs = now;
+    atomic_store_explicit(&worker->workerBusy, 0, memory_order_release);
+    if (atomic_fetch_sub(&pool->poolPending, 1) == 1 && atomic_load(&pool->poolWaiters) > 0) {
+        pthread_mutex_lock(&pool->poolMutex);
         pthread_cond_broadcast(&pool->poolWaitcv);
+        pthread_mutex_unlock(&pool->poolMutex);
     }
 }
 
 /*
- * Called by a worker thread on return from a job.
+ * A parked worker is leaving, perhaps cancelled in pthread_cond_wait().
  */
 static void
-jobCleanup(void *arg) {
-    pthread_t myTid = pthread_self();
-    active_t *activep;
-    active_t **activepp;
-
+parkCleanup(void *arg) {
     threadPool_t *pool = (threadPool_t *) arg;
 
+    /* Parked workers are counted as idle or as wakeups, either will do. */
+    if (pool->poolWakeups > 0)
+        pool->poolWakeups--;
+    else
+        atomic_fetch_sub(&pool->poolIdle, 1);
+    pthread_mutex_unlock(&pool->poolMutex);
+}
+
+/*
+ * Sleep until there is work. Returns NULL if the pool is being destroyed
+ * or the worker is to exit, because it has lingered long enough or the
+ * pool is over its limit. An exiting worker leaves poolNthreads here,
+ * under the lock, so no more than needed ever leave.
+ */
+static job_t *
+parkWorker(worker_t *self) {
+    threadPool_t *pool = self->workerPool;
+    struct timespec ts;
+    job_t *job = NULL;
+    int threads, timedout = 0;
+
+    /* Whatever it runs next did not follow on from its last job. */
+    self->workerDoneNs = 0;
     pthread_mutex_lock(&pool->poolMutex);
-    for (activepp = &pool->poolActive;
-         (activep = *activepp) != NULL;
-         activepp = &activep->activeNext) {
-        if (activep->activeTid == myTid) {
-            *activepp = activep->activeNext;
-            break;
-        }
+    atomic_fetch_add(&pool->poolIdle, 1);
+    pthread_cleanup_push(parkCleanup, pool)
+            atomic_thread_fence(memory_order_seq_cst);
+            while (!(atomic_load(&pool->poolFlags) & POOL_DESTROY) && (job = findJob(self)) == NULL) {
+                threads = atomic_load(&pool->poolNthreads);
+                if (threads > atomic_load(&pool->poolLimit) || (timedout && threads > pool->poolMinimum)) {
+                    atomic_fetch_sub(&pool->poolNthreads, 1);
+                    atomic_fetch_add(&pool->poolRetired, 1);
+                    self->workerRetired = 1;
+                    break;
+                }
+                if (threads <= pool->poolMinimum) {
+                    (void) pthread_cond_wait(&pool->poolWorkcv, &pool->poolMutex);
+                } else {
+                    (void) clock_gettime(CLOCK_REALTIME, &ts);
+                    ts.tv_sec += pool->poolLinger;
+                    /* Look for work once more before leaving. */
+                    timedout = pool->poolLinger == 0 ||
+                               pthread_cond_timedwait(&pool->poolWorkcv, &pool->poolMutex, &ts) == ETIMEDOUT;
+                }
+                /* Back on the idle count before looking again, a new job then wakes another. */
+                if (pool->poolWakeups > 0) {
+                    pool->poolWakeups--;
+                    atomic_fetch_add(&pool->poolIdle, 1);
+                }
+            }
+    pthread_cleanup_pop(1);    /* parkCleanup(pool) */
+    return job;
+}
+
+/*
+ * Run a job on a worker, either from its main loop or nested inside
+ * another job that is waiting on a future. A worker going straight from
+ * one job to the next passes the time the last one finished as now,
+ * saving a clock read, a job queued since counts as not having waited.
+ * Now is 0 while the pool isn't timing its jobs.
+ */
+static void
+runJob(worker_t *self, job_t *job, int64_t now) {
+    threadPool_t *pool = self->workerPool;
+    typeCounts_t *counts = &self->workerCounts[job->jobType - pool->poolTypes];
+    void *(*func)(void *);
+    void *arg;
+    int64_t outerRunNs = self->workerRunNs;
+    jobType_t *outerType = self->workerType;
+    void (*outerDone)(void *) = self->workerDone;
+    void *outerDoneArg = self->workerDoneArg;
+    int nested = self->workerDepth++ > 0;
+
+    /* The outer job's time so far is counted, it resumes after this one. */
+    if (nested && now != 0 && self->workerStartedNs != 0)
+        timeAdd(&self->workerBusyNs, now - self->workerStartedNs);
+    countAdd(&counts->countStarted, 1);
+    /* A job queued before timing was turned on isn't timed. */
+    if (now != 0 && job->jobQueuedNs != 0) {
+        if (now < job->jobQueuedNs)
+            now = job->jobQueuedNs;
+        timeAdd(&self->workerWaitNs, now - job->jobQueuedNs);
+        countAdd(&self->workerStarted, 1);
+        timeAdd(&counts->countWaitNs, now - job->jobQueuedNs);
+        timeMax(&counts->countMaxWaitNs, now - job->jobQueuedNs);
+        recordHistogram(counts->countWaitHistogram, now - job->jobQueuedNs);
+    }
+    self->workerStartedNs = now;
+    self->workerRunNs = now;
+    self->workerType = job->jobType;
+    self->workerDone = job->jobDone;
+    self->workerDoneArg = job->jobDoneArg;
+    func = job->jobFunc;
+    arg = job->jobArg;
+    workerFreeJob(self, job);
+    pthread_cleanup_push(jobCleanup, self)
+        /*
+         * Call the specified job function.
+         */
+        func(arg);
+    /*
+     * If the job function calls pthread_exit(), the thread
+     * calls jobCleanup(self) and workerCleanup(self);
+     * the integrity of the pool is thereby maintained.
+     */
+    pthread_cleanup_pop(1);    /* jobCleanup(self) */
+    if (nested) {
+        atomic_store(&self->workerBusy, 1);
+        self->workerStartedNs = self->workerDoneNs;
+        self->workerRunNs = outerRunNs;
+        self->workerType = outerType;
+        self->workerDone = outerDone;
+        self->workerDoneArg = outerDoneArg;
     }
-    if (pool->poolFlags & POOL_WAIT)
-        notify_waiters(pool);
+    self->workerDepth--;
 }
 
 static void *
 workerThread(void *arg) {
-    threadPool_t *pool = (threadPool_t *) arg;
-    int timedout;
+    worker_t *self = (worker_t *) arg;
+    threadPool_t *pool = self->workerPool;
     job_t *job;
-    void *(*func)(void *);
-    active_t active;
-    struct timespec ts;
 
+    currentWorker = self;
+    self->workerDoneNs = 0;
+    /*
+     * Pinned before anything is allocated, so the memory the worker
+     * first touches comes from its own node.
+     */
+    pthread_mutex_lock(&pool->poolMutex);
+    if (pool->poolPlaces != NULL)
+        (void) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                      &pool->poolPlaces[self - pool->poolWorkers]);
+    pthread_mutex_unlock(&pool->poolMutex);
     /*
      * This is the worker's main loop.  It will only be left
      * if a timeout occurs or if the pool is being destroyed.
      */
-    pthread_mutex_lock(&pool->poolMutex);
-    pthread_cleanup_push(workerCleanup, pool)
-    active.activeTid = pthread_self();
+    pthread_cleanup_push(workerCleanup, self)
             for (;;) {
                 /*
                  * We don't know what this thread was doing during
-                 * its last job, so we reset its signal mask and
-                 * cancellation state back to the initial values.
+                 * its last job, so we reset its cancellation state
+                 * back to the initial values. The signal mask is left
+                 * to the job, resetting it costs a system call per job.
                  */
-                pthread_sigmask(SIG_SETMASK, &signalSet, NULL);
                 pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
                 pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-                timedout = 0;
-                pool->poolIdle++;
-                if (pool->poolFlags & POOL_WAIT)
-                    notify_waiters(pool);
-                while (pool->poolHead == NULL &&
-                       !(pool->poolFlags & POOL_DESTROY)) {
-                    if (pool->poolNthreads <= pool->poolMinimum) {
-                        (void) pthread_cond_wait(&pool->poolWorkcv, &pool->poolMutex);
-                    } else {
-                        (void) clock_gettime(CLOCK_REALTIME, &ts);
-                        ts.tv_sec += pool->poolLinger;
-                        if (pool->poolLinger == 0 ||
-                            pthread_cond_timedwait(&pool->poolWorkcv, &pool->poolMutex, &ts) == ETIMEDOUT) {
-                            timedout = 1;
-                            break;
-                        }
-                    }
-                }
-                pool->poolIdle--;
-                if (pool->poolFlags & POOL_DESTROY)
+                if (atomic_load(&pool->poolFlags) & POOL_DESTROY)
                     break;
-                if ((job = pool->poolHead) != NULL) {
-                    timedout = 0;
-                    func = job->jobFunc;
-                    arg = job->jobArg;
-                    pool->poolHead = job->jobNext;
-                    if (job == pool->poolTail)
-                        pool->poolTail = NULL;
-                    active.activeNext = pool->poolActive;
-                    pool->poolActive = &active;
-                    pthread_mutex_unlock(&pool->poolMutex);
-                    pthread_cleanup_push(jobCleanup, pool)
-                    free(job);
-                    /*
-                     * Call the specified job function.
-                     */
-                    func(arg);
-                    /*
-                     * If the job function calls pthread_exit(), the thread
-                     * calls jobCleanup(pool) and workerCleanup(pool);
-                     * the integrity of the pool is thereby maintained.
-                     */
-                    pthread_cleanup_pop(1);    /* jobCleanup(pool) */
-                }
-                if (timedout && pool->poolNthreads > pool->poolMinimum) {
-                    /*
-                     * We timed out and there is no work to be done
-                     * and the number of workers exceeds the minimum.
-                     * Exit now to reduce the size of the pool.
-                     */
+                if ((job = findJob(self)) == NULL && (job = parkWorker(self)) == NULL)
+                    break;
+                /*
+                 * Marked busy before the destroy flag is checked again so
+                 * thrPoolDestroy() either sees the job running and cancels
+                 * it or the job is never started.
+                 */
+                atomic_store(&self->workerBusy, 1);
+                if (atomic_load(&pool->poolFlags) & POOL_DESTROY) {
+                    /* thrPoolDestroy() completes it along with the rest. */
+                    atomic_store(&self->workerBusy, 0);
+                    injectJob(pool, job);
                     break;
                 }
+                runJob(self, job, self->workerDoneNs != 0 ? self->workerDoneNs : jobClock(pool));
             }
-    pthread_cleanup_pop(1);    /* workerCleanup(pool) */
+    pthread_cleanup_pop(1);    /* workerCleanup(self) */
     return NULL;
 }
 
@@ -246,6 +927,7 @@ cloneAttributes(pthread_attr_t *newAttr, pthread_attr_t *oldAttr) {
 threadPool_t *
 thrPoolCreate(uint16_t minThreads, uint16_t maxThreads, uint16_t linger, pthread_attr_t *attr) {
     threadPool_t *pool;
+    int i;
 
     sigfillset(&signalSet);
 
@@ -258,19 +940,44 @@ thrPoolCreate(uint16_t minThreads, uint16_t maxThreads, uint16_t linger, pthread
         errno = ENOMEM;
         return (NULL);
     }
+    if ((pool->poolWorkers = calloc(maxThreads, sizeof(worker_t))) == NULL) {
+        free(pool);
+        errno = ENOMEM;
+        return (NULL);
+    }
+    for (i = 0; i < maxThreads; i++)
+        pool->poolWorkers[i].workerPool = pool;
     pthread_mutex_init(&pool->poolMutex, NULL);
+    pthread_mutex_init(&pool->poolTakeMutex, NULL);
     pthread_cond_init(&pool->poolBusycv, NULL);
+    pthread_cond_init(&pool->poolTunecv, NULL);
     pthread_cond_init(&pool->poolWorkcv, NULL);
     pthread_cond_init(&pool->poolWaitcv, NULL);
-    pool->poolActive = NULL;
+    atomic_init(&pool->poolInject, NULL);
     pool->poolHead = NULL;
-    pool->poolTail = NULL;
-    pool->poolFlags = 0;
+    atomic_init(&pool->poolFree, 0);
+    memset(pool->poolSlabDir, 0, sizeof(pool->poolSlabDir));
+    pool->poolNSlabs = 0;
+    atomic_init(&pool->poolInjected, 0);
+    atomic_init(&pool->poolPending, 0);
+    atomic_init(&pool->poolWaiters, 0);
+    atomic_init(&pool->poolFlags, 0);
     pool->poolLinger = linger;
     pool->poolMinimum = minThreads;
     pool->poolMaximum = maxThreads;
-    pool->poolNthreads = 0;
-    pool->poolIdle = 0;
+    atomic_init(&pool->poolLimit, maxThreads);
+    atomic_init(&pool->poolNthreads, 0);
+    pool->poolSlots = 0;
+    pool->poolTuning = 0;
+    memset(&pool->tuneStats, 0, sizeof(pool->tuneStats));
+    atomic_init(&pool->poolIdle, 0);
+    pool->poolWakeups = 0;
+    pool->poolPlaces = NULL;
+    pool->poolPeak = 0;
+    atomic_init(&pool->poolCreated, 0);
+    atomic_init(&pool->poolRetired, 0);
+    pool->poolDumping = 0;
+    memset(pool->poolTypes, 0, sizeof(pool->poolTypes));
 
     /*
      * We cannot just copy the attribute pointer.
@@ -300,32 +1007,355 @@ thrPoolCreate(uint16_t minThreads, uint16_t maxThreads, uint16_t linger, pthread
 
 int
 thrPoolQueue(threadPool_t *pool, void *(*func)(void *), void *arg) {
+    return thrPoolQueueDone(pool, func, arg, NULL, NULL);
+}
+
+static int
+queueJob(threadPool_t *pool, jobType_t *type, void *(*func)(void *), void *arg, void (*done)(void *),
+         void *doneArg) {
+    worker_t *self = currentWorker != NULL && currentWorker->workerPool == pool ? currentWorker : NULL;
     job_t *job;
 
-    if ((job = malloc(sizeof(*job))) == NULL) {
+    if (atomic_load(&pool->poolFlags) & POOL_DESTROY) {
+        errno = ECANCELED;
+        return (-1);
+    }
+    /*
+     * A worker queueing more work takes the job from its own cache and
+     * keeps it on its own deque, everyone else goes through the shared
+     * free list and the injection queue. None of them take a lock.
+     */
+    if ((job = self != NULL ? workerTakeJob(self) : takeFreeJob(pool)) == NULL) {
         errno = ENOMEM;
         return (-1);
     }
-    job->jobNext = NULL;
     job->jobFunc = func;
     job->jobArg = arg;
+    job->jobDone = done;
+    job->jobDoneArg = doneArg;
+    job->jobQueuedNs = jobClock(pool);
+    job->jobType = type;
+    atomic_fetch_add(&type->typeQueued, 1);
+    atomic_fetch_add(&pool->poolPending, 1);
+    /* The count of injected jobs is updated seq_cst, a push onto the deque needs the fence. */
+    if (self != NULL && dequePush(&self->workerDeque, job) == 0)
+        atomic_thread_fence(memory_order_seq_cst);
+    else
+        injectJob(pool, job);
+    wakeWorker(pool);
+    return 0;
+}
 
-    pthread_mutex_lock(&pool->poolMutex);
+int
+thrPoolQueueDone(threadPool_t *pool, void *(*func)(void *), void *arg, void (*done)(void *), void *doneArg) {
+    return queueJob(pool, jobType(pool, func, NULL), func, arg, done, doneArg);
+}
 
-    if (pool->poolHead == NULL)
-        pool->poolHead = job;
-    else
-        pool->poolTail->jobNext = job;
-    pool->poolTail = job;
+int
+thrPoolQueueNamed(threadPool_t *pool, const char *name, void *(*func)(void *), void *arg, void (*done)(void *),
+                  void *doneArg) {
+    return queueJob(pool, jobType(pool, func, name), func, arg, done, doneArg);
+}
 
-    if (pool->poolIdle > 0) {
+/*
+ * Add up what the workers have started, the time those jobs waited and
+ * the time spent running them.
+ */
+static void
+sumWorkers(threadPool_t *pool, long long *started, long long *waitNs, long long *busyNs) {
+    worker_t *worker;
+
+    *started = *waitNs = *busyNs = 0;
+    for (worker = pool->poolWorkers; worker < pool->poolWorkers + pool->poolMaximum; worker++) {
+        *started += (long long) atomic_load_explicit(&worker->workerStarted, memory_order_relaxed);
+        *waitNs += atomic_load_explicit(&worker->workerWaitNs, memory_order_relaxed);
+        *busyNs += atomic_load_explicit(&worker->workerBusyNs, memory_order_relaxed);
+    }
+}
+
+/*
+ * Move the limit one worker towards the measured demand, the caller holds
+ * poolMutex. Jobs waiting longer than the target on average, or a job
+ * still queued for longer than that, grow the pool. A mostly idle pool
+ * with jobs starting well within the target shrinks it. Busy time is
+ * counted when jobs finish so long jobs show up late, one step per
+ * interval keeps that from causing swings.
+ */
+static void
+tunePool(threadPool_t *pool) {
+    long long started, waitNs, busyNs;
+    int64_t now = monotonicNs();
+    int threads = atomic_load(&pool->poolNthreads);
+    int limit = atomic_load(&pool->poolLimit);
+    thrPoolScale_t *stats = &pool->tuneStats;
+    int64_t oldest = 0;
+    job_t *job;
+    int error;
+
+    sumWorkers(pool, &started, &waitNs, &busyNs);
+    stats->scaleWaitNs = started > pool->tuneStarted ? (waitNs - pool->tuneWaitNs) / (started - pool->tuneStarted) : 0;
+    stats->scaleUtilisation = threads > 0 && now > pool->tuneAtNs ?
+                              (double) (busyNs - pool->tuneBusyNs) / ((double) (now - pool->tuneAtNs) * threads) : 0;
+    pool->tuneAtNs = now;
+    pool->tuneStarted = started;
+    pool->tuneWaitNs = waitNs;
+    pool->tuneBusyNs = busyNs;
+    /* Nothing starts while every worker is stuck, the queue itself shows it. */
+    if (atomic_load(&pool->poolInjected) > 0) {
+        pthread_mutex_lock(&pool->poolTakeMutex);
+        if ((job = injectedHead(pool)) != NULL)
+            oldest = job->jobQueuedNs;
+        pthread_mutex_unlock(&pool->poolTakeMutex);
+    }
+    if (oldest != 0 && now - oldest > stats->scaleWaitNs)
+        stats->scaleWaitNs = now - oldest;
+
+    if (stats->scaleWaitNs > pool->tuneTargetNs && limit < pool->poolMaximum) {
+        atomic_store(&pool->poolLimit, ++limit);
+        /* A worker that can't be started now would only grow the limit, try again next interval. */
+        if (oldest != 0 && (error = createWorker(pool)) != 0 && error != EAGAIN) {
+            atomic_store(&pool->poolLimit, --limit);
+            logError("Could not grow the pool to %d workers: %d", limit + 1, error)
+        } else {
+            stats->scaleGrown++;
+            logInfo("Growing the pool to %d workers, jobs waited %lld us on average.", limit,
+                    (long long) (stats->scaleWaitNs / 1000))
+        }
+    } else if (stats->scaleWaitNs <= pool->tuneTargetNs / 2 && stats->scaleUtilisation < POOL_TUNE_LOW_UTIL &&
+               limit > pool->poolMinimum && limit > 1) {
+        atomic_store(&pool->poolLimit, --limit);
+        stats->scaleShrunk++;
+        logInfo("Shrinking the pool to %d workers, %.0f%% utilised.", limit, stats->scaleUtilisation * 100)
+        /* An idle worker over the limit leaves when it wakes. */
         pthread_cond_signal(&pool->poolWorkcv);
-    } else if (pool->poolNthreads < pool->poolMaximum &&
-               createWorker(pool) == 0) {
-        pool->poolNthreads++;
     }
+    stats->scaleLimit = limit;
+}
+
+static void *
+tuneThread(void *arg) {
+    threadPool_t *pool = (threadPool_t *) arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&pool->poolMutex);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    while (!(atomic_load(&pool->poolFlags) & POOL_DESTROY)) {
+        ts.tv_sec += pool->tuneIntervalMs / 1000;
+        ts.tv_nsec += (long) (pool->tuneIntervalMs % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (!(atomic_load(&pool->poolFlags) & POOL_DESTROY) &&
+               pthread_cond_timedwait(&pool->poolTunecv, &pool->poolMutex, &ts) != ETIMEDOUT);
+        if (!(atomic_load(&pool->poolFlags) & POOL_DESTROY))
+            tunePool(pool);
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+    return NULL;
+}
+
+int
+thrPoolAutoscale(threadPool_t *pool, unsigned int intervalMs, unsigned int targetWaitMs) {
+    sigset_t oset;
+    int error;
+
+    if (intervalMs == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    pthread_mutex_lock(&pool->poolMutex);
+    if (pool->poolTuning) {
+        pthread_mutex_unlock(&pool->poolMutex);
+        errno = EBUSY;
+        return (-1);
+    }
+    atomic_fetch_or(&pool->poolFlags, POOL_TIMED);
+    pool->tuneIntervalMs = intervalMs;
+    pool->tuneTargetNs = (int64_t) targetWaitMs * 1000000LL;
+    pool->tuneAtNs = monotonicNs();
+    sumWorkers(pool, &pool->tuneStarted, &pool->tuneWaitNs, &pool->tuneBusyNs);
+    pool->tuneStats.scaleLimit = atomic_load(&pool->poolLimit);
+    pthread_sigmask(SIG_SETMASK, &signalSet, &oset);
+    error = pthread_create(&pool->poolTuner, NULL, tuneThread, pool);
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    if (error == 0)
+        pool->poolTuning = 1;
+    pthread_mutex_unlock(&pool->poolMutex);
+    if (error != 0) {
+        errno = error;
+        return (-1);
+    }
+    return 0;
+}
+
+void
+thrPoolScaleStats(threadPool_t *pool, thrPoolScale_t *stats) {
+    pthread_mutex_lock(&pool->poolMutex);
+    *stats = pool->tuneStats;
+    stats->scaleLimit = atomic_load(&pool->poolLimit);
+    stats->scaleThreads = atomic_load(&pool->poolNthreads);
+    pthread_mutex_unlock(&pool->poolMutex);
+}
+
+int64_t
+thrStatsQuantile(const unsigned long *histogram, double share) {
+    unsigned long total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < THR_STATS_BUCKETS; b++)
+        total += histogram[b];
+    for (b = 0; b < THR_STATS_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen >= total * share)
+            break;
+    }
+    return (int64_t) 1 << (b < THR_STATS_BUCKETS ? b : THR_STATS_BUCKETS - 1);
+}
+
+void
+thrPoolStats(threadPool_t *pool, thrPoolStats_t *stats) {
+    thrJobStats_t *out;
+    jobType_t *type;
+    typeCounts_t *counts;
+    long pending;
+    int i, w, b;
+
+    memset(stats, 0, sizeof(*stats));
+    atomic_fetch_or(&pool->poolFlags, POOL_TIMED);
+    pthread_mutex_lock(&pool->poolMutex);
+    stats->statsThreads = atomic_load(&pool->poolNthreads);
+    stats->statsPeakThreads = pool->poolPeak;
+    stats->statsIdle = atomic_load(&pool->poolIdle) + pool->poolWakeups;
+    for (i = 0; i < pool->poolMaximum; i++) {
+        if (pool->poolWorkers[i].workerInUse && atomic_load(&pool->poolWorkers[i].workerBusy))
+            stats->statsRunning++;
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+    pending = atomic_load(&pool->poolPending);
+    stats->statsQueued = pending > stats->statsRunning ? pending - stats->statsRunning : 0;
+    stats->statsInjected = atomic_load(&pool->poolInjected);
+    stats->statsCreated = atomic_load(&pool->poolCreated);
+    stats->statsRetired = atomic_load(&pool->poolRetired);
+
+    for (i = 0; i < THR_STATS_TYPES; i++) {
+        type = &pool->poolTypes[i];
+        if (i < THR_STATS_TYPES - 1 ? !atomic_load_explicit(&type->typeUsed, memory_order_acquire)
+                                    : atomic_load(&type->typeQueued) == 0)
+            continue;
+        out = &stats->statsTypes[stats->statsNTypes++];
+        if (i == THR_STATS_TYPES - 1)
+            snprintf(out->jobName, sizeof(out->jobName), "other");
+        else if (type->typeName[0] != '\0')
+            memcpy(out->jobName, type->typeName, sizeof(out->jobName));
+        else
+            snprintf(out->jobName, sizeof(out->jobName), "%p", (void *) (uintptr_t) type->typeFunc);
+        out->jobQueued = atomic_load(&type->typeQueued);
+        for (w = 0; w < pool->poolMaximum; w++) {
+            counts = &pool->poolWorkers[w].workerCounts[i];
+            out->jobStarted += atomic_load_explicit(&counts->countStarted, memory_order_relaxed);
+            out->jobFinished += atomic_load_explicit(&counts->countFinished, memory_order_relaxed);
+            out->jobWaitNs += atomic_load_explicit(&counts->countWaitNs, memory_order_relaxed);
+            out->jobRunNs += atomic_load_explicit(&counts->countRunNs, memory_order_relaxed);
+            if (atomic_load_explicit(&counts->countMaxWaitNs, memory_order_relaxed) > out->jobMaxWaitNs)
+                out->jobMaxWaitNs = atomic_load_explicit(&counts->countMaxWaitNs, memory_order_relaxed);
+            if (atomic_load_explicit(&counts->countMaxRunNs, memory_order_relaxed) > out->jobMaxRunNs)
+                out->jobMaxRunNs = atomic_load_explicit(&counts->countMaxRunNs, memory_order_relaxed);
+            for (b = 0; b < THR_STATS_BUCKETS; b++) {
+                out->jobWaitHistogram[b] += atomic_load_explicit(&counts->countWaitHistogram[b],
+                                                                 memory_order_relaxed);
+                out->jobRunHistogram[b] += atomic_load_explicit(&counts->countRunHistogram[b],
+                                                                memory_order_relaxed);
+            }
+        }
+    }
+}
+
+/*
+ * Log a pool's statistics, one line for the pool and one per kind of job.
+ */
+static void
+dumpStats(threadPool_t *pool) {
+    thrPoolStats_t *stats;
+    thrJobStats_t *job;
+    int i;
+
+    if ((stats = malloc(sizeof(*stats))) == NULL)
+        return;
+    thrPoolStats(pool, stats);
+    logInfo("Pool %p: %d workers (peak %d, %d idle), %ld queued, %ld running, %lu started, %lu retired.",
+            (void *) pool, stats->statsThreads, stats->statsPeakThreads, stats->statsIdle, stats->statsQueued,
+            stats->statsRunning, stats->statsCreated, stats->statsRetired)
+    for (i = 0; i < stats->statsNTypes; i++) {
+        job = &stats->statsTypes[i];
+        logInfo("Pool %p jobs %s: %lu queued, %lu finished, wait avg %lld us p99 < %lld us max %lld us, "
+                "run avg %lld us p99 < %lld us max %lld us.", (void *) pool, job->jobName, job->jobQueued,
+                job->jobFinished,
+                (long long) (job->jobStarted ? job->jobWaitNs / (int64_t) job->jobStarted / 1000 : 0),
+                (long long) thrStatsQuantile(job->jobWaitHistogram, 0.99), (long long) (job->jobMaxWaitNs / 1000),
+                (long long) (job->jobFinished ? job->jobRunNs / (int64_t) job->jobFinished / 1000 : 0),
+                (long long) thrStatsQuantile(job->jobRunHistogram, 0.99), (long long) (job->jobMaxRunNs / 1000))
+    }
+    free(stats);
+}
+
+/*
+ * The statistics dumper, logs every dumpIntervalMs until the pool is
+ * destroyed.
+ */
+static void *
+dumpThread(void *arg) {
+    threadPool_t *pool = (threadPool_t *) arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&pool->poolMutex);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    while (!(atomic_load(&pool->poolFlags) & POOL_DESTROY)) {
+        ts.tv_sec += pool->dumpIntervalMs / 1000;
+        ts.tv_nsec += (long) (pool->dumpIntervalMs % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (!(atomic_load(&pool->poolFlags) & POOL_DESTROY) &&
+               pthread_cond_timedwait(&pool->poolTunecv, &pool->poolMutex, &ts) != ETIMEDOUT);
+        if (!(atomic_load(&pool->poolFlags) & POOL_DESTROY)) {
+            pthread_mutex_unlock(&pool->poolMutex);
+            dumpStats(pool);
+            pthread_mutex_lock(&pool->poolMutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+    return NULL;
+}
 
+int
+thrPoolStatsDump(threadPool_t *pool, unsigned int intervalMs) {
+    sigset_t oset;
+    int error;
+
+    if (intervalMs == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    pthread_mutex_lock(&pool->poolMutex);
+    if (pool->poolDumping) {
+        pthread_mutex_unlock(&pool->poolMutex);
+        errno = EBUSY;
+        return (-1);
+    }
+    atomic_fetch_or(&pool->poolFlags, POOL_TIMED);
+    pool->dumpIntervalMs = intervalMs;
+    pthread_sigmask(SIG_SETMASK, &signalSet, &oset);
+    error = pthread_create(&pool->poolDumper, NULL, dumpThread, pool);
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    if (error == 0)
+        pool->poolDumping = 1;
     pthread_mutex_unlock(&pool->poolMutex);
+    if (error != 0) {
+        errno = error;
+        return (-1);
+    }
     return 0;
 }
 
@@ -333,43 +1363,46 @@ void
 thrPoolWait(threadPool_t *pool) {
     pthread_mutex_lock(&pool->poolMutex);
     pthread_cleanup_push((void *) pthread_mutex_unlock, &pool->poolMutex)
-    while (pool->poolHead != NULL || pool->poolActive != NULL) {
-        pool->poolFlags |= POOL_WAIT;
-        (void) pthread_cond_wait(&pool->poolWaitcv, &pool->poolMutex);
-    }
+            atomic_fetch_add(&pool->poolWaiters, 1);
+            while (atomic_load(&pool->poolPending) > 0)
+                (void) pthread_cond_wait(&pool->poolWaitcv, &pool->poolMutex);
+            atomic_fetch_sub(&pool->poolWaiters, 1);
     pthread_cleanup_pop(1);    /* pthread_mutex_unlock(&pool->poolMutex); */
 }
 
 void
 thrPoolDestroy(threadPool_t *pool) {
-    active_t *activep;
     job_t *job;
+    int i;
 
     pthread_mutex_lock(&pool->poolMutex);
     pthread_cleanup_push((void *) pthread_mutex_unlock, &pool->poolMutex)
 
-    /* mark the pool as being destroyed; wakeup idle workers */
-    pool->poolFlags |= POOL_DESTROY;
-    pthread_cond_broadcast(&pool->poolWorkcv);
+            /* mark the pool as being destroyed; wakeup idle workers */
+            atomic_fetch_or(&pool->poolFlags, POOL_DESTROY);
+            pthread_cond_broadcast(&pool->poolWorkcv);
+            pthread_cond_broadcast(&pool->poolTunecv);
 
-    /* cancel all active workers */
-    for (activep = pool->poolActive;
-         activep != NULL;
-         activep = activep->activeNext)
-        pthread_cancel(activep->activeTid);
-
-    /* wait for all active workers to finish */
-    while (pool->poolActive != NULL) {
-        pool->poolFlags |= POOL_WAIT;
-        pthread_cond_wait(&pool->poolWaitcv, &pool->poolMutex);
-    }
+            /*
+             * Cancel all workers running a job. A slot is only released
+             * under the lock so none of these threads can have exited.
+             */
+            for (i = 0; i < pool->poolMaximum; i++) {
+                if (pool->poolWorkers[i].workerInUse && atomic_load(&pool->poolWorkers[i].workerBusy))
+                    pthread_cancel(pool->poolWorkers[i].workerTid);
+            }
 
-    /* the last worker to terminate will wake us up */
-    while (pool->poolNthreads != 0)
-        pthread_cond_wait(&pool->poolBusycv, &pool->poolMutex);
+            /* the last worker to release its slot will wake us up */
+            while (pool->poolSlots != 0)
+                pthread_cond_wait(&pool->poolBusycv, &pool->poolMutex);
 
     pthread_cleanup_pop(1);    /* pthread_mutex_unlock(&pool->poolMutex); */
 
+    if (pool->poolTuning)
+        pthread_join(pool->poolTuner, NULL);
+    if (pool->poolDumping)
+        pthread_join(pool->poolDumper, NULL);
+
     /*
      * Unlink the pool from the global list of all pools.
      */
@@ -385,12 +1418,412 @@ thrPoolDestroy(threadPool_t *pool) {
     pthread_mutex_unlock(&thrPoolLock);
 
     /*
-     * There should be no pending jobs, but just in case...
+     * Exiting workers moved their deques to the injection queue. Jobs that
+     * never ran are completed as cancelled here, then released with the
+     * slabs.
      */
-    for (job = pool->poolHead; job != NULL; job = pool->poolHead) {
-        pool->poolHead = job->jobNext;
-        free(job);
+    while ((job = takeInjected(pool, NULL)) != NULL) {
+        if (job->jobDone != NULL)
+            job->jobDone(job->jobDoneArg);
     }
+    for (i = 0; i < pool->poolNSlabs; i++)
+        free(pool->poolSlabDir[i / POOL_DIR_SLABS][i % POOL_DIR_SLABS]);
+    for (i = 0; i < POOL_DIR_CHUNKS && pool->poolSlabDir[i] != NULL; i++)
+        free(pool->poolSlabDir[i]);
+    pthread_mutex_destroy(&pool->poolMutex);
+    pthread_mutex_destroy(&pool->poolTakeMutex);
+    pthread_cond_destroy(&pool->poolBusycv);
+    pthread_cond_destroy(&pool->poolTunecv);
+    pthread_cond_destroy(&pool->poolWorkcv);
+    pthread_cond_destroy(&pool->poolWaitcv);
     pthread_attr_destroy(&pool->poolAttr);
+    free(pool->poolPlaces);
+    free(pool->poolWorkers);
     free(pool);
 }
+
+/*
+ * Parse a kernel style CPU list, e.g. "0-3,8,10-11".
+ */
+static int
+parseCpuList(const char *list, cpu_set_t *cpus) {
+    char *end;
+    long first, last;
+
+    CPU_ZERO(cpus);
+    while (*list != '\0' && *list != '\n') {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0)
+            return (-1);
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return (-1);
+        }
+        if (last >= CPU_SETSIZE)
+            return (-1);
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+        list = end;
+        if (*list == ',')
+            list++;
+        else if (*list != '\0' && *list != '\n')
+            return (-1);
+    }
+    return 0;
+}
+
+/*
+ * Read a CPU list from sysfs.
+ */
+static int
+readCpuList(const char *path, cpu_set_t *cpus) {
+    char buff[4096];
+    FILE *file;
+    int rc = -1;
+
+    if ((file = fopen(path, "r")) == NULL)
+        return (-1);
+    if (fgets(buff, sizeof(buff), file) != NULL)
+        rc = parseCpuList(buff, cpus);
+    fclose(file);
+    return rc;
+}
+
+/*
+ * Fill nodes, indexed by node number, with the allowed CPUs of each NUMA
+ * node and return one past the highest node. Without NUMA every CPU is
+ * on node 0.
+ */
+static int
+readNodes(const cpu_set_t *allowed, cpu_set_t *nodes) {
+    char path[64];
+    cpu_set_t online;
+    int node, nNodes = 0;
+
+    if (readCpuList(POOL_NODE_PATH "/online", &online) == 0) {
+        for (node = 0; node < CPU_SETSIZE; node++) {
+            if (!CPU_ISSET(node, &online))
+                continue;
+            snprintf(path, sizeof(path), POOL_NODE_PATH "/node%d/cpulist", node);
+            if (readCpuList(path, &nodes[node]) == -1)
+                CPU_ZERO(&nodes[node]);
+            CPU_AND(&nodes[node], &nodes[node], allowed);
+            nNodes = node + 1;
+        }
+    }
+    if (nNodes == 0) {
+        nodes[0] = *allowed;
+        nNodes = 1;
+    }
+    return nNodes;
+}
+
+/*
+ * Order the CPUs workers are pinned to in turn: compact takes every CPU
+ * of a node before moving to the next, scatter deals one from each node
+ * at a time. Returns the number of CPUs ordered.
+ */
+static int
+orderCpus(thrPlacement_t placement, const cpu_set_t *nodes, int nNodes, int *order) {
+    int node, cpu, nth, count, nCpus = 0, more = 1;
+
+    if (placement == THR_PLACE_COMPACT) {
+        for (node = 0; node < nNodes; node++) {
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &nodes[node]))
+                    order[nCpus++] = cpu;
+            }
+        }
+        return nCpus;
+    }
+    for (nth = 0; more; nth++) {
+        more = 0;
+        for (node = 0; node < nNodes; node++) {
+            for (cpu = 0, count = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &nodes[node]) && count++ == nth) {
+                    order[nCpus++] = cpu;
+                    more = 1;
+                    break;
+                }
+            }
+        }
+    }
+    return nCpus;
+}
+
+int
+thrPoolPlace(threadPool_t *pool, thrPlacement_t placement, const char *cpuList, int node) {
+    cpu_set_t allowed, *nodes = NULL, *places = NULL;
+    int *order = NULL;
+    int nNodes, nCpus, slot, error = 0;
+
+    if (cpuList != NULL ? parseCpuList(cpuList, &allowed) == -1
+                        : sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (placement != THR_PLACE_NONE || cpuList != NULL) {
+        nodes = calloc(CPU_SETSIZE, sizeof(cpu_set_t));
+        order = malloc(CPU_SETSIZE * sizeof(int));
+        places = calloc(pool->poolMaximum, sizeof(cpu_set_t));
+        if (nodes == NULL || order == NULL || places == NULL) {
+            error = ENOMEM;
+            goto out;
+        }
+        nNodes = readNodes(&allowed, nodes);
+        if (placement == THR_PLACE_NODE) {
+            if (node < 0 || node >= nNodes) {
+                error = EINVAL;
+                goto out;
+            }
+            allowed = nodes[node];
+        }
+        if (CPU_COUNT(&allowed) == 0) {
+            error = EINVAL;
+            goto out;
+        }
+        if (placement == THR_PLACE_COMPACT || placement == THR_PLACE_SCATTER) {
+            if ((nCpus = orderCpus(placement, nodes, nNodes, order)) == 0) {
+                error = EINVAL;
+                goto out;
+            }
+            for (slot = 0; slot < pool->poolMaximum; slot++) {
+                CPU_ZERO(&places[slot]);
+                CPU_SET(order[slot % nCpus], &places[slot]);
+            }
+        } else {
+            /* Every worker may use any of the CPUs. */
+            for (slot = 0; slot < pool->poolMaximum; slot++)
+                places[slot] = allowed;
+        }
+    }
+
+    /* Workers already running move now, the rest as they start. */
+    pthread_mutex_lock(&pool->poolMutex);
+    free(pool->poolPlaces);
+    pool->poolPlaces = places;
+    places = NULL;
+    for (slot = 0; slot < pool->poolMaximum; slot++) {
+        if (pool->poolWorkers[slot].workerInUse)
+            (void) pthread_setaffinity_np(pool->poolWorkers[slot].workerTid, sizeof(cpu_set_t),
+                                          pool->poolPlaces != NULL ? &pool->poolPlaces[slot] : &allowed);
+    }
+    pthread_mutex_unlock(&pool->poolMutex);
+out:
+    free(nodes);
+    free(order);
+    free(places);
+    if (error != 0) {
+        errno = error;
+        return (-1);
+    }
+    return 0;
+}
+
+threadPool_t *
+thrPoolSelf(void) {
+    return currentWorker != NULL ? currentWorker->workerPool : NULL;
+}
+
+static void
+futureRelease(thrFuture_t *future) {
+    int refs;
+
+    pthread_mutex_lock(&future->futureMutex);
+    refs = --future->futureRefs;
+    pthread_mutex_unlock(&future->futureMutex);
+    if (refs == 0) {
+        pthread_mutex_destroy(&future->futureMutex);
+        pthread_cond_destroy(&future->futureCond);
+        free(future);
+    }
+}
+
+static void *
+futureRun(void *arg) {
+    thrFuture_t *future = (thrFuture_t *) arg;
+
+    future->futureResult = future->futureFunc(future->futureArg);
+    future->futureReturned = 1;
+    return NULL;
+}
+
+/*
+ * The job's completion callback: publish the result, wake the waiters,
+ * then run the continuations on this thread.
+ */
+static void
+futureComplete(void *arg) {
+    thrFuture_t *future = (thrFuture_t *) arg;
+    thrContinuation_t *then, *next;
+
+    pthread_mutex_lock(&future->futureMutex);
+    future->futureState = future->futureReturned ? FUTURE_DONE : FUTURE_CANCELLED;
+    then = future->futureThen;
+    future->futureThen = NULL;
+    future->futureTail = &future->futureThen;
+    pthread_cond_broadcast(&future->futureCond);
+    pthread_mutex_unlock(&future->futureMutex);
+
+    for (; then != NULL; then = next) {
+        next = then->thenNext;
+        then->thenFunc(future, then->thenArg);
+        free(then);
+    }
+    futureRelease(future);
+}
+
+thrFuture_t *
+thrPoolSubmit(threadPool_t *pool, void *(*func)(void *), void *arg) {
+    thrFuture_t *future;
+
+    if ((future = calloc(1, sizeof(*future))) == NULL) {
+        errno = ENOMEM;
+        return (NULL);
+    }
+    pthread_mutex_init(&future->futureMutex, NULL);
+    pthread_cond_init(&future->futureCond, NULL);
+    future->futurePool = pool;
+    future->futureFunc = func;
+    future->futureArg = arg;
+    future->futureState = FUTURE_PENDING;
+    future->futureRefs = 2;
+    future->futureTail = &future->futureThen;
+    if (queueJob(pool, jobType(pool, func, NULL), futureRun, future, futureComplete, future) == -1) {
+        pthread_mutex_destroy(&future->futureMutex);
+        pthread_cond_destroy(&future->futureCond);
+        free(future);
+        return (NULL);
+    }
+    return future;
+}
+
+static inline int
+timespecPassed(const struct timespec *ts) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+/*
+ * Wait until the future completes or the deadline (if any) passes. A
+ * worker of the future's pool runs other queued jobs meanwhile, so jobs
+ * waiting on the jobs they queued can never hold every worker, and
+ * looks again every POOL_HELP_POLL_NS in case more are queued.
+ */
+static int
+futureWait(thrFuture_t *future, const struct timespec *deadline, void **result) {
+    worker_t *self = currentWorker != NULL && currentWorker->workerPool == future->futurePool ? currentWorker : NULL;
+    struct timespec ts;
+    job_t *job;
+    int state;
+
+    for (;;) {
+        pthread_mutex_lock(&future->futureMutex);
+        if (future->futureState != FUTURE_PENDING || (deadline != NULL && timespecPassed(deadline)))
+            break;
+        if (self != NULL) {
+            pthread_mutex_unlock(&future->futureMutex);
+            if ((job = findJob(self)) != NULL) {
+                runJob(self, job, jobClock(self->workerPool));
+                continue;
+            }
+            pthread_mutex_lock(&future->futureMutex);
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += POOL_HELP_POLL_NS;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            if (deadline != NULL && (deadline->tv_sec < ts.tv_sec ||
+                                     (deadline->tv_sec == ts.tv_sec && deadline->tv_nsec < ts.tv_nsec)))
+                ts = *deadline;
+        } else if (deadline != NULL) {
+            ts = *deadline;
+        }
+        pthread_cleanup_push((void *) pthread_mutex_unlock, &future->futureMutex)
+                if (future->futureState == FUTURE_PENDING) {
+                    if (self == NULL && deadline == NULL)
+                        (void) pthread_cond_wait(&future->futureCond, &future->futureMutex);
+                    else
+                        (void) pthread_cond_timedwait(&future->futureCond, &future->futureMutex, &ts);
+                }
+        pthread_cleanup_pop(1);    /* pthread_mutex_unlock(&future->futureMutex); */
+    }
+    state = future->futureState;
+    if (state == FUTURE_DONE && result != NULL)
+        *result = future->futureResult;
+    pthread_mutex_unlock(&future->futureMutex);
+
+    if (state == FUTURE_PENDING) {
+        errno = ETIMEDOUT;
+        return (-1);
+    }
+    if (state == FUTURE_CANCELLED) {
+        errno = ECANCELED;
+        return (-1);
+    }
+    return 0;
+}
+
+int
+thrFutureWait(thrFuture_t *future, void **result) {
+    return futureWait(future, NULL, result);
+}
+
+int
+thrFutureTimedWait(thrFuture_t *future, unsigned int timeoutMs, void **result) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (long) (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return futureWait(future, &deadline, result);
+}
+
+int
+thrFutureReady(thrFuture_t *future) {
+    int ready;
+
+    pthread_mutex_lock(&future->futureMutex);
+    ready = future->futureState != FUTURE_PENDING;
+    pthread_mutex_unlock(&future->futureMutex);
+    return ready;
+}
+
+int
+thrFutureThen(thrFuture_t *future, thrFutureFunc func, void *arg) {
+    thrContinuation_t *then;
+
+    pthread_mutex_lock(&future->futureMutex);
+    if (future->futureState != FUTURE_PENDING) {
+        pthread_mutex_unlock(&future->futureMutex);
+        func(future, arg);
+        return 0;
+    }
+    if ((then = malloc(sizeof(*then))) == NULL) {
+        pthread_mutex_unlock(&future->futureMutex);
+        errno = ENOMEM;
+        return (-1);
+    }
+    then->thenNext = NULL;
+    then->thenFunc = func;
+    then->thenArg = arg;
+    *future->futureTail = then;
+    future->futureTail = &then->thenNext;
+    pthread_mutex_unlock(&future->futureMutex);
+    return 0;
+}
+
+void
+thrFutureRelease(thrFuture_t *future) {
+    futureRelease(future);
+}
@@ -7,8 +7,10 @@
 #define INVEST_FETCH_C_THREADPOOL_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdint.h>
@@ -22,9 +24,26 @@
  * The threadPool_t type is opaque to the client.
  * It is created by thrPoolCreate() and must be passed
  * unmodified to the remainder of the interfaces.
+ * Every worker has its own lock free deque, jobs queued from a worker
+ * go on its deque and everything else through a shared injection queue.
+ * Idle workers steal from the others' deques before parking.
  */
 typedef struct threadPool threadPool_t;
 
+/*
+ * The thrFuture_t type is opaque to the client.
+ * It is returned by thrPoolSubmit() and completes once the job has
+ * returned (done) or was cancelled, exited or dropped by
+ * thrPoolDestroy() (cancelled). It must be released with
+ * thrFutureRelease() by the submitter.
+ */
+typedef struct thrFuture thrFuture_t;
+
+/*
+ * A continuation, called with the completed future.
+ */
+typedef void (*thrFutureFunc)(thrFuture_t *future, void *arg);
+
 /*
  * Create a thread pool.
  *	minThreads:	the minimum number of threads kept in the pool,
@@ -50,18 +69,191 @@ threadPool_t *thrPoolCreate(uint16_t minThreads, uint16_t maxThreads, uint16_t l
  *
  * The job is performed as if a new detached thread were created for it:
  *	pthread_create(NULL, attr, void *(*func)(void *), void *arg);
+ * except that a job which changes the signal mask must restore it.
  *
  * On error, thrPoolQueue() returns -1 with errno set to the error code.
  */
 int thrPoolQueue(threadPool_t *pool, void *(*func)(void *), void *arg);
 
+/*
+ * As thrPoolQueue(), and call done(doneArg) on the worker thread once
+ * func has returned. It is also called if the job is cancelled or calls
+ * pthread_exit(), or by thrPoolDestroy() if the job never ran, and never
+ * with the pool locked, so it can queue more work. done can be NULL.
+ * On error, thrPoolQueueDone() returns -1 with errno set to the error code
+ * and done is not called.
+ */
+int thrPoolQueueDone(threadPool_t *pool, void *(*func)(void *), void *arg, void (*done)(void *), void *doneArg);
+
+/*
+ * As thrPoolQueueDone(), counting the job under name in the pool's
+ * statistics rather than under its function, e.g. for jobs that share a
+ * function but do different work.
+ */
+int thrPoolQueueNamed(threadPool_t *pool, const char *name, void *(*func)(void *), void *arg, void (*done)(void *),
+                      void *doneArg);
+
+/*
+ * The autoscaling controller's view of the pool.
+ */
+typedef struct thrPoolScale {
+    int scaleLimit;             /* workers the pool may have now */
+    int scaleThreads;           /* workers it has */
+    unsigned long scaleGrown;   /* times the limit was raised */
+    unsigned long scaleShrunk;  /* times it was lowered */
+    int64_t scaleWaitNs;        /* mean queue wait over the last interval */
+    double scaleUtilisation;    /* share of the workers' time spent running jobs */
+} thrPoolScale_t;
+
+/*
+ * Let the pool size itself between minThreads and maxThreads. Every
+ * intervalMs the controller raises the limit on workers by one if jobs
+ * waited longer than targetWaitMs on average, or lowers it by one if
+ * jobs started well within the target and the workers were mostly idle.
+ * Workers over the limit leave once they are idle. Without it the pool
+ * may always grow to maxThreads.
+ * On error, thrPoolAutoscale() returns -1 with errno set to the error code.
+ */
+int thrPoolAutoscale(threadPool_t *pool, unsigned int intervalMs, unsigned int targetWaitMs);
+
+/*
+ * Copy out the controller's last measurements and decisions.
+ */
+void thrPoolScaleStats(threadPool_t *pool, thrPoolScale_t *stats);
+
+/* Kinds of job counted apart, the rest are counted together as "other". */
+#define THR_STATS_TYPES 32
+/* Histogram buckets, bucket b counts durations under 2^b microseconds. */
+#define THR_STATS_BUCKETS 24
+/* Longest job name kept, including the terminator. */
+#define THR_STATS_NAME 32
+
+/*
+ * Counters for one kind of job: those queued with the same name, or
+ * without a name and with the same function.
+ */
+typedef struct thrJobStats {
+    char jobName[THR_STATS_NAME];   /* the name, or the function's address */
+    unsigned long jobQueued;
+    unsigned long jobStarted;
+    unsigned long jobFinished;      /* returned, exited or cancelled */
+    int64_t jobWaitNs;              /* total time started jobs spent queued */
+    int64_t jobRunNs;               /* total time finished jobs spent running */
+    int64_t jobMaxWaitNs;
+    int64_t jobMaxRunNs;
+    unsigned long jobWaitHistogram[THR_STATS_BUCKETS];
+    unsigned long jobRunHistogram[THR_STATS_BUCKETS];
+} thrJobStats_t;
+
+/*
+ * What a pool is doing and has done since it was created.
+ */
+typedef struct thrPoolStats {
+    long statsQueued;               /* jobs waiting to start */
+    long statsRunning;              /* jobs running */
+    long statsInjected;             /* of those queued, those in the shared queue */
+    int statsThreads;               /* workers now */
+    int statsPeakThreads;           /* most workers at once */
+    int statsIdle;                  /* parked workers */
+    unsigned long statsCreated;     /* workers started */
+    unsigned long statsRetired;     /* workers that left after lingering idle or over the limit */
+    int statsNTypes;
+    thrJobStats_t statsTypes[THR_STATS_TYPES];
+} thrPoolStats_t;
+
+/*
+ * Copy out the pool's statistics. They are read without stopping the
+ * pool so the counters may be a few jobs apart. Jobs are only timed once
+ * this, thrPoolStatsDump() or thrPoolAutoscale() has been called on the
+ * pool, until then the times are zero and only the counts are kept.
+ */
+void thrPoolStats(threadPool_t *pool, thrPoolStats_t *stats);
+
+/*
+ * Upper bound in microseconds of the durations the given share of a
+ * histogram falls within.
+ */
+int64_t thrStatsQuantile(const unsigned long *histogram, double share);
+
+/*
+ * Log the pool's statistics every intervalMs until it is destroyed.
+ * On error, thrPoolStatsDump() returns -1 with errno set to the error code.
+ */
+int thrPoolStatsDump(threadPool_t *pool, unsigned int intervalMs);
+
+/*
+ * Where a pool's workers run, see thrPoolPlace().
+ */
+typedef enum thrPlacement {
+    THR_PLACE_NONE,         /* anywhere in the CPU list */
+    THR_PLACE_COMPACT,      /* one CPU each, filling a NUMA node before the next */
+    THR_PLACE_SCATTER,      /* one CPU each, spread across the NUMA nodes */
+    THR_PLACE_NODE          /* anywhere on one NUMA node, for a pool per node */
+} thrPlacement_t;
+
+/*
+ * Pin the pool's workers, within cpuList (a kernel style CPU list such as
+ * "0-7,16-23", or NULL for the CPUs the process may use). Workers pin
+ * themselves before their first job, so the memory they allocate is
+ * first touched, and placed, on their own node. The topology comes from
+ * sysfs, a host without NUMA is a single node. THR_PLACE_NONE with a
+ * NULL cpuList unpins them again.
+ * On error, thrPoolPlace() returns -1 with errno set to the error code.
+ */
+int thrPoolPlace(threadPool_t *pool, thrPlacement_t placement, const char *cpuList, int node);
+
+/*
+ * Queue a job whose result can be waited on. Jobs may submit and wait on
+ * jobs of their own, a worker waiting on a future of its pool runs other
+ * queued jobs meanwhile rather than holding up the pool.
+ * On error, thrPoolSubmit() returns NULL with errno set to the error code.
+ */
+thrFuture_t *thrPoolSubmit(threadPool_t *pool, void *(*func)(void *), void *arg);
+
+/*
+ * Wait for a future, storing what the job returned in result (can be
+ * NULL). Returns -1 with errno set to ECANCELED if it was cancelled.
+ */
+int thrFutureWait(thrFuture_t *future, void **result);
+
+/*
+ * As thrFutureWait(), giving up after timeoutMs with errno set to
+ * ETIMEDOUT.
+ */
+int thrFutureTimedWait(thrFuture_t *future, unsigned int timeoutMs, void **result);
+
+/*
+ * Whether the future has completed.
+ */
+int thrFutureReady(thrFuture_t *future);
+
+/*
+ * Call func(future, arg) once the future completes, on the thread that
+ * completes it, or now if it already has. Continuations run in the
+ * order they were added and can wait on the future without blocking.
+ * On error, thrFutureThen() returns -1 with errno set to the error code.
+ */
+int thrFutureThen(thrFuture_t *future, thrFutureFunc func, void *arg);
+
+/*
+ * Release the submitter's hold on a future, it is freed once the job
+ * has also finished with it.
+ */
+void thrFutureRelease(thrFuture_t *future);
+
+/*
+ * The pool the calling thread is a worker of, NULL if none.
+ */
+threadPool_t *thrPoolSelf(void);
+
 /*
  * Wait for all queued jobs to complete.
  */
 void thrPoolWait(threadPool_t *pool);
 
 /*
- * Cancel all queued jobs and destroy the pool.
+ * Cancel all queued jobs and destroy the pool. Queueing on a pool being
+ * destroyed fails with errno set to ECANCELED.
  */
 void thrPoolDestroy(threadPool_t *pool);
 
@@ -0,0 +1,245 @@
+//
+// Created by Matthew Johnson on 28/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "../src/nzx/bars.h"
+#include "test.h"
+
+#define MAX_ROWS 64
+
+/* 2020-06-01 in NZST */
+#define JUNE_MIDNIGHT 1590926400
+#define JUNE_10AM 1590962400
+
+/*
+ * Stand ins for the market zone and the storage thread, closed bars are
+ * kept here instead of being written.
+ */
+struct storageBatch {
+    int unused;
+};
+
+static char rows[MAX_ROWS][8][32];
+static int nRows;
+static atomic_int submitted;
+/* The sweeper adds batches alongside the test's own updates. */
+static pthread_mutex_t rowsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+tzZone_t *
+nzxMarketZone(void) {
+    return tzLoad("Pacific/Auckland");
+}
+
+long
+nzxPriceDelay(void) {
+    return 20 * 60;
+}
+
+storageBatch_t *
+storageBatchCreate(const char *name) {
+    (void) name;
+    return calloc(1, sizeof(storageBatch_t));
+}
+
+/* Split each {"a","b"} array into the rows' columns. */
+int
+storageBatchAdd(storageBatch_t *batch, const char *command, int nParams, const char *const *values,
+                const int *lengths, const int *formats, storageResultFunc onResult, void *resultArg) {
+    const char *in;
+    int c, row, len;
+
+    (void) batch;
+    (void) command;
+    (void) lengths;
+    (void) formats;
+    (void) onResult;
+    (void) resultArg;
+    pthread_mutex_lock(&rowsMutex);
+    for (c = 0; c < nParams && c < 8; c++) {
+        for (row = nRows, in = values[c] + 1; *in != '}' && row < MAX_ROWS; row++) {
+            in++;
+            for (len = 0; *in != '"' && len < 31; len++) {
+                rows[row][c][len] = *in++;
+            }
+            rows[row][c][len] = '\0';
+            in += *(in + 1) == ',' ? 2 : 1;
+        }
+    }
+    nRows = row;
+    pthread_mutex_unlock(&rowsMutex);
+    return 0;
+}
+
+int
+storageSubmitDurable(storageBatch_t *batch) {
+    atomic_fetch_add(&submitted, 1);
+    free(batch);
+    return 0;
+}
+
+void
+storageBatchFree(storageBatch_t *batch) {
+    free(batch);
+}
+
+/* The closed bar of code at width, NULL if none has been written. */
+static char (*findBar(const char *code, const char *width))[32] {
+    int i;
+
+    for (i = nRows - 1; i >= 0; i--) {
+        if (strcmp(rows[i][1], code) == 0 && strcmp(rows[i][2], width) == 0) {
+            return rows[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+update(const char *code, float price, time_t observed) {
+    nzxNode_t node = {.listing = {.Code = (char *) code, .Price = price}, .next = NULL};
+
+    nzxBarsUpdate(&node, observed);
+}
+
+/* A minute bar is written with the batch for its own minute. */
+static void
+testMinute(void) {
+    char (*bar)[32];
+
+    update("MIN", 1.5f, JUNE_10AM);
+    CHECK((bar = findBar("MIN", "60")) != NULL)
+    if (bar != NULL) {
+        CHECK(strcmp(bar[0], "1590962400") == 0)
+        CHECK(strcmp(bar[3], "1.5") == 0 && strcmp(bar[6], "1.5") == 0)
+        CHECK(strcmp(bar[7], "1") == 0)
+    }
+    CHECK(findBar("MIN", "3600") == NULL)
+}
+
+/* Open and close go by observed time, whatever order the batches finish in. */
+static void
+testOhlc(void) {
+    char (*bar)[32];
+
+    update("HOUR", 1.0f, JUNE_10AM);
+    update("HOUR", 3.0f, JUNE_10AM + 30 * 60);
+    update("HOUR", 0.5f, JUNE_10AM + 10 * 60);
+    CHECK(findBar("HOUR", "3600") == NULL)
+    /* The last minute of the hour closes it. */
+    update("HOUR", 2.0f, JUNE_10AM + 59 * 60);
+    CHECK((bar = findBar("HOUR", "3600")) != NULL)
+    if (bar != NULL) {
+        CHECK(strcmp(bar[0], "1590962400") == 0)
+        CHECK(strcmp(bar[3], "1") == 0)
+        CHECK(strcmp(bar[4], "3") == 0)
+        CHECK(strcmp(bar[5], "0.5") == 0)
+        CHECK(strcmp(bar[6], "2") == 0)
+        CHECK(strcmp(bar[7], "4") == 0)
+    }
+}
+
+/* A price for a bar that has already been written is dropped. */
+static void
+testLate(void) {
+    int before;
+
+    update("LATE", 1.0f, JUNE_10AM + 59 * 60);
+    CHECK(findBar("LATE", "3600") != NULL)
+    before = nRows;
+    update("LATE", 9.0f, JUNE_10AM + 15 * 60);
+    CHECK(nRows == before)
+    CHECK(strcmp(findBar("LATE", "3600")[6], "1") == 0)
+}
+
+/* A bar still open when the next one starts is written then. */
+static void
+testNextBar(void) {
+    char (*bar)[32];
+
+    update("NEXT", 1.0f, JUNE_10AM);
+    update("NEXT", 2.0f, JUNE_10AM + 2 * 3600);
+    CHECK((bar = findBar("NEXT", "3600")) != NULL)
+    if (bar != NULL) {
+        CHECK(strcmp(bar[0], "1590962400") == 0)
+        CHECK(strcmp(bar[6], "1") == 0)
+    }
+}
+
+/* Days start at local midnight, on daylight saving days too. */
+static void
+testDays(void) {
+    char (*bar)[32];
+
+    update("DAY", 1.0f, JUNE_10AM);
+    update("DAY", 2.0f, JUNE_MIDNIGHT + 86400 - 60);
+    CHECK((bar = findBar("DAY", "86400")) != NULL)
+    if (bar != NULL) {
+        CHECK(strcmp(bar[0], "1590926400") == 0)
+    }
+    /* 2020-09-27 starts in NZST and ends in NZDT, it is 23 hours long. */
+    update("DST", 1.0f, 1601161200);
+    update("DST", 2.0f, 1601204340);
+    CHECK((bar = findBar("DST", "86400")) != NULL)
+    if (bar != NULL) {
+        CHECK(strcmp(bar[0], "1601121600") == 0)
+        CHECK(strcmp(bar[7], "2") == 0)
+    }
+}
+
+/* The hour and day bars of the last batch of the day are swept once they are due. */
+static void
+testSweep(void) {
+    time_t close = JUNE_10AM + 7 * 3600;   /* 17:00, after the last batch */
+
+    update("SWEEP", 1.0f, close - 15 * 60);
+    CHECK(findBar("SWEEP", "3600") == NULL)
+    /* Not before the batch for the hour's last minute could have arrived. */
+    nzxBarsSweep(close + 20 * 60);
+    CHECK(findBar("SWEEP", "3600") == NULL)
+    nzxBarsSweep(close + 21 * 60);
+    CHECK(findBar("SWEEP", "3600") != NULL)
+    CHECK(findBar("SWEEP", "86400") == NULL)
+    nzxBarsSweep(JUNE_MIDNIGHT + 86400 + 21 * 60);
+    CHECK(findBar("SWEEP", "86400") != NULL)
+}
+
+/* The sweeper thread writes a bar once it is due without being asked. */
+static void
+testSweeper(void) {
+    time_t now = time(NULL), due;
+    int i, before;
+
+    CHECK(nzxBarsStart() == 0)
+    /* An hour bar observed long enough ago that it is already due. */
+    due = now - 3 * 3600;
+    update("THREAD", 1.0f, due - due % 60);
+    /* The minute bar went with the update, wait for the sweeper's batch. */
+    before = atomic_load(&submitted);
+    for (i = 0; i < 100 && atomic_load(&submitted) == before; i++) {
+        usleep(10000);
+    }
+    /* Joined, the rows can be read. */
+    nzxBarsStop();
+    CHECK(findBar("THREAD", "3600") != NULL)
+}
+
+int
+main(void) {
+    setenv("NZX_BAR_WIDTHS", "60,3600,86400", 1);
+    if (nzxMarketZone() == NULL) {
+        fprintf(stderr, "Could not load Pacific/Auckland, is TZDIR set to tests/data/zoneinfo?\n");
+        return EXIT_FAILURE;
+    }
+    RUN(testMinute)
+    RUN(testOhlc)
+    RUN(testLate)
+    RUN(testNextBar)
+    RUN(testDays)
+    RUN(testSweep)
+    RUN(testSweeper)
+    return TEST_RESULT();
+}
@@ -0,0 +1,132 @@
+//
+// Created by Matthew Johnson on 27/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "../src/storage/spool.h"
+#include "test.h"
+
+#define TEST_SPOOL "spool_test.spool"
+
+#include <sys/stat.h>
+
+static int
+countRecord(const void *data, uint32_t len, void *arg) {
+    (void) data;
+    (void) len;
+    (*(int *) arg)++;
+    return 0;
+}
+
+/* Records appended under the interval policy are synced once it is up, without further appends. */
+static void
+testIntervalFlush(void) {
+    struct timespec next;
+    spool_t *spool;
+
+    unlink(TEST_SPOOL);
+    spool = spoolOpen(TEST_SPOOL, 0, SPOOL_FSYNC_INTERVAL, 50);
+    CHECK(spool != NULL)
+    CHECK(spoolFlush(spool, &next) == 0)
+    /* The first append after a quiet spell syncs straight away. */
+    usleep(60000);
+    CHECK(spoolAppend(spool, "first", 5) == 0)
+    CHECK(spoolFlush(spool, &next) == 0)
+    /* The next one waits for the interval. */
+    CHECK(spoolAppend(spool, "second", 6) == 0)
+    CHECK(spoolFlush(spool, &next) == 1)
+    usleep(60000);
+    CHECK(spoolFlush(spool, &next) == 0)
+    spoolClose(spool);
+    unlink(TEST_SPOOL);
+}
+
+/* Appended records survive closing and reopening until consumed. */
+static void
+testRecover(void) {
+    spool_t *spool;
+    uint64_t next;
+    int count = 0;
+
+    unlink(TEST_SPOOL);
+    spool = spoolOpen(TEST_SPOOL, 0, SPOOL_FSYNC_NONE, 0);
+    CHECK(spoolAppend(spool, "one", 3) == 0)
+    CHECK(spoolAppend(spool, "two", 3) == 0)
+    CHECK(spoolRead(spool, 1, countRecord, &count, &next) == 1)
+    spoolConsume(spool, next);
+    spoolClose(spool);
+
+    spool = spoolOpen(TEST_SPOOL, 0, SPOOL_FSYNC_NONE, 0);
+    count = 0;
+    CHECK(spoolRead(spool, 10, countRecord, &count, &next) == 1)
+    CHECK(count == 1)
+    spoolConsume(spool, next);
+    CHECK(spoolPending(spool) == 0)
+    spoolClose(spool);
+    unlink(TEST_SPOOL);
+}
+
+static int
+expectRecord(const void *data, uint32_t len, void *arg) {
+    uint32_t *expected = arg;
+
+    CHECK(len == sizeof(uint32_t) + *expected % 200)
+    CHECK(*(const uint32_t *) data == *expected)
+    (*expected)++;
+    return 0;
+}
+
+/*
+ * Appending and consuming without ever draining the spool keeps it in
+ * order and within a bounded size, also when a read straddles the records
+ * being moved to the front.
+ */
+static void
+testCompact(void) {
+    uint8_t record[sizeof(uint32_t) + 200] = {0};
+    uint32_t appended = 0, expected = 0;
+    spool_t *spool;
+    struct stat st;
+    uint64_t next;
+    int round, i;
+
+    unlink(TEST_SPOOL);
+    spool = spoolOpen(TEST_SPOOL, 0, SPOOL_FSYNC_NONE, 0);
+    CHECK(spool != NULL)
+    for (round = 0; round < 2000; round++) {
+        for (i = 0; i < 4; i++, appended++) {
+            memcpy(record, &appended, sizeof(appended));
+            CHECK(spoolAppend(spool, record, sizeof(uint32_t) + appended % 200) == 0)
+        }
+        /* Keep a couple of records back, and append before committing every other round. */
+        CHECK(spoolRead(spool, (int) (appended - expected) - 2, expectRecord, &expected, &next) > 0)
+        if (round % 2) {
+            memcpy(record, &appended, sizeof(appended));
+            CHECK(spoolAppend(spool, record, sizeof(uint32_t) + appended % 200) == 0)
+            appended++;
+        }
+        spoolConsume(spool, next);
+        CHECK(spoolPending(spool) > 0)
+    }
+    spoolClose(spool);
+    CHECK(stat(TEST_SPOOL, &st) == 0 && st.st_size <= 16 * 4096)
+
+    /* What was left unconsumed is recovered in order after reopening. */
+    spool = spoolOpen(TEST_SPOOL, 0, SPOOL_FSYNC_NONE, 0);
+    i = (int) (appended - expected);
+    CHECK(spoolRead(spool, 1000, expectRecord, &expected, &next) == i)
+    CHECK(expected == appended)
+    spoolConsume(spool, next);
+    CHECK(spoolPending(spool) == 0)
+    spoolClose(spool);
+    unlink(TEST_SPOOL);
+}
+
+int
+main(void) {
+    loggerInit(1, 0);
+    RUN(testRecover)
+    RUN(testIntervalFlush)
+    RUN(testCompact)
+    return TEST_RESULT();
+}
@@ -0,0 +1,33 @@
+//
+// Created by Matthew Johnson on 27/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef INVEST_FETCH_C_TEST_H
+#define INVEST_FETCH_C_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * A failed check reports where it was and fails the test run, the rest
+ * of the checks still run.
+ */
+static int testFailures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        testFailures++; \
+    } \
+} while (0);
+
+#define RUN(test) do { \
+    int before = testFailures; \
+    test(); \
+    printf("%s %s\n", testFailures == before ? "PASS" : "FAIL", #test); \
+} while (0);
+
+#define TEST_RESULT() (testFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE)
+
+#endif //INVEST_FETCH_C_TEST_H
@@ -0,0 +1,537 @@
+//
+// Created by Matthew Johnson on 27/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+
+#include "../src/threading/threadPool.h"
+#include "test.h"
+
+#define TEST_WORKERS 2
+/* Jobs queued from one worker, more than its deque holds. */
+#define TEST_JOBS 1000
+/* Jobs a worker's deque holds, POOL_DEQUE_SIZE in threadPool.c. */
+#define TEST_DEQUE_SIZE 256
+/* Jobs left on a busy worker's deque for another to steal. */
+#define TEST_STEAL_JOBS 8
+
+/* The CPUs this process may run on. */
+static cpu_set_t allowed;
+
+/* Runs on a worker, reporting the CPUs it is allowed on. */
+static void *
+workerAffinity(void *arg) {
+    cpu_set_t *set = (cpu_set_t *) arg;
+
+    CPU_ZERO(set);
+    pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+    /* Held a moment so every worker gets one of the jobs. */
+    usleep(20000);
+    return NULL;
+}
+
+/* Run a job on every worker and collect what each is allowed on. */
+static void
+sampleWorkers(threadPool_t *pool, cpu_set_t *sets) {
+    thrFuture_t *futures[TEST_WORKERS];
+    int i;
+
+    for (i = 0; i < TEST_WORKERS; i++) {
+        futures[i] = thrPoolSubmit(pool, workerAffinity, &sets[i]);
+        CHECK(futures[i] != NULL)
+    }
+    for (i = 0; i < TEST_WORKERS; i++) {
+        if (futures[i] != NULL) {
+            CHECK(thrFutureWait(futures[i], NULL) == 0)
+            thrFutureRelease(futures[i]);
+        }
+    }
+}
+
+static int
+firstCpu(const cpu_set_t *set) {
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, set); cpu++);
+    return cpu;
+}
+
+/* Workers that are already running move onto the CPU list given. */
+static void
+testCpuList(void) {
+    cpu_set_t sets[TEST_WORKERS];
+    threadPool_t *pool;
+    char list[16];
+    int cpu = firstCpu(&allowed), i;
+
+    pool = thrPoolCreate(TEST_WORKERS, TEST_WORKERS, 0, NULL);
+    CHECK(pool != NULL)
+    sampleWorkers(pool, sets);
+    snprintf(list, sizeof(list), "%d", cpu);
+    CHECK(thrPoolPlace(pool, THR_PLACE_NONE, list, 0) == 0)
+    sampleWorkers(pool, sets);
+    for (i = 0; i < TEST_WORKERS; i++) {
+        CHECK(CPU_COUNT(&sets[i]) == 1 && CPU_ISSET(cpu, &sets[i]))
+    }
+    /* Unpinned they may run anywhere the process may. */
+    CHECK(thrPoolPlace(pool, THR_PLACE_NONE, NULL, 0) == 0)
+    sampleWorkers(pool, sets);
+    for (i = 0; i < TEST_WORKERS; i++) {
+        CHECK(CPU_EQUAL(&sets[i], &allowed))
+    }
+    thrPoolDestroy(pool);
+}
+
+/* Compact placement gives every worker, new ones included, a single CPU. */
+static void
+testCompact(void) {
+    cpu_set_t sets[TEST_WORKERS];
+    threadPool_t *pool;
+    int i;
+
+    pool = thrPoolCreate(0, TEST_WORKERS, 0, NULL);
+    CHECK(pool != NULL)
+    CHECK(thrPoolPlace(pool, THR_PLACE_COMPACT, NULL, 0) == 0)
+    sampleWorkers(pool, sets);
+    for (i = 0; i < TEST_WORKERS; i++) {
+        CHECK(CPU_COUNT(&sets[i]) == 1 && CPU_ISSET(firstCpu(&sets[i]), &allowed))
+    }
+    thrPoolDestroy(pool);
+}
+
+/* Bad lists and nodes are refused. */
+static void
+testInvalid(void) {
+    threadPool_t *pool = thrPoolCreate(0, 1, 0, NULL);
+
+    CHECK(thrPoolPlace(pool, THR_PLACE_NONE, "3-x", 0) == -1 && errno == EINVAL)
+    CHECK(thrPoolPlace(pool, THR_PLACE_NODE, NULL, 4096) == -1 && errno == EINVAL)
+    thrPoolDestroy(pool);
+}
+
+/* Jobs run so far by the test in progress. */
+static atomic_int ran;
+
+static void *
+countJob(void *arg) {
+    (void) arg;
+    atomic_fetch_add(&ran, 1);
+    return NULL;
+}
+
+/* Queues more jobs than its worker's deque holds, noting where they went. */
+static void *
+queueMany(void *arg) {
+    thrPoolStats_t *stats = (thrPoolStats_t *) arg;
+    int i;
+
+    for (i = 0; i < TEST_JOBS; i++) {
+        CHECK(thrPoolQueue(thrPoolSelf(), countJob, NULL) == 0)
+    }
+    thrPoolStats(thrPoolSelf(), stats);
+    return NULL;
+}
+
+/* A worker's jobs past what its deque holds go to the injection queue. */
+static void
+testOverflow(void) {
+    static thrPoolStats_t stats;
+    threadPool_t *pool = thrPoolCreate(1, 1, 0, NULL);
+
+    atomic_store(&ran, 0);
+    CHECK(thrPoolQueue(pool, queueMany, &stats) == 0)
+    thrPoolWait(pool);
+    CHECK(atomic_load(&ran) == TEST_JOBS)
+    /* The only worker was busy queueing, none had been taken yet. */
+    CHECK(stats.statsInjected == TEST_JOBS - TEST_DEQUE_SIZE)
+    CHECK(stats.statsQueued == TEST_JOBS)
+    thrPoolDestroy(pool);
+}
+
+/* Notes the thread it ran on. */
+static void *
+stealJob(void *arg) {
+    *(pthread_t *) arg = pthread_self();
+    atomic_fetch_add(&ran, 1);
+    return NULL;
+}
+
+/*
+ * Queues jobs on its own deque and holds its worker until they have run,
+ * without a future wait that would run them here.
+ */
+static void *
+queueAndHold(void *arg) {
+    pthread_t *ranOn = (pthread_t *) arg;
+    int i;
+
+    for (i = 0; i < TEST_STEAL_JOBS; i++) {
+        CHECK(thrPoolQueue(thrPoolSelf(), stealJob, &ranOn[i]) == 0)
+    }
+    for (i = 0; i < 500 && atomic_load(&ran) < TEST_STEAL_JOBS; i++)
+        usleep(10000);
+    ranOn[TEST_STEAL_JOBS] = pthread_self();
+    return NULL;
+}
+
+/* Jobs on a busy worker's deque are stolen by another. */
+static void
+testSteal(void) {
+    pthread_t ranOn[TEST_STEAL_JOBS + 1];
+    threadPool_t *pool = thrPoolCreate(0, 2, 0, NULL);
+    int i;
+
+    atomic_store(&ran, 0);
+    CHECK(thrPoolQueue(pool, queueAndHold, ranOn) == 0)
+    thrPoolWait(pool);
+    CHECK(atomic_load(&ran) == TEST_STEAL_JOBS)
+    for (i = 0; i < TEST_STEAL_JOBS; i++) {
+        CHECK(!pthread_equal(ranOn[i], ranOn[TEST_STEAL_JOBS]))
+    }
+    thrPoolDestroy(pool);
+}
+
+static void *
+sleepJob(void *arg) {
+    usleep((useconds_t) (uintptr_t) arg);
+    atomic_fetch_add(&ran, 1);
+    return NULL;
+}
+
+/* Wait for the pool to have idle parked workers. */
+static int
+waitIdle(threadPool_t *pool, int idle) {
+    static thrPoolStats_t stats;
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        thrPoolStats(pool, &stats);
+        if (stats.statsIdle == idle)
+            return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+/* Workers with nothing to do park, and a new job wakes one. */
+static void
+testPark(void) {
+    threadPool_t *pool = thrPoolCreate(2, 2, 0, NULL);
+    thrFuture_t *future;
+
+    atomic_store(&ran, 0);
+    CHECK(thrPoolQueue(pool, sleepJob, (void *) 20000) == 0)
+    CHECK(thrPoolQueue(pool, sleepJob, (void *) 20000) == 0)
+    CHECK(waitIdle(pool, 2))
+    CHECK(atomic_load(&ran) == 2)
+    future = thrPoolSubmit(pool, countJob, NULL);
+    CHECK(future != NULL && thrFutureTimedWait(future, 5000, NULL) == 0)
+    thrFutureRelease(future);
+    CHECK(waitIdle(pool, 2))
+    thrPoolDestroy(pool);
+}
+
+/* Queues another job from its worker. */
+static void *
+queueOnward(void *arg) {
+    (void) arg;
+    usleep(1000);
+    CHECK(thrPoolQueue(thrPoolSelf(), countJob, NULL) == 0)
+    atomic_fetch_add(&ran, 1);
+    return NULL;
+}
+
+/* thrPoolWait() returns once every job has finished, those queued by jobs too. */
+static void
+testWait(void) {
+    threadPool_t *pool = thrPoolCreate(0, 4, 0, NULL);
+    int i;
+
+    atomic_store(&ran, 0);
+    for (i = 0; i < 100; i++) {
+        CHECK(thrPoolQueue(pool, queueOnward, NULL) == 0)
+    }
+    thrPoolWait(pool);
+    CHECK(atomic_load(&ran) == 200)
+    thrPoolDestroy(pool);
+}
+
+static atomic_int holding;
+static atomic_int finished;
+
+/* Holds its worker until cancelled. */
+static void *
+holdJob(void *arg) {
+    (void) arg;
+    atomic_store(&holding, 1);
+    for (;;)
+        usleep(1000000);
+    return NULL;
+}
+
+static void
+countFinished(void *arg) {
+    (void) arg;
+    atomic_fetch_add(&finished, 1);
+}
+
+/* Destroying a pool cancels the running job and completes the queued ones without running them. */
+static void
+testDestroy(void) {
+    threadPool_t *pool = thrPoolCreate(1, 1, 0, NULL);
+    int i;
+
+    atomic_store(&ran, 0);
+    atomic_store(&holding, 0);
+    atomic_store(&finished, 0);
+    CHECK(thrPoolQueueDone(pool, holdJob, NULL, countFinished, NULL) == 0)
+    for (i = 0; i < 500 && !atomic_load(&holding); i++)
+        usleep(10000);
+    for (i = 0; i < 10; i++) {
+        CHECK(thrPoolQueueDone(pool, countJob, NULL, countFinished, NULL) == 0)
+    }
+    thrPoolDestroy(pool);
+    CHECK(atomic_load(&ran) == 0)
+    CHECK(atomic_load(&finished) == 11)
+}
+
+/* The controller brings an idle pool down to its minimum and grows it under a backlog. */
+static void
+testAutoscale(void) {
+    threadPool_t *pool = thrPoolCreate(1, 4, 0, NULL);
+    thrPoolScale_t scale;
+    int i;
+
+    CHECK(thrPoolAutoscale(pool, 0, 20) == -1 && errno == EINVAL)
+    CHECK(thrPoolAutoscale(pool, 10, 20) == 0)
+    CHECK(thrPoolAutoscale(pool, 10, 20) == -1 && errno == EBUSY)
+    for (i = 0; i < 500; i++) {
+        thrPoolScaleStats(pool, &scale);
+        if (scale.scaleLimit == 1)
+            break;
+        usleep(10000);
+    }
+    CHECK(scale.scaleLimit == 1 && scale.scaleShrunk == 3)
+    atomic_store(&ran, 0);
+    for (i = 0; i < 40; i++) {
+        CHECK(thrPoolQueue(pool, sleepJob, (void *) 5000) == 0)
+    }
+    for (i = 0; i < 500; i++) {
+        thrPoolScaleStats(pool, &scale);
+        if (scale.scaleGrown > 0)
+            break;
+        usleep(10000);
+    }
+    CHECK(scale.scaleGrown > 0 && scale.scaleLimit > 1)
+    thrPoolWait(pool);
+    CHECK(atomic_load(&ran) == 40)
+    thrPoolDestroy(pool);
+}
+
+static atomic_int gate;
+
+/* Holds its worker until the gate opens, returning its argument. */
+static void *
+gateJob(void *arg) {
+    int i;
+
+    for (i = 0; i < 500 && !atomic_load(&gate); i++)
+        usleep(10000);
+    return arg;
+}
+
+/* A future yields what its job returned, a timed wait gives up on one still running. */
+static void
+testFutureWait(void) {
+    threadPool_t *pool = thrPoolCreate(0, 1, 0, NULL);
+    thrFuture_t *future;
+    void *result = NULL;
+    int value;
+
+    atomic_store(&gate, 0);
+    future = thrPoolSubmit(pool, gateJob, &value);
+    CHECK(future != NULL)
+    CHECK(thrFutureTimedWait(future, 20, &result) == -1 && errno == ETIMEDOUT)
+    CHECK(!thrFutureReady(future))
+    atomic_store(&gate, 1);
+    CHECK(thrFutureWait(future, &result) == 0 && result == &value)
+    CHECK(thrFutureReady(future))
+    thrFutureRelease(future);
+    thrPoolDestroy(pool);
+}
+
+static atomic_int thens;
+static int thenOrder[3];
+
+/* Notes the order it ran in, the future it follows has completed. */
+static void
+recordThen(thrFuture_t *future, void *arg) {
+    void *result = NULL;
+
+    thenOrder[atomic_fetch_add(&thens, 1)] = (int) (intptr_t) arg;
+    CHECK(thrFutureReady(future) && thrFutureWait(future, &result) == 0 && result == &gate)
+}
+
+/* Continuations run in the order they were added, at once if the future has completed. */
+static void
+testFutureThen(void) {
+    threadPool_t *pool = thrPoolCreate(0, 1, 0, NULL);
+    thrFuture_t *future;
+
+    atomic_store(&gate, 0);
+    atomic_store(&thens, 0);
+    future = thrPoolSubmit(pool, gateJob, &gate);
+    CHECK(future != NULL)
+    CHECK(thrFutureThen(future, recordThen, (void *) 1) == 0)
+    CHECK(thrFutureThen(future, recordThen, (void *) 2) == 0)
+    CHECK(atomic_load(&thens) == 0)
+    atomic_store(&gate, 1);
+    /* They run after the waiters are woken, but before the job counts as finished. */
+    thrPoolWait(pool);
+    CHECK(atomic_load(&thens) == 2 && thenOrder[0] == 1 && thenOrder[1] == 2)
+    CHECK(thrFutureThen(future, recordThen, (void *) 3) == 0)
+    CHECK(atomic_load(&thens) == 3 && thenOrder[2] == 3)
+    thrFutureRelease(future);
+    thrPoolDestroy(pool);
+}
+
+/* Waits on a job of its own, which only runs if the waiting worker helps. */
+static void *
+waitOnInner(void *arg) {
+    thrFuture_t *inner = thrPoolSubmit(thrPoolSelf(), gateJob, arg);
+    void *result = NULL;
+
+    CHECK(inner != NULL && thrFutureWait(inner, &result) == 0)
+    thrFutureRelease(inner);
+    return result;
+}
+
+/* A worker waiting on a future of its pool runs the queued jobs meanwhile. */
+static void
+testFutureHelp(void) {
+    threadPool_t *pool = thrPoolCreate(0, 1, 0, NULL);
+    thrFuture_t *future;
+    void *result = NULL;
+    int value;
+
+    atomic_store(&gate, 1);
+    future = thrPoolSubmit(pool, waitOnInner, &value);
+    CHECK(future != NULL && thrFutureTimedWait(future, 5000, &result) == 0 && result == &value)
+    thrFutureRelease(future);
+    thrPoolDestroy(pool);
+}
+
+/* A job dropped by thrPoolDestroy() completes its future as cancelled. */
+static void
+testFutureCancelled(void) {
+    threadPool_t *pool = thrPoolCreate(1, 1, 0, NULL);
+    thrFuture_t *future;
+    int i;
+
+    atomic_store(&holding, 0);
+    CHECK(thrPoolQueue(pool, holdJob, NULL) == 0)
+    for (i = 0; i < 500 && !atomic_load(&holding); i++)
+        usleep(10000);
+    future = thrPoolSubmit(pool, countJob, NULL);
+    CHECK(future != NULL)
+    thrPoolDestroy(pool);
+    CHECK(thrFutureReady(future))
+    CHECK(thrFutureWait(future, NULL) == -1 && errno == ECANCELED)
+    thrFutureRelease(future);
+}
+
+/* The counters of the kind of job with the given name, NULL if none. */
+static thrJobStats_t *
+findStats(thrPoolStats_t *stats, const char *name) {
+    int i;
+
+    for (i = 0; i < stats->statsNTypes; i++) {
+        if (strcmp(stats->statsTypes[i].jobName, name) == 0)
+            return &stats->statsTypes[i];
+    }
+    return NULL;
+}
+
+static unsigned long
+histogramCount(const unsigned long *histogram) {
+    unsigned long count = 0;
+    int b;
+
+    for (b = 0; b < THR_STATS_BUCKETS; b++)
+        count += histogram[b];
+    return count;
+}
+
+/*
+ * Jobs are counted by name or by function, and timed once the
+ * statistics have been asked for.
+ */
+static void
+testStats(void) {
+    static thrPoolStats_t stats;
+    threadPool_t *pool = thrPoolCreate(0, 2, 0, NULL);
+    thrJobStats_t *job;
+    char name[THR_STATS_NAME];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        CHECK(thrPoolQueueNamed(pool, "early", sleepJob, (void *) 1000, NULL, NULL) == 0)
+    }
+    thrPoolWait(pool);
+    thrPoolStats(pool, &stats);
+    CHECK((job = findStats(&stats, "early")) != NULL)
+    if (job != NULL) {
+        CHECK(job->jobQueued == 3 && job->jobStarted == 3 && job->jobFinished == 3)
+        CHECK(job->jobRunNs == 0 && histogramCount(job->jobRunHistogram) == 0)
+    }
+
+    for (i = 0; i < 10; i++) {
+        CHECK(thrPoolQueueNamed(pool, "sleeper", sleepJob, (void *) 2000, NULL, NULL) == 0)
+    }
+    for (i = 0; i < 5; i++) {
+        CHECK(thrPoolQueue(pool, countJob, NULL) == 0)
+    }
+    thrPoolWait(pool);
+    thrPoolStats(pool, &stats);
+    CHECK(stats.statsQueued == 0 && stats.statsRunning == 0 && stats.statsInjected == 0)
+    CHECK(stats.statsCreated >= 1 && stats.statsPeakThreads <= 2)
+    CHECK((job = findStats(&stats, "sleeper")) != NULL)
+    if (job != NULL) {
+        CHECK(job->jobQueued == 10 && job->jobStarted == 10 && job->jobFinished == 10)
+        CHECK(histogramCount(job->jobWaitHistogram) == 10 && histogramCount(job->jobRunHistogram) == 10)
+        CHECK(job->jobRunNs >= 10 * 2000000LL && job->jobMaxRunNs >= 2000000LL)
+        CHECK(job->jobMaxWaitNs <= job->jobWaitNs)
+        CHECK(thrStatsQuantile(job->jobRunHistogram, 1.0) >= 2048)
+    }
+    snprintf(name, sizeof(name), "%p", (void *) (uintptr_t) countJob);
+    CHECK((job = findStats(&stats, name)) != NULL)
+    if (job != NULL) {
+        CHECK(job->jobQueued == 5 && job->jobFinished == 5)
+    }
+    thrPoolDestroy(pool);
+}
+
+int
+main(void) {
+    loggerInit(1, 0);
+    sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+    RUN(testCpuList)
+    RUN(testCompact)
+    RUN(testInvalid)
+    RUN(testOverflow)
+    RUN(testSteal)
+    RUN(testPark)
+    RUN(testWait)
+    RUN(testDestroy)
+    RUN(testAutoscale)
+    RUN(testFutureWait)
+    RUN(testFutureThen)
+    RUN(testFutureHelp)
+    RUN(testFutureCancelled)
+    RUN(testStats)
+    return TEST_RESULT();
+}
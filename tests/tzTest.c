@@ -0,0 +1,65 @@
+//
+// Created by Matthew Johnson on 27/04/2020.
+// Copyright (c) 2020 LocalNetwork NZ. All rights reserved.
+//
+
+#include "../src/helpers/tz.h"
+#include "test.h"
+
+#define NZST 43200
+#define NZDT 46800
+
+static tzZone_t *zone;
+
+/* Within the explicit transitions of the slim file. */
+static void
+testTransitions(void) {
+    CHECK(tzOffset(zone, 1149120000) == NZST)  /* 2006-06-01 */
+    CHECK(tzOffset(zone, 1165017600) == NZDT)  /* 2006-12-02 */
+    CHECK(tzOffset(zone, 1174139999) == NZDT)  /* 2007-03-18 02:59:59 NZDT */
+    CHECK(tzOffset(zone, 1174140000) == NZST)  /* 2007-03-18 02:00:00 NZST */
+}
+
+/* Past the last transition the footer rule NZST-12NZDT,M9.5.0,M4.1.0/3 applies. */
+static void
+testFooter(void) {
+    CHECK(tzOffset(zone, 1590969600) == NZST)  /* 2020-06-01 */
+    CHECK(tzOffset(zone, 1606780800) == NZDT)  /* 2020-12-01 */
+    CHECK(tzOffset(zone, 1586008799) == NZDT)  /* 2020-04-05 02:59:59 NZDT */
+    CHECK(tzOffset(zone, 1586008800) == NZST)  /* 2020-04-05 02:00:00 NZST */
+    CHECK(tzOffset(zone, 1601128799) == NZST)  /* 2020-09-27 01:59:59 NZST */
+    CHECK(tzOffset(zone, 1601128800) == NZDT)  /* 2020-09-27 03:00:00 NZDT */
+    CHECK(tzOffset(zone, 1577836800) == NZDT)  /* 2020-01-01 across the new year */
+    CHECK(tzOffset(zone, 2153736000) == NZDT)  /* 2038-04-01 past 32 bit time */
+    CHECK(tzOffset(zone, 2161684800) == NZST)  /* 2038-07-02 */
+}
+
+/* Days are cut at local midnight whichever offset is in effect. */
+static void
+testTruncate(void) {
+    CHECK(tzTruncate(zone, 1590969600, 86400) == 1590926400)  /* 2020-06-01 00:00 NZST */
+    CHECK(tzTruncate(zone, 1606780800, 86400) == 1606734000)  /* 2020-12-01 00:00 NZDT */
+}
+
+/* On change days the bucket starts with the offset in effect at its start. */
+static void
+testTruncateChange(void) {
+    CHECK(tzTruncate(zone, 1601161200, 86400) == 1601121600)  /* 2020-09-27 12:00 NZDT -> 00:00 NZST */
+    CHECK(tzTruncate(zone, 1586044800, 86400) == 1585998000)  /* 2020-04-05 12:00 NZST -> 00:00 NZDT */
+    CHECK(tzTruncate(zone, 1586007000, 3600) == 1586005200)   /* 02:30 NZDT -> 02:00 NZDT */
+    CHECK(tzTruncate(zone, 1586010600, 3600) == 1586008800)   /* repeated 02:30 NZST -> 02:00 NZST */
+    CHECK(tzTruncate(zone, 1601128800, 3600) == 1601128800)   /* 03:00 NZDT, 02:00 was skipped */
+}
+
+int
+main(void) {
+    if ((zone = tzLoad("Pacific/Auckland")) == NULL) {
+        fprintf(stderr, "Could not load Pacific/Auckland, is TZDIR set to tests/data/zoneinfo?\n");
+        return EXIT_FAILURE;
+    }
+    RUN(testTransitions)
+    RUN(testFooter)
+    RUN(testTruncate)
+    RUN(testTruncateChange)
+    return TEST_RESULT();
+}